@@ -1,9 +1,12 @@
 #include <sfce.hh>
 #include <cparse.hh>
+#include <AVMAnalysis.hh>
 #include <errorHandler.hh>
+#include <algorithm>
 #include <numeric>
 #include <cmath>
 #include <bit>
+#include <optional>
 
 /*
  *
@@ -17,6 +20,8 @@ void AVM::AVMByteCodeDriver(FunctionAST* functionToBeTranslated) {
     auto* funcSymbol = parserState.globalSymbolTable[functionToBeTranslated->globalSymTableIdx];
     auto* prototype = dynamic_cast<FunctionPrototype*>(funcSymbol->type->declaratorPartList[1]);
     function->prototype = prototype;
+    function->isStatic = funcSymbol->type->isStatic();
+    function->isInline = funcSymbol->type->isInline();
     currentFunction = function;
     for (auto* i : prototype->types) {
         currentFunction->incomingSymbols.push_back(i);
@@ -77,6 +82,10 @@ std::string AVM::genCode(ASTNode *expr) {
             auto* dereference = new LoadMemoryInstruction;
             dereference->opcode = AVMOpcode::LD;
             dereference->addrVar = genCode(expr->left);
+            dereference->isVolatile = isVolatileAddress(expr->left);
+            // Semantic analysis leaves the type pointed to on the dereference
+            if (expr->type != nullptr)
+                dereference->accessType = expr->type->accessTypeAsString();
             dereference->dest = genTmpDest();
             currentBasicBlock->sequenceOfInstructions.push_back(dereference);
             return dereference->dest;
@@ -165,6 +174,19 @@ std::string AVM::genCode(ASTNode *expr) {
         }
         case A_MV:
         {
+            // Assigning through a pointer writes memory
+            if (expr->left->op == A_DEREF)
+            {
+                auto* storeInstruction = new StoreMemoryInstruction;
+                storeInstruction->opcode = AVMOpcode::ST;
+                storeInstruction->src = genCode(expr->right);
+                storeInstruction->addrVar = genCode(expr->left->left);
+                storeInstruction->isVolatile = isVolatileAddress(expr->left->left);
+                if (expr->left->type != nullptr)
+                    storeInstruction->accessType = expr->left->type->accessTypeAsString();
+                currentBasicBlock->sequenceOfInstructions.push_back(storeInstruction);
+                return {};
+            }
             auto* moveInstruction = new MoveInstruction;
             moveInstruction->valueToBeMoved = genCode(expr->right);
             moveInstruction->opcode = AVMOpcode::MV;
@@ -195,6 +217,65 @@ std::string AVM::genCode(ASTNode *expr) {
             currentBasicBlock->sequenceOfInstructions.push_back(gep);
             return gep->dest;
         }
+        case A_LAND:
+        case A_LOR:
+        {
+            // Used as a value: the left-hand side's truth value is the result when it decides it,
+            // otherwise the right-hand side is evaluated in a block of its own
+            auto registerTemporary = [&](const std::string& dest) {
+                auto* tempSymbol = new Symbol;
+                tempSymbol->type = new CType;
+                tempSymbol->identifier = dest;
+                tempSymbol->type->typeSpecifier.push_back({.token = INTEGER, .lexeme = "int", .lineNumber = 0});
+                parserState.globalSymbolTable.push_back(tempSymbol);
+                currentFunction->variablesInFunction.push_back(tempSymbol);
+            };
+            auto truthValue = [&](ASTNode* operand) {
+                std::string value = genCode(operand);
+                if (ASTopIsCMPOp(operand->op) || operand->op == A_LAND || operand->op == A_LOR)
+                    return value;
+                auto* comparisonInstruction = new ComparisonInstruction;
+                comparisonInstruction->compareCode = CMPCode::NEQ;
+                comparisonInstruction->op1 = value;
+                comparisonInstruction->op2 = "#0";
+                comparisonInstruction->opcode = AVMOpcode::CMP;
+                comparisonInstruction->dest = genTmpDest();
+                registerTemporary(comparisonInstruction->dest);
+                currentBasicBlock->sequenceOfInstructions.push_back(comparisonInstruction);
+                return comparisonInstruction->dest;
+            };
+            std::string result = genTmpDest();
+            registerTemporary(result);
+            auto* moveInstruction = new MoveInstruction;
+            moveInstruction->opcode = AVMOpcode::MV;
+            moveInstruction->valueToBeMoved = truthValue(expr->left);
+            moveInstruction->dest = result;
+            currentBasicBlock->sequenceOfInstructions.push_back(moveInstruction);
+
+            auto* rightBasicBlock = new AVMBasicBlock;
+            auto* continuation = new AVMBasicBlock;
+            rightBasicBlock->label = genLabel();
+            continuation->label = genLabel();
+            auto* branchInstruction = new BranchInstruction;
+            branchInstruction->opcode = AVMOpcode::BR;
+            branchInstruction->dependantComparison = moveInstruction->valueToBeMoved;
+            branchInstruction->trueTarget = expr->op == A_LAND ? rightBasicBlock->label : continuation->label;
+            branchInstruction->falseTarget = expr->op == A_LAND ? continuation->label : rightBasicBlock->label;
+            currentBasicBlock->sequenceOfInstructions.push_back(branchInstruction);
+
+            currentFunction->basicBlocksInFunction.push_back(rightBasicBlock);
+            currentBasicBlock = rightBasicBlock;
+            auto* secondMoveInstruction = new MoveInstruction;
+            secondMoveInstruction->opcode = AVMOpcode::MV;
+            secondMoveInstruction->valueToBeMoved = truthValue(expr->right);
+            secondMoveInstruction->dest = result;
+            currentBasicBlock->sequenceOfInstructions.push_back(secondMoveInstruction);
+            currentBasicBlock->sequenceOfInstructions.push_back(createUnconditionalBranch(continuation->label));
+
+            currentFunction->basicBlocksInFunction.push_back(continuation);
+            currentBasicBlock = continuation;
+            return result;
+        }
         case A_IFDECL:
         case A_WHILEBODY:
         case A_FORDECL:
@@ -231,7 +312,7 @@ std::string AVM::genCode(ASTNode *expr) {
                     if (expr->op == A_LNOT)
                     {
                         arithmeticInstruction->opcode = AVMOpcode::XOR;
-                        arithmeticInstruction->src2 = "18446744073709551615";
+                        arithmeticInstruction->src2 = makeAVMConstant(UINT64_MAX);
                     }
                 }
                 arithmeticInstruction->dest = genTmpDest();
@@ -267,18 +348,12 @@ std::vector<AVMBasicBlock*> AVM::newBasicBlockHandler(ASTNode *node, ASTNode *ne
     switch (node->op) {
         case A_IFDECL:
         {
-            auto* branchInstruction = new BranchInstruction;
-            branchInstruction->dependantComparison = genCode(node->left);
-            branchInstruction->opcode = AVMOpcode::BR;
-            branchInstruction->trueTarget = genLabel();
-            branchInstruction->falseTarget = genLabel();
-            currentBasicBlock->sequenceOfInstructions.push_back(branchInstruction);
-
             // Done with previous basic block
             auto* trueBasicBlock = new AVMBasicBlock;
             auto* falseBasicBlock = new AVMBasicBlock;
-            trueBasicBlock->label = branchInstruction->trueTarget;
-            falseBasicBlock->label = branchInstruction->falseTarget;
+            trueBasicBlock->label = genLabel();
+            falseBasicBlock->label = genLabel();
+            genBranch(node->left, trueBasicBlock->label, falseBasicBlock->label);
             currentFunction->basicBlocksInFunction.push_back(trueBasicBlock);
             currentFunction->basicBlocksInFunction.push_back(falseBasicBlock);
 
@@ -289,6 +364,8 @@ std::vector<AVMBasicBlock*> AVM::newBasicBlockHandler(ASTNode *node, ASTNode *ne
             {
                 basicBlocks = newBasicBlockHandler(node->right->left->op == A_CS ? node->right->left->left : node->right->left, nullptr, true);
             }
+            // The body may have ended in a block of its own, which is where it leaves from
+            trueBasicBlock = currentBasicBlock;
             string = "";
 
             currentBasicBlock = falseBasicBlock;
@@ -297,6 +374,7 @@ std::vector<AVMBasicBlock*> AVM::newBasicBlockHandler(ASTNode *node, ASTNode *ne
             std::vector<AVMBasicBlock*> basicBlocks2;
             if (string == "NBB")
                 basicBlocks2 = newBasicBlockHandler(node->right->right->op == A_CS ? node->right->right->left : node->right->right, nullptr, true);
+            falseBasicBlock = currentBasicBlock;
 
             basicBlocks.insert(basicBlocks.end(), basicBlocks2.begin(), basicBlocks2.end());
 
@@ -373,17 +451,18 @@ std::vector<AVMBasicBlock*> AVM::newBasicBlockHandler(ASTNode *node, ASTNode *ne
             auto* whileConditionTestBasicBlock = new AVMBasicBlock;
             whileConditionTestBasicBlock->label = branchInstruction->trueTarget;
             currentBasicBlock = whileConditionTestBasicBlock;
-            auto string = genCode(node->left);
-
-            auto branchInstruction2 = new BranchInstruction;
-            branchInstruction2->trueTarget = genLabel();
-            branchInstruction2->falseTarget = genLabel();
-            branchInstruction2->opcode = AVMOpcode::BR;
-            branchInstruction2->dependantComparison = string;
-            currentBasicBlock->sequenceOfInstructions.push_back(branchInstruction2);
 
             auto innerPartOfWhile = new AVMBasicBlock;
-            innerPartOfWhile->label = branchInstruction2->trueTarget;
+            auto* continuation = new AVMBasicBlock;
+            innerPartOfWhile->label = genLabel();
+            continuation->label = genLabel();
+            genBranch(node->left, innerPartOfWhile->label, continuation->label);
+
+            // The body becomes the header once the loop is rotated
+            if (node->value != 0) {
+                currentFunction->unrollPragmas[whileConditionTestBasicBlock->label] = node->value;
+                currentFunction->unrollPragmas[innerPartOfWhile->label] = node->value;
+            }
             currentBasicBlock = innerPartOfWhile;
             genCode(node->right);
 
@@ -392,10 +471,8 @@ std::vector<AVMBasicBlock*> AVM::newBasicBlockHandler(ASTNode *node, ASTNode *ne
             branchInstruction3->falseTarget = "NULL";
             branchInstruction3->dependantComparison = "#1";
             branchInstruction3->opcode = AVMOpcode::BR;
-            innerPartOfWhile->sequenceOfInstructions.push_back(branchInstruction3);
+            currentBasicBlock->sequenceOfInstructions.push_back(branchInstruction3);
 
-            auto* continuation = new AVMBasicBlock;
-            continuation->label = branchInstruction2->falseTarget;
             currentBasicBlock = continuation;
             genCode(nextBasicBlock);
             currentFunction->basicBlocksInFunction.push_back(whileConditionTestBasicBlock);
@@ -412,6 +489,64 @@ std::vector<AVMBasicBlock*> AVM::newBasicBlockHandler(ASTNode *node, ASTNode *ne
     }
 }
 
+/*
+ * void genBranch
+ *
+ * Emits code branching to trueTarget when the condition holds and to falseTarget otherwise.
+ * && and || are short-circuited: the left-hand side branches straight to a target when it
+ * decides the outcome, and the right-hand side is only evaluated, in a block of its own,
+ * when it does not. ! swaps the targets.
+ * */
+void AVM::genBranch(ASTNode *condition, const std::string& trueTarget, const std::string& falseTarget) {
+    if (condition->op == A_LAND || condition->op == A_LOR)
+    {
+        auto* rightBasicBlock = new AVMBasicBlock;
+        rightBasicBlock->label = genLabel();
+        if (condition->op == A_LAND)
+            genBranch(condition->left, rightBasicBlock->label, falseTarget);
+        else
+            genBranch(condition->left, trueTarget, rightBasicBlock->label);
+        currentFunction->basicBlocksInFunction.push_back(rightBasicBlock);
+        currentBasicBlock = rightBasicBlock;
+        genBranch(condition->right, trueTarget, falseTarget);
+        return;
+    }
+    if (condition->op == A_LNOT)
+    {
+        genBranch(condition->left, falseTarget, trueTarget);
+        return;
+    }
+    auto* branchInstruction = new BranchInstruction;
+    branchInstruction->opcode = AVMOpcode::BR;
+    branchInstruction->dependantComparison = genCode(condition);
+    branchInstruction->trueTarget = trueTarget;
+    branchInstruction->falseTarget = falseTarget;
+    currentBasicBlock->sequenceOfInstructions.push_back(branchInstruction);
+}
+
+/*
+ * bool isVolatileAddress
+ *
+ * Whether memory at an address computed by the expression may be volatile, going by the types
+ * of the variables it uses. A variable with volatile anywhere in its type is enough.
+ * */
+bool AVM::isVolatileAddress(ASTNode* expr) {
+    if (expr == nullptr)
+        return false;
+    if (expr->op == A_IDENT)
+    {
+        std::vector<Symbol*> candidates = currentFunction->variablesInFunction;
+        candidates.insert(candidates.end(), currentFunction->incomingSymbols.begin(), currentFunction->incomingSymbols.end());
+        candidates.insert(candidates.end(), globalSyms.begin(), globalSyms.end());
+        for (auto* symbol : candidates)
+        {
+            if (symbol->identifier == expr->identifier && symbol->type != nullptr && symbol->type->isVolatile())
+                return true;
+        }
+    }
+    return isVolatileAddress(expr->left) || isVolatileAddress(expr->right);
+}
+
 bool isPowerOfTwo(u64 val)
 {
     return std::__popcount(val) == 1;
@@ -422,127 +557,285 @@ bool isPowerOfTwo(u64 val)
  * This function performs all available optimisations on AVM IR, on a per-function basis
  * */
 void AVM::avmOptimiseFunction(AVMFunction* function) {
+    optInlineCalls(function);
+    optEliminateTailRecursion(function);
     for (auto it : function->basicBlocksInFunction)
-    {
-        optMulToShift(it);
-        optDivToShift(it);
         optFoldConstants(it);
+    optSimplifyControlFlow(function);
+    optRotateLoops(function);
+    // Passes run between these two calls see the function in SSA form
+    constructSSA(function);
+    optPropagateConstants(function);
+    copyPropagation(function);
+    optEliminateRedundantLoads(function);
+    optCombineInstructions(function);
+    optGlobalValueNumbering(function);
+    optPromoteGlobalsInLoops(function);
+    optHoistLoopInvariants(function);
+    optUnswitchLoops(function);
+    optStrengthReduceInductionVariables(function);
+    optUnrollLoops(function);
+    // Unrolled copies of a loop can often be folded together
+    optPropagateConstants(function);
+    copyPropagation(function);
+    optEliminateRedundantLoads(function);
+    optCombineInstructions(function);
+    // Multipliers and divisors are best known once constants have been propagated
+    for (auto it : function->basicBlocksInFunction)
+    {
+        optMulByConstant(it);
+        optDivByConstant(it);
     }
+    optGlobalValueNumbering(function);
+    optEliminateDeadStores(function);
+    optCombineBranchConditions(function);
+    optConvertIfsToSelects(function);
+    optEliminateDeadCode(function);
+    destructSSA(function);
+    optSimplifyControlFlow(function);
+    layoutBlocks(function);
 }
 /*
- * Convert multiplications where the multiplicand is a power of two into a shift,
- * performed on a per-basic block basis.
- * This function uses the commutative property of multiplication to reorder
- * cases where the multiplier is a power of two and turn that into a multiplicand
+ * void avmOptimiseCompilationUnit
+ *
+ * Optimises every function in turn, so callees defined before their callers are inlined
+ * already optimised, then drops static functions that are no longer called.
  * */
-void AVM::optMulToShift(AVMBasicBlock *basicBlock) {
-    std::vector<ArithmeticInstruction*> multiplies;
-    std::vector<u64> indexes;
-
-    for (auto x = 0; x < basicBlock->sequenceOfInstructions.size(); x++) // Loop through basic block and find any relevant multiplies
+void AVM::avmOptimiseCompilationUnit() {
+    for (auto* function : compilationUnit)
     {
-        auto* it = basicBlock->sequenceOfInstructions.at(x);
-        if (it->getInstructionType() == AVMInstructionType::ARITHMETIC)
+        avmOptimiseFunction(function);
+    }
+    std::set<std::string> called;
+    for (auto* function : compilationUnit)
+    {
+        for (auto* basicBlock : function->basicBlocksInFunction)
         {
-            auto* instruction = dynamic_cast<ArithmeticInstruction*>(it);
-            if (it->opcode == AVMOpcode::MUL) {
-                multiplies.push_back(instruction);
-                indexes.push_back(x);
+            for (auto* instruction : basicBlock->sequenceOfInstructions)
+            {
+                if (instruction->getInstructionType() == AVMInstructionType::CALL)
+                    called.insert(dynamic_cast<CallInstruction*>(instruction)->funcName);
             }
         }
     }
+    compilationUnit.erase(std::remove_if(compilationUnit.begin(), compilationUnit.end(), [&](AVMFunction* function) {
+        if (!function->isStatic || called.count("@" + function->name))
+            return false;
+        delete function;
+        return true;
+    }), compilationUnit.end());
+}
+/*
+ * Latencies in cycles of the ARMv8 instructions a multiplication by a constant can be built from,
+ * as on Cortex-A72. An add or subtract whose second operand is shifted, which the code generator
+ * emits for a shift feeding straight into it, takes shiftedOperandLatency.
+ * */
+static const std::unordered_map<AVMOpcode, u32> ARMv8Latency {
+        {AVMOpcode::ADD, 1},
+        {AVMOpcode::SUB, 1},
+        {AVMOpcode::SLL, 1},
+        {AVMOpcode::MUL, 4}
+};
+static const u32 shiftedOperandLatency = 2;
 
-    for (auto x = 0; x < multiplies.size(); x++)
-    {
-        auto* it = multiplies.at(x);
-        bool multiplicandIsConstant = false;
-        u64 multiplicandValue = 0;
-        u64 multiplicandPos = 0;
-        bool multiplierIsConstant = false;
-        u64 multiplierValue = 0;
-        u64 multiplierPos = 0;
-
-        if (it->src2.at(0) == '#')
-        {
-            multiplierIsConstant = true;
-            std::string tmp;
-            tmp.append(it->src2);
-            tmp.erase(0, 1);
-            multiplierValue = std::stoull(tmp);
-        }
-        if (it->src1.at(0) == '#')
-        {
-            multiplicandIsConstant = true;
-            std::string tmp;
-            tmp.append(it->src1);
-            tmp.erase(0, 1);
-            multiplicandValue = std::stoull(tmp);
-        }
+/*
+ * Shift and add sequences for multiplying by an odd constant o, the product then being shifted
+ * left by the constant's trailing zeros:
+ *   ShiftAdd: o = 2^a + 1  x + (x << a)
+ *   ShiftSub: o = 2^a - 1  (x << a) - x
+ * */
+enum class MulDecomposition {
+    ShiftAdd,
+    ShiftSub
+};
 
-        if (multiplierIsConstant && isPowerOfTwo(multiplierValue))
-        {
-            std::string tmp;
-            tmp.append("#");
-            tmp.append(std::to_string((u64)std::trunc(std::log2(multiplierValue))));
-            it->src2 = tmp;
-            it->opcode = AVMOpcode::SLL;
-        } else if (multiplicandIsConstant && isPowerOfTwo(multiplicandValue))
-        {
-            it->src1 = it->src2;
-            std::string tmp;
-            tmp.append("#");
-            tmp.append(std::to_string((u64)std::trunc(std::log2(multiplicandValue))));
-            it->src2 = tmp;
+/*
+ * Replaces multiplications by a constant with shifts, adds and subtracts.
+ *
+ * A power of two becomes a single shift. Any other constant is decomposed into the cheapest of the
+ * MulDecomposition sequences that fits it, going by ARMv8Latency along the sequence's critical
+ * path, which is used when it beats the latency of mul: x * 10 becomes (x + (x << 2)) << 1 and
+ * x * 7 becomes (x << 3) - x.
+ * */
+void AVM::optMulByConstant(AVMBasicBlock *basicBlock) {
+    auto& sequence = basicBlock->sequenceOfInstructions;
+    for (auto x = 0; x < sequence.size(); x++)
+    {
+        if (sequence.at(x)->getInstructionType() != AVMInstructionType::ARITHMETIC || sequence.at(x)->opcode != AVMOpcode::MUL)
+            continue;
+        auto* it = dynamic_cast<ArithmeticInstruction*>(sequence.at(x));
+        if (isAVMConstant(it->src1) && !isAVMConstant(it->src2))
+            std::swap(it->src1, it->src2);
+        if (isAVMConstant(it->src1) || !isAVMConstant(it->src2))
+            continue;
+        u64 multiplier = getAVMConstant(it->src2);
+        if (multiplier == 0)
+            continue;
+        u32 zeros = std::__countr_zero(multiplier);
+        if (isPowerOfTwo(multiplier))
+        {
+            it->src2 = makeAVMConstant(zeros);
             it->opcode = AVMOpcode::SLL;
-        }
+            continue;
+        }
+
+        u64 odd = multiplier >> zeros;
+        u32 best = ARMv8Latency.at(AVMOpcode::MUL);
+        std::optional<MulDecomposition> decomposition;
+        u32 shift = 0;
+        auto consider = [&](MulDecomposition candidate, u32 latency, u32 amount) {
+            if (zeros != 0)
+                latency += ARMv8Latency.at(AVMOpcode::SLL);
+            if (latency >= best)
+                return;
+            best = latency;
+            decomposition = candidate;
+            shift = amount;
+        };
+        if (isPowerOfTwo(odd - 1))
+            consider(MulDecomposition::ShiftAdd, shiftedOperandLatency, std::__countr_zero(odd - 1));
+        if (isPowerOfTwo(odd + 1))
+            consider(MulDecomposition::ShiftSub, ARMv8Latency.at(AVMOpcode::SLL) + ARMv8Latency.at(AVMOpcode::SUB),
+                     std::__countr_zero(odd + 1));
+        if (!decomposition)
+            continue;
+
+        std::vector<AVMInstruction*> replacement;
+        auto emit = [&](AVMOpcode opcode, const std::string& src1, const std::string& src2) {
+            std::string dest = genSSAName("m");
+            replacement.push_back(createArithmetic(opcode, dest, src1, src2));
+            return dest;
+        };
+        std::string product;
+        switch (*decomposition) {
+            case MulDecomposition::ShiftAdd:
+                product = emit(AVMOpcode::ADD, it->src1, emit(AVMOpcode::SLL, it->src1, makeAVMConstant(shift)));
+                break;
+            case MulDecomposition::ShiftSub:
+                product = emit(AVMOpcode::SUB, emit(AVMOpcode::SLL, it->src1, makeAVMConstant(shift)), it->src1);
+                break;
+        }
+        if (zeros != 0)
+            emit(AVMOpcode::SLL, product, makeAVMConstant(zeros));
+        dynamic_cast<ArithmeticInstruction*>(replacement.back())->dest = it->dest;
+        delete it;
+        sequence.erase(sequence.begin() + x);
+        sequence.insert(sequence.begin() + x, replacement.begin(), replacement.end());
+        x += replacement.size() - 1;
     }
 }
 /*
- * In cases where the divisor is a power of two, converts divisions into right shifts
+ * How an unsigned division by a constant that is not a power of two is done with a multiplication
+ * (Granlund and Montgomery, "Division by Invariant Integers using Multiplication"):
+ *   q = mulh(x >> preShift, multiplier) >> postShift
+ * or, when no multiplier fits in 64 bits,
+ *   t = mulh(x, multiplier); q = (t + ((x - t) >> 1)) >> postShift
  * */
-void AVM::optDivToShift(AVMBasicBlock* basicBlock)
-{
-    std::vector<ArithmeticInstruction*> divides;
-    std::vector<u64> indexes;
+struct MagicDivisor {
+    u64 multiplier;
+    u32 preShift;
+    u32 postShift;
+    bool needsAdd;
+};
 
-    for (auto x = 0; x < basicBlock->sequenceOfInstructions.size(); x++) // Loop through basic block and find any relevant multiplies
+/*
+ * A multiplier m and shift s give floor(x / d) for every x below 2^N when
+ * 2^(64+s) <= m * d <= 2^(64+s) + 2^(64+s-N). The smallest such shift is searched for, first with
+ * the full 64-bit dividend and then, for an even divisor, with the dividend shifted right by the
+ * divisor's trailing zeros, which leaves more room for the multiplier.
+ * */
+static MagicDivisor computeMagicDivisor(u64 divisor) {
+    for (u32 preShift : {0, std::__countr_zero(divisor)})
     {
-        auto* it = basicBlock->sequenceOfInstructions.at(x);
-        if (it->getInstructionType() == AVMInstructionType::ARITHMETIC)
+        u64 odd = divisor >> preShift;
+        for (u32 postShift = 0; postShift < 64; postShift++)
         {
-            auto* instruction = dynamic_cast<ArithmeticInstruction*>(it);
-            if (it->opcode == AVMOpcode::DIV) {
-                divides.push_back(instruction);
-                indexes.push_back(x);
-            }
+            unsigned __int128 power = (unsigned __int128)1 << (64 + postShift);
+            unsigned __int128 multiplier = (power + odd - 1) / odd;
+            if (multiplier >> 64)
+                break;
+            if (multiplier * odd - power <= (unsigned __int128)1 << (postShift + preShift))
+                return {(u64)multiplier, preShift, postShift, false};
         }
     }
+    u32 log = 64 - std::__countl_zero(divisor - 1);
+    unsigned __int128 multiplier = (((unsigned __int128)1 << 64) * (((unsigned __int128)1 << log) - divisor)) / divisor + 1;
+    return {(u64)multiplier, 0, log - 1, true};
+}
 
-    for (auto x = 0; x < divides.size(); x++)
+/*
+ * Replaces divisions and remainders by a constant, as udiv takes tens of cycles.
+ *
+ * A division by a power of two becomes a logical right shift and a remainder by one becomes a
+ * mask. Any other divisor is divided by with a multiply-high and shifts, as worked out by
+ * computeMagicDivisor, and the remainder is then x - q * d, which the code generator emits as a
+ * single msub. All division in AVM is unsigned.
+ * */
+void AVM::optDivByConstant(AVMBasicBlock* basicBlock)
+{
+    auto& sequence = basicBlock->sequenceOfInstructions;
+    for (auto x = 0; x < sequence.size(); x++)
     {
-        auto* it = divides.at(x);
-        bool divisorIsConstant = false;
-        u64 divisorValue = 0;
-
-        if (it->src2.at(0) == '#')
-        {
-            divisorIsConstant = true;
-            std::string tmp;
-            tmp.append(it->src2);
-            tmp.erase(0, 1);
-            divisorValue = std::stoull(tmp);
-        }
-        if (divisorIsConstant && isPowerOfTwo(divisorValue))
+        if (sequence.at(x)->getInstructionType() != AVMInstructionType::ARITHMETIC)
+            continue;
+        auto* it = dynamic_cast<ArithmeticInstruction*>(sequence.at(x));
+        if ((it->opcode != AVMOpcode::DIV && it->opcode != AVMOpcode::MOD) || !isAVMConstant(it->src2) || isAVMConstant(it->src1))
+            continue;
+        u64 divisor = getAVMConstant(it->src2);
+        if (divisor < 2)
+            continue;
+        if (isPowerOfTwo(divisor))
         {
-            std::string tmp;
-            tmp.append("#");
-            tmp.append(std::to_string((u64)std::trunc(std::log2(divisorValue))));
-            it->src2 = tmp;
-            it->opcode = AVMOpcode::ASR;
+            if (it->opcode == AVMOpcode::DIV) {
+                it->opcode = AVMOpcode::SLR;
+                it->src2 = makeAVMConstant(std::__countr_zero(divisor));
+            }
+            else {
+                it->opcode = AVMOpcode::AND;
+                it->src2 = makeAVMConstant(divisor - 1);
+            }
+            continue;
         }
+
+        auto magic = computeMagicDivisor(divisor);
+        std::vector<AVMInstruction*> replacement;
+        std::string dividend = it->src1;
+        auto emit = [&](AVMOpcode opcode, const std::string& src1, const std::string& src2) {
+            std::string dest = genSSAName("q");
+            replacement.push_back(createArithmetic(opcode, dest, src1, src2));
+            return dest;
+        };
+        std::string quotient = dividend;
+        if (magic.preShift != 0)
+            quotient = emit(AVMOpcode::SLR, quotient, makeAVMConstant(magic.preShift));
+        quotient = emit(AVMOpcode::MULH, quotient, makeAVMConstant(magic.multiplier));
+        if (magic.needsAdd)
+        {
+            std::string difference = emit(AVMOpcode::SUB, dividend, quotient);
+            difference = emit(AVMOpcode::SLR, difference, "#1");
+            quotient = emit(AVMOpcode::ADD, quotient, difference);
+        }
+        if (magic.postShift != 0)
+            quotient = emit(AVMOpcode::SLR, quotient, makeAVMConstant(magic.postShift));
+        if (it->opcode == AVMOpcode::MOD)
+        {
+            std::string product = emit(AVMOpcode::MUL, quotient, it->src2);
+            replacement.push_back(createArithmetic(AVMOpcode::SUB, it->dest, dividend, product));
+        }
+        else {
+            dynamic_cast<ArithmeticInstruction*>(replacement.back())->dest = it->dest;
+        }
+        delete it;
+        sequence.erase(sequence.begin() + x);
+        sequence.insert(sequence.begin() + x, replacement.begin(), replacement.end());
+        x += replacement.size() - 1;
     }
 }
 
+/*
+ * Evaluates an AVM operation the way the generated ARMv8 code would: on 64-bit values,
+ * with shift amounts taken modulo 64 and division by zero giving zero.
+ * */
 u64 performCalculation(AVMOpcode opcode, u64 operand1, u64 operand2)
 {
     switch (opcode) {
@@ -558,23 +851,31 @@ u64 performCalculation(AVMOpcode opcode, u64 operand1, u64 operand2)
         {
             return operand1 * operand2;
         }
+        case AVMOpcode::MULH:
+        {
+            return (u64)(((unsigned __int128)operand1 * operand2) >> 64);
+        }
         case AVMOpcode::DIV: {
+            if (operand2 == 0)
+                return 0;
             return operand1 / operand2;
         }
         case AVMOpcode::MOD:
         {
+            if (operand2 == 0)
+                return operand1;
             return operand1 % operand2;
         }
         case AVMOpcode::SLL:
         {
-            return operand1 << operand2;
+            return operand1 << (operand2 & 63);
         }
         case AVMOpcode::SLR:
         {
-            return operand1 >> operand2;
+            return operand1 >> (operand2 & 63);
         }
         case AVMOpcode::ASR: {
-            return (signed)operand1 >> operand2;
+            return (i64)operand1 >> (operand2 & 63);
         }
         case AVMOpcode::AND:
         {
@@ -593,6 +894,29 @@ u64 performCalculation(AVMOpcode opcode, u64 operand1, u64 operand2)
     }
 }
 
+/*
+ * Comparisons are unsigned, matching the condition codes chosen by the code generator
+ * */
+bool performComparison(CMPCode code, u64 operand1, u64 operand2)
+{
+    switch (code) {
+        case CMPCode::LT:
+            return operand1 < operand2;
+        case CMPCode::MT:
+            return operand1 > operand2;
+        case CMPCode::LTEQ:
+            return operand1 <= operand2;
+        case CMPCode::MTEQ:
+            return operand1 >= operand2;
+        case CMPCode::EQ:
+            return operand1 == operand2;
+        case CMPCode::NEQ:
+            return operand1 != operand2;
+        default:
+            return false;
+    }
+}
+
 /*
  * Inspect each arithmetic instruction and eliminate any calculation of constants at runtime
  * */
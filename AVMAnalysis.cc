@@ -0,0 +1,1348 @@
+#include <AVMAnalysis.hh>
+#include <cctype>
+#include <algorithm>
+#include <deque>
+#include <map>
+
+bool isAVMConstant(const std::string& operand) {
+    if (operand.empty())
+        return false;
+    return operand.at(0) == '#' || std::isdigit(operand.at(0));
+}
+
+bool isAVMLocalVariable(const std::string& operand) {
+    if (operand.empty() || isAVMConstant(operand))
+        return false;
+    return operand.at(0) != '@' && operand.at(0) != '!';
+}
+
+u64 getAVMConstant(const std::string& operand) {
+    if (operand.at(0) == '#')
+        return std::stoull(operand.substr(1));
+    return std::stoull(operand);
+}
+
+std::string makeAVMConstant(u64 value) {
+    std::string tmp;
+    tmp.append("#");
+    tmp.append(std::to_string(value));
+    return tmp;
+}
+
+bool isCommutative(AVMOpcode opcode) {
+    switch (opcode) {
+        case AVMOpcode::ADD:
+        case AVMOpcode::MUL:
+        case AVMOpcode::MULH:
+        case AVMOpcode::AND:
+        case AVMOpcode::XOR:
+        case AVMOpcode::ORR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+CMPCode invertComparison(CMPCode code) {
+    switch (code) {
+        case CMPCode::LT:
+            return CMPCode::MTEQ;
+        case CMPCode::MT:
+            return CMPCode::LTEQ;
+        case CMPCode::LTEQ:
+            return CMPCode::MT;
+        case CMPCode::MTEQ:
+            return CMPCode::LT;
+        case CMPCode::EQ:
+            return CMPCode::NEQ;
+        case CMPCode::NEQ:
+            return CMPCode::EQ;
+        default:
+            return code;
+    }
+}
+
+CMPCode swapComparison(CMPCode code) {
+    switch (code) {
+        case CMPCode::LT:
+            return CMPCode::MT;
+        case CMPCode::MT:
+            return CMPCode::LT;
+        case CMPCode::LTEQ:
+            return CMPCode::MTEQ;
+        case CMPCode::MTEQ:
+            return CMPCode::LTEQ;
+        default:
+            return code;
+    }
+}
+
+std::string* getInstructionDestination(AVMInstruction* instruction) {
+    switch (instruction->getInstructionType()) {
+        case AVMInstructionType::ARITHMETIC:
+            return &dynamic_cast<ArithmeticInstruction*>(instruction)->dest;
+        case AVMInstructionType::LOAD:
+            return &dynamic_cast<LoadMemoryInstruction*>(instruction)->dest;
+        case AVMInstructionType::GEP:
+            return &dynamic_cast<GetElementPtr*>(instruction)->dest;
+        case AVMInstructionType::CMP:
+            return &dynamic_cast<ComparisonInstruction*>(instruction)->dest;
+        case AVMInstructionType::CALL: {
+            auto& returnVal = dynamic_cast<CallInstruction*>(instruction)->returnVal;
+            return returnVal.empty() ? nullptr : &returnVal;
+        }
+        case AVMInstructionType::MV:
+            return &dynamic_cast<MoveInstruction*>(instruction)->dest;
+        case AVMInstructionType::PHI:
+            return &dynamic_cast<PhiInstruction*>(instruction)->dest;
+        case AVMInstructionType::CSEL:
+            return &dynamic_cast<CSELInstruction*>(instruction)->dest;
+        default:
+            return nullptr;
+    }
+}
+
+std::vector<std::string*> getInstructionOperands(AVMInstruction* instruction) {
+    std::vector<std::string*> operands;
+    switch (instruction->getInstructionType()) {
+        case AVMInstructionType::ARITHMETIC: {
+            auto* arithmeticInstruction = dynamic_cast<ArithmeticInstruction*>(instruction);
+            operands.push_back(&arithmeticInstruction->src1);
+            operands.push_back(&arithmeticInstruction->src2);
+            break;
+        }
+        case AVMInstructionType::LOAD:
+            operands.push_back(&dynamic_cast<LoadMemoryInstruction*>(instruction)->addrVar);
+            break;
+        case AVMInstructionType::STORE: {
+            auto* storeInstruction = dynamic_cast<StoreMemoryInstruction*>(instruction);
+            operands.push_back(&storeInstruction->src);
+            operands.push_back(&storeInstruction->addrVar);
+            break;
+        }
+        case AVMInstructionType::CMP: {
+            auto* comparisonInstruction = dynamic_cast<ComparisonInstruction*>(instruction);
+            operands.push_back(&comparisonInstruction->op1);
+            operands.push_back(&comparisonInstruction->op2);
+            break;
+        }
+        case AVMInstructionType::BRANCH: {
+            auto* branchInstruction = dynamic_cast<BranchInstruction*>(instruction);
+            if (branchInstruction->falseTarget != "NULL")
+                operands.push_back(&branchInstruction->dependantComparison);
+            break;
+        }
+        case AVMInstructionType::CALL:
+            for (auto& i : dynamic_cast<CallInstruction*>(instruction)->args)
+                operands.push_back(&i);
+            break;
+        case AVMInstructionType::RET: {
+            auto* retInstruction = dynamic_cast<RetInstruction*>(instruction);
+            if (!retInstruction->value.empty())
+                operands.push_back(&retInstruction->value);
+            break;
+        }
+        case AVMInstructionType::MV:
+            operands.push_back(&dynamic_cast<MoveInstruction*>(instruction)->valueToBeMoved);
+            break;
+        case AVMInstructionType::PHI:
+            for (auto& i : dynamic_cast<PhiInstruction*>(instruction)->incoming)
+                operands.push_back(&i.first);
+            break;
+        case AVMInstructionType::CSEL: {
+            auto* selectInstruction = dynamic_cast<CSELInstruction*>(instruction);
+            operands.push_back(&selectInstruction->condition);
+            operands.push_back(&selectInstruction->trueValue);
+            operands.push_back(&selectInstruction->falseValue);
+            break;
+        }
+        default:
+            break;
+    }
+    return operands;
+}
+
+AVMInstruction* cloneInstruction(AVMInstruction* instruction) {
+    switch (instruction->getInstructionType()) {
+        case AVMInstructionType::ARITHMETIC:
+            return new ArithmeticInstruction(*dynamic_cast<ArithmeticInstruction*>(instruction));
+        case AVMInstructionType::LOAD:
+            return new LoadMemoryInstruction(*dynamic_cast<LoadMemoryInstruction*>(instruction));
+        case AVMInstructionType::STORE:
+            return new StoreMemoryInstruction(*dynamic_cast<StoreMemoryInstruction*>(instruction));
+        case AVMInstructionType::GEP:
+            return new GetElementPtr(*dynamic_cast<GetElementPtr*>(instruction));
+        case AVMInstructionType::CMP:
+            return new ComparisonInstruction(*dynamic_cast<ComparisonInstruction*>(instruction));
+        case AVMInstructionType::BRANCH:
+            return new BranchInstruction(*dynamic_cast<BranchInstruction*>(instruction));
+        case AVMInstructionType::CALL:
+            return new CallInstruction(*dynamic_cast<CallInstruction*>(instruction));
+        case AVMInstructionType::RET:
+            return new RetInstruction(*dynamic_cast<RetInstruction*>(instruction));
+        case AVMInstructionType::MV:
+            return new MoveInstruction(*dynamic_cast<MoveInstruction*>(instruction));
+        case AVMInstructionType::ALLOCA:
+            return new AllocaInstruction(*dynamic_cast<AllocaInstruction*>(instruction));
+        case AVMInstructionType::PHI:
+            return new PhiInstruction(*dynamic_cast<PhiInstruction*>(instruction));
+        case AVMInstructionType::CSEL:
+            return new CSELInstruction(*dynamic_cast<CSELInstruction*>(instruction));
+        case AVMInstructionType::END:
+            return new ProgramEndInstruction(*dynamic_cast<ProgramEndInstruction*>(instruction));
+    }
+    return nullptr;
+}
+
+AVMInstruction* getTerminator(AVMBasicBlock* basicBlock) {
+    if (basicBlock->sequenceOfInstructions.empty())
+        return nullptr;
+    auto* last = basicBlock->sequenceOfInstructions.back();
+    if (last->getInstructionType() == AVMInstructionType::BRANCH || last->getInstructionType() == AVMInstructionType::RET)
+        return last;
+    return nullptr;
+}
+
+std::vector<std::string> getBranchTargets(AVMBasicBlock* basicBlock) {
+    auto* terminator = getTerminator(basicBlock);
+    if (terminator == nullptr || terminator->getInstructionType() != AVMInstructionType::BRANCH)
+        return {};
+    auto* branchInstruction = dynamic_cast<BranchInstruction*>(terminator);
+    std::vector<std::string> targets{branchInstruction->trueTarget};
+    if (branchInstruction->falseTarget != "NULL" && branchInstruction->falseTarget != branchInstruction->trueTarget)
+        targets.push_back(branchInstruction->falseTarget);
+    return targets;
+}
+
+void retargetBranch(AVMBasicBlock* basicBlock, const std::string& from, const std::string& to) {
+    auto* terminator = getTerminator(basicBlock);
+    if (terminator == nullptr || terminator->getInstructionType() != AVMInstructionType::BRANCH)
+        return;
+    auto* branchInstruction = dynamic_cast<BranchInstruction*>(terminator);
+    if (branchInstruction->trueTarget == from)
+        branchInstruction->trueTarget = to;
+    if (branchInstruction->falseTarget == from)
+        branchInstruction->falseTarget = to;
+}
+
+BranchInstruction* createUnconditionalBranch(const std::string& target) {
+    auto* branchInstruction = new BranchInstruction;
+    branchInstruction->opcode = AVMOpcode::BR;
+    branchInstruction->dependantComparison = "#1";
+    branchInstruction->trueTarget = target;
+    branchInstruction->falseTarget = "NULL";
+    return branchInstruction;
+}
+
+MoveInstruction* createMove(const std::string& dest, const std::string& value) {
+    auto* moveInstruction = new MoveInstruction;
+    moveInstruction->opcode = AVMOpcode::MV;
+    moveInstruction->dest = dest;
+    moveInstruction->valueToBeMoved = value;
+    return moveInstruction;
+}
+
+ArithmeticInstruction* createArithmetic(AVMOpcode opcode, const std::string& dest, const std::string& src1, const std::string& src2) {
+    auto* arithmeticInstruction = new ArithmeticInstruction;
+    arithmeticInstruction->opcode = opcode;
+    arithmeticInstruction->dest = dest;
+    arithmeticInstruction->src1 = src1;
+    arithmeticInstruction->src2 = src2;
+    return arithmeticInstruction;
+}
+
+u64 getInitialValue(AVMFunction* function, const std::string& local) {
+    for (auto* symbol : function->variablesInFunction)
+    {
+        if (symbol->identifier == local)
+            return symbol->value;
+    }
+    return 0;
+}
+
+void insertBeforeTerminator(AVMBasicBlock* basicBlock, AVMInstruction* instruction) {
+    auto& sequence = basicBlock->sequenceOfInstructions;
+    if (getTerminator(basicBlock) != nullptr)
+        sequence.insert(sequence.end()-1, instruction);
+    else
+        sequence.push_back(instruction);
+}
+
+/*
+ * Puts a function's blocks into the shape the optimisation passes expect.
+ * Anything after a block's first branch or return can never execute and is deleted, and every
+ * block that falls through to its layout successor is given an explicit branch, so blocks can be
+ * reordered or inserted without changing control flow. Only the last block may still fall through,
+ * into the function epilogue.
+ * */
+void normaliseControlFlow(AVMFunction* function) {
+    auto& blocks = function->basicBlocksInFunction;
+    for (auto* basicBlock : blocks)
+    {
+        auto& sequence = basicBlock->sequenceOfInstructions;
+        for (auto x = 0; x < sequence.size(); x++)
+        {
+            auto type = sequence.at(x)->getInstructionType();
+            if (type != AVMInstructionType::BRANCH && type != AVMInstructionType::RET)
+                continue;
+            for (auto y = x + 1; y < sequence.size(); y++)
+                delete sequence.at(y);
+            sequence.erase(sequence.begin()+x+1, sequence.end());
+            break;
+        }
+    }
+    for (auto x = 0; x + 1 < blocks.size(); x++)
+    {
+        if (getTerminator(blocks.at(x)) == nullptr)
+            blocks.at(x)->sequenceOfInstructions.push_back(createUnconditionalBranch(blocks.at(x+1)->label));
+    }
+}
+
+/*
+ * Deletes blocks that cannot be reached from the entry block, and drops phi operands
+ * flowing in from them. Returns true if anything was removed.
+ * */
+bool removeUnreachableBlocks(AVMFunction* function) {
+    AVMControlFlowGraph cfg(function);
+    std::vector<AVMBasicBlock*> keep;
+    std::set<std::string> removedLabels;
+    for (auto x = 0; x < cfg.blocks.size(); x++)
+    {
+        if (cfg.reachable.at(x))
+            keep.push_back(cfg.blocks.at(x));
+        else
+            removedLabels.insert(cfg.blocks.at(x)->label);
+    }
+    if (removedLabels.empty())
+        return false;
+    for (auto* basicBlock : keep)
+    {
+        for (auto* instruction : basicBlock->sequenceOfInstructions)
+        {
+            if (instruction->getInstructionType() != AVMInstructionType::PHI)
+                break;
+            auto& incoming = dynamic_cast<PhiInstruction*>(instruction)->incoming;
+            incoming.erase(std::remove_if(incoming.begin(), incoming.end(), [&](const std::pair<std::string, std::string>& i) {
+                return removedLabels.count(i.second) != 0;
+            }), incoming.end());
+        }
+    }
+    for (auto x = 0; x < cfg.blocks.size(); x++)
+    {
+        if (!cfg.reachable.at(x))
+            delete cfg.blocks.at(x);
+    }
+    function->basicBlocksInFunction = keep;
+    return true;
+}
+
+/*
+ * Orders blocks so that a branch's first target usually follows it, letting the code generator
+ * fall through instead of branching: blocks are placed in depth-first preorder from the entry
+ * block, visiting a branch's true target before its false target. A loop body therefore follows
+ * its test and the loop exit follows the body. A block that ran off the end of the function is
+ * given an explicit return first, as it may no longer be last.
+ * */
+void layoutBlocks(AVMFunction* function) {
+    normaliseControlFlow(function);
+    removeUnreachableBlocks(function);
+    auto& blocks = function->basicBlocksInFunction;
+    if (blocks.empty())
+        return;
+    if (getTerminator(blocks.back()) == nullptr)
+    {
+        auto* retInstruction = new RetInstruction;
+        retInstruction->opcode = AVMOpcode::RET;
+        blocks.back()->sequenceOfInstructions.push_back(retInstruction);
+    }
+    AVMControlFlowGraph cfg(function);
+    std::vector<AVMBasicBlock*> order;
+    std::vector<bool> placed(cfg.blocks.size(), false);
+    std::vector<u32> stack{0};
+    while (!stack.empty())
+    {
+        u32 block = stack.back();
+        stack.pop_back();
+        if (placed.at(block))
+            continue;
+        placed.at(block) = true;
+        order.push_back(cfg.blocks.at(block));
+        auto& successors = cfg.successors.at(block);
+        for (auto it = successors.rbegin(); it != successors.rend(); it++)
+        {
+            if (!placed.at(*it))
+                stack.push_back(*it);
+        }
+    }
+    blocks = order;
+}
+
+u64 countFrameSlots(AVMFunction* function) {
+    std::set<std::string> locals;
+    for (auto* symbol : function->incomingSymbols)
+        locals.insert(symbol->identifier);
+    for (auto* basicBlock : function->basicBlocksInFunction)
+    {
+        for (auto* instruction : basicBlock->sequenceOfInstructions)
+        {
+            if (instruction->getInstructionType() == AVMInstructionType::ALLOCA)
+                locals.insert(dynamic_cast<AllocaInstruction*>(instruction)->target);
+            auto* destination = getInstructionDestination(instruction);
+            if (destination != nullptr && isAVMLocalVariable(*destination))
+                locals.insert(*destination);
+        }
+    }
+    return locals.size();
+}
+
+AVMControlFlowGraph::AVMControlFlowGraph(AVMFunction* function) : function(function) {
+    blocks = function->basicBlocksInFunction;
+    for (auto x = 0; x < blocks.size(); x++)
+    {
+        labelToIndex[blocks.at(x)->label] = x;
+    }
+    successors.resize(blocks.size());
+    predecessors.resize(blocks.size());
+    for (auto x = 0; x < blocks.size(); x++)
+    {
+        auto* terminator = getTerminator(blocks.at(x));
+        if (terminator == nullptr)
+        {
+            if (x + 1 < blocks.size())
+                successors.at(x).push_back(x+1);
+        }
+        else {
+            for (const auto& target : getBranchTargets(blocks.at(x)))
+            {
+                auto found = labelToIndex.find(target);
+                if (found != labelToIndex.end())
+                    successors.at(x).push_back(found->second);
+            }
+        }
+        for (auto successor : successors.at(x))
+            predecessors.at(successor).push_back(x);
+    }
+    // Depth first search from the entry block to find reachable blocks and a reverse postorder
+    reachable.assign(blocks.size(), false);
+    if (blocks.empty())
+        return;
+    std::vector<u32> postOrder;
+    std::vector<std::pair<u32, u32>> stack{{0, 0}};
+    reachable.at(0) = true;
+    while (!stack.empty())
+    {
+        auto& [block, next] = stack.back();
+        if (next < successors.at(block).size())
+        {
+            u32 successor = successors.at(block).at(next);
+            next++;
+            if (!reachable.at(successor))
+            {
+                reachable.at(successor) = true;
+                stack.emplace_back(successor, 0);
+            }
+        }
+        else {
+            postOrder.push_back(block);
+            stack.pop_back();
+        }
+    }
+    reversePostOrder.assign(postOrder.rbegin(), postOrder.rend());
+}
+
+AVMDominatorTree::AVMDominatorTree(AVMControlFlowGraph& cfg) {
+    u32 size = cfg.blocks.size();
+    immediateDominator.assign(size, -1);
+    children.resize(size);
+    dominanceFrontier.resize(size);
+    rpoNumber.assign(size, 0);
+    if (size == 0)
+        return;
+    for (auto x = 0; x < cfg.reversePostOrder.size(); x++)
+    {
+        rpoNumber.at(cfg.reversePostOrder.at(x)) = x;
+    }
+    auto intersect = [&](u32 a, u32 b) {
+        while (a != b)
+        {
+            while (rpoNumber.at(a) > rpoNumber.at(b))
+                a = immediateDominator.at(a);
+            while (rpoNumber.at(b) > rpoNumber.at(a))
+                b = immediateDominator.at(b);
+        }
+        return a;
+    };
+    immediateDominator.at(0) = 0;
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (auto x = 1; x < cfg.reversePostOrder.size(); x++)
+        {
+            u32 block = cfg.reversePostOrder.at(x);
+            i64 newIdom = -1;
+            for (auto predecessor : cfg.predecessors.at(block))
+            {
+                if (immediateDominator.at(predecessor) == -1)
+                    continue;
+                newIdom = newIdom == -1 ? predecessor : intersect(predecessor, newIdom);
+            }
+            if (newIdom != immediateDominator.at(block))
+            {
+                immediateDominator.at(block) = newIdom;
+                changed = true;
+            }
+        }
+    }
+    for (auto block : cfg.reversePostOrder)
+    {
+        if (block != 0)
+            children.at(immediateDominator.at(block)).push_back(block);
+    }
+    for (auto block : cfg.reversePostOrder)
+    {
+        u32 reachablePredecessors = 0;
+        for (auto predecessor : cfg.predecessors.at(block))
+            if (cfg.reachable.at(predecessor))
+                reachablePredecessors++;
+        if (reachablePredecessors < 2)
+            continue;
+        for (auto predecessor : cfg.predecessors.at(block))
+        {
+            if (!cfg.reachable.at(predecessor))
+                continue;
+            i64 runner = predecessor;
+            while (runner != immediateDominator.at(block))
+            {
+                auto& frontier = dominanceFrontier.at(runner);
+                if (std::find(frontier.begin(), frontier.end(), block) == frontier.end())
+                    frontier.push_back(block);
+                if (runner == 0)
+                    break;
+                runner = immediateDominator.at(runner);
+            }
+        }
+    }
+    immediateDominator.at(0) = -1;
+}
+
+bool AVMDominatorTree::dominates(u32 dominator, u32 block) {
+    i64 runner = block;
+    while (runner != -1)
+    {
+        if (runner == dominator)
+            return true;
+        runner = immediateDominator.at(runner);
+    }
+    return false;
+}
+
+AVMPostDominatorTree::AVMPostDominatorTree(AVMControlFlowGraph& cfg) {
+    u32 size = cfg.blocks.size();
+    exit = size;
+    immediatePostDominator.assign(size + 1, -1);
+    // Successors in the reversed graph are the predecessors in the flow graph, and the other way round
+    std::vector<std::vector<u32>> reversedSuccessors(size + 1);
+    std::vector<std::vector<u32>> reversedPredecessors(size + 1);
+    for (auto x = 0; x < size; x++)
+    {
+        if (cfg.successors.at(x).empty()) {
+            reversedSuccessors.at(exit).push_back(x);
+            reversedPredecessors.at(x).push_back(exit);
+        }
+        for (auto successor : cfg.successors.at(x))
+        {
+            reversedSuccessors.at(successor).push_back(x);
+            reversedPredecessors.at(x).push_back(successor);
+        }
+    }
+    std::vector<u32> postOrder;
+    std::vector<bool> visited(size + 1, false);
+    std::vector<std::pair<u32, u32>> stack{{exit, 0}};
+    visited.at(exit) = true;
+    while (!stack.empty())
+    {
+        auto& [block, next] = stack.back();
+        if (next < reversedSuccessors.at(block).size())
+        {
+            u32 successor = reversedSuccessors.at(block).at(next);
+            next++;
+            if (!visited.at(successor))
+            {
+                visited.at(successor) = true;
+                stack.emplace_back(successor, 0);
+            }
+        }
+        else {
+            postOrder.push_back(block);
+            stack.pop_back();
+        }
+    }
+    std::vector<u32> rpoNumber(size + 1, 0);
+    for (auto x = 0; x < postOrder.size(); x++)
+    {
+        rpoNumber.at(postOrder.at(x)) = postOrder.size() - 1 - x;
+    }
+    auto intersect = [&](u32 a, u32 b) {
+        while (a != b)
+        {
+            while (rpoNumber.at(a) > rpoNumber.at(b))
+                a = immediatePostDominator.at(a);
+            while (rpoNumber.at(b) > rpoNumber.at(a))
+                b = immediatePostDominator.at(b);
+        }
+        return a;
+    };
+    immediatePostDominator.at(exit) = exit;
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (auto it = postOrder.rbegin() + 1; it != postOrder.rend(); it++)
+        {
+            i64 newIdom = -1;
+            for (auto predecessor : reversedPredecessors.at(*it))
+            {
+                if (immediatePostDominator.at(predecessor) == -1)
+                    continue;
+                newIdom = newIdom == -1 ? predecessor : intersect(predecessor, newIdom);
+            }
+            if (newIdom != immediatePostDominator.at(*it))
+            {
+                immediatePostDominator.at(*it) = newIdom;
+                changed = true;
+            }
+        }
+    }
+    immediatePostDominator.at(exit) = -1;
+}
+
+bool AVMPostDominatorTree::postDominates(u32 postDominator, u32 block) {
+    i64 runner = block;
+    while (runner != -1)
+    {
+        if (runner == postDominator)
+            return true;
+        runner = immediatePostDominator.at(runner);
+    }
+    return false;
+}
+
+AVMLiveness::AVMLiveness(AVMControlFlowGraph& cfg) {
+    u32 size = cfg.blocks.size();
+    liveIn.resize(size);
+    liveOut.resize(size);
+    std::vector<std::set<std::string>> upwardExposed(size);
+    std::vector<std::set<std::string>> defined(size);
+    // Values a block's successors read through phis, keyed by predecessor
+    std::vector<std::set<std::string>> phiUses(size);
+    for (auto x = 0; x < size; x++)
+    {
+        for (auto* instruction : cfg.blocks.at(x)->sequenceOfInstructions)
+        {
+            if (instruction->getInstructionType() == AVMInstructionType::PHI)
+            {
+                for (const auto& [value, label] : dynamic_cast<PhiInstruction*>(instruction)->incoming)
+                {
+                    auto found = cfg.labelToIndex.find(label);
+                    if (found != cfg.labelToIndex.end() && isAVMLocalVariable(value))
+                        phiUses.at(found->second).insert(value);
+                }
+            }
+            else {
+                for (auto* operand : getInstructionOperands(instruction))
+                {
+                    if (isAVMLocalVariable(*operand) && !defined.at(x).count(*operand))
+                        upwardExposed.at(x).insert(*operand);
+                }
+            }
+            auto* destination = getInstructionDestination(instruction);
+            if (destination != nullptr)
+                defined.at(x).insert(*destination);
+        }
+    }
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (auto it = cfg.reversePostOrder.rbegin(); it != cfg.reversePostOrder.rend(); it++)
+        {
+            u32 block = *it;
+            std::set<std::string> out = phiUses.at(block);
+            for (auto successor : cfg.successors.at(block))
+            {
+                for (const auto& i : liveIn.at(successor))
+                    out.insert(i);
+            }
+            std::set<std::string> in = upwardExposed.at(block);
+            for (const auto& i : out)
+            {
+                if (!defined.at(block).count(i))
+                    in.insert(i);
+            }
+            if (out != liveOut.at(block) || in != liveIn.at(block))
+            {
+                liveOut.at(block) = std::move(out);
+                liveIn.at(block) = std::move(in);
+                changed = true;
+            }
+        }
+    }
+}
+
+AVMDefUse::AVMDefUse(AVMFunction* function) {
+    auto& blocks = function->basicBlocksInFunction;
+    for (auto x = 0; x < blocks.size(); x++)
+    {
+        for (auto* instruction : blocks.at(x)->sequenceOfInstructions)
+        {
+            if (instruction->getInstructionType() == AVMInstructionType::GEP)
+                addressTaken.insert(dynamic_cast<GetElementPtr*>(instruction)->src);
+            for (auto* operand : getInstructionOperands(instruction))
+            {
+                if (isAVMLocalVariable(*operand))
+                    uses[*operand].emplace_back(instruction, x);
+            }
+            auto* destination = getInstructionDestination(instruction);
+            if (destination != nullptr)
+            {
+                definition[*destination] = {instruction, x};
+                definitionCount[*destination]++;
+            }
+        }
+    }
+}
+
+bool AVMDefUse::isSSAValue(const std::string& variable) {
+    if (!isAVMLocalVariable(variable) || addressTaken.count(variable))
+        return false;
+    auto found = definitionCount.find(variable);
+    return found != definitionCount.end() && found->second == 1;
+}
+
+bool AVMDefUse::isStableValue(const std::string& operand) {
+    if (isAVMConstant(operand))
+        return true;
+    if (!isAVMLocalVariable(operand) || addressTaken.count(operand))
+        return false;
+    auto found = definitionCount.find(operand);
+    return found == definitionCount.end() || found->second == 1;
+}
+
+bool AVMDefUse::isBooleanValue(const std::string& value) {
+    if (!isSSAValue(value))
+        return false;
+    auto found = definition.find(value);
+    if (found == definition.end() || found->second.first == nullptr)
+        return false;
+    auto* instruction = found->second.first;
+    if (instruction->getInstructionType() == AVMInstructionType::CMP)
+        return true;
+    if (instruction->getInstructionType() != AVMInstructionType::ARITHMETIC)
+        return false;
+    auto* arithmeticInstruction = dynamic_cast<ArithmeticInstruction*>(instruction);
+    return (arithmeticInstruction->opcode == AVMOpcode::AND || arithmeticInstruction->opcode == AVMOpcode::ORR)
+           && isBooleanValue(arithmeticInstruction->src1) && isBooleanValue(arithmeticInstruction->src2);
+}
+
+AVMLoopInfo::AVMLoopInfo(AVMControlFlowGraph& cfg, AVMDominatorTree& dominatorTree) : cfg(cfg) {
+    std::map<u32, AVMLoop> loopsByHeader;
+    for (auto block : cfg.reversePostOrder)
+    {
+        for (auto successor : cfg.successors.at(block))
+        {
+            if (!dominatorTree.dominates(successor, block))
+                continue;
+            auto& loop = loopsByHeader[successor];
+            loop.header = successor;
+            loop.blocks.insert(successor);
+            loop.latches.push_back(block);
+            std::vector<u32> worklist{block};
+            while (!worklist.empty())
+            {
+                u32 current = worklist.back();
+                worklist.pop_back();
+                if (!loop.blocks.insert(current).second)
+                    continue;
+                for (auto predecessor : cfg.predecessors.at(current))
+                {
+                    if (cfg.reachable.at(predecessor))
+                        worklist.push_back(predecessor);
+                }
+            }
+        }
+    }
+    for (auto& [header, loop] : loopsByHeader)
+    {
+        for (auto block : loop.blocks)
+        {
+            for (auto successor : cfg.successors.at(block))
+            {
+                if (!loop.blocks.count(successor) && std::find(loop.exits.begin(), loop.exits.end(), successor) == loop.exits.end())
+                    loop.exits.push_back(successor);
+            }
+        }
+        loops.push_back(std::move(loop));
+    }
+    // A loop nested in another has strictly fewer blocks, so sorting by size puts inner loops first
+    std::stable_sort(loops.begin(), loops.end(), [](const AVMLoop& a, const AVMLoop& b) {
+        return a.blocks.size() < b.blocks.size();
+    });
+    for (auto x = 0; x < loops.size(); x++)
+    {
+        for (auto y = x + 1; y < loops.size(); y++)
+        {
+            if (loops.at(y).blocks.count(loops.at(x).header))
+            {
+                loops.at(x).parent = y;
+                break;
+            }
+        }
+    }
+    for (auto x = loops.size(); x-- > 0;)
+    {
+        if (loops.at(x).parent != -1)
+            loops.at(x).depth = loops.at(loops.at(x).parent).depth + 1;
+    }
+}
+
+i64 AVMLoopInfo::preheader(const AVMLoop& loop) {
+    i64 candidate = -1;
+    for (auto predecessor : cfg.predecessors.at(loop.header))
+    {
+        if (loop.blocks.count(predecessor) || !cfg.reachable.at(predecessor))
+            continue;
+        if (candidate != -1)
+            return -1;
+        candidate = predecessor;
+    }
+    if (candidate == -1 || cfg.successors.at(candidate).size() != 1)
+        return -1;
+    return candidate;
+}
+
+/*
+ * Tightens facts using each other: the bits min and max have in common above the highest bit where
+ * they differ are known, and the known bits bound the range.
+ * */
+static AVMValueFacts normaliseFacts(AVMValueFacts facts) {
+    u64 differing = facts.min ^ facts.max;
+    u64 common = differing == 0 ? UINT64_MAX : ~(UINT64_MAX >> std::__countl_zero(differing));
+    if (facts.min <= facts.max) {
+        facts.knownOne |= facts.min & common;
+        facts.knownZero |= ~facts.min & common;
+    }
+    facts.min = std::max(facts.min, facts.knownOne);
+    facts.max = std::min(facts.max, ~facts.knownZero);
+    return facts;
+}
+
+static AVMValueFacts constantFacts(u64 value) {
+    return {~value, value, value, value};
+}
+
+/*
+ * Known bits of a + b + carry, following which carries into each bit are known.
+ * */
+static AVMValueFacts addBits(u64 zero1, u64 one1, u64 zero2, u64 one2, bool carry) {
+    u64 possibleSumZero = ~zero1 + ~zero2 + carry;
+    u64 possibleSumOne = one1 + one2 + carry;
+    u64 carryKnownZero = ~(possibleSumZero ^ zero1 ^ zero2);
+    u64 carryKnownOne = possibleSumOne ^ one1 ^ one2;
+    u64 known = (zero1 | one1) & (zero2 | one2) & (carryKnownZero | carryKnownOne);
+    AVMValueFacts facts;
+    facts.knownZero = ~possibleSumOne & known;
+    facts.knownOne = possibleSumOne & known;
+    return facts;
+}
+
+/*
+ * Facts about the result of an arithmetic operation, from the facts about its operands.
+ * */
+static AVMValueFacts arithmeticFacts(AVMOpcode opcode, const AVMValueFacts& a, const AVMValueFacts& b) {
+    if (a.isConstant() && b.isConstant())
+        return constantFacts(performCalculation(opcode, a.knownOne, b.knownOne));
+    AVMValueFacts facts;
+    auto trailingZeros = [](const AVMValueFacts& operand) {
+        return operand.knownZero == UINT64_MAX ? 64 : std::__countr_zero(~operand.knownZero);
+    };
+    switch (opcode) {
+        case AVMOpcode::ADD:
+            facts = addBits(a.knownZero, a.knownOne, b.knownZero, b.knownOne, false);
+            // The range survives if the sum never wraps, or always does
+            if (a.max <= UINT64_MAX - b.max || a.min > UINT64_MAX - b.min) {
+                facts.min = a.min + b.min;
+                facts.max = a.max + b.max;
+            }
+            break;
+        case AVMOpcode::SUB:
+            // a - b is a + ~b + 1
+            facts = addBits(a.knownZero, a.knownOne, b.knownOne, b.knownZero, true);
+            if (a.min >= b.max || a.max < b.min) {
+                facts.min = a.min - b.max;
+                facts.max = a.max - b.min;
+            }
+            break;
+        case AVMOpcode::MUL: {
+            u32 zeros = std::min(64, trailingZeros(a) + trailingZeros(b));
+            facts.knownZero = zeros == 64 ? UINT64_MAX : ((u64)1 << zeros) - 1;
+            if (((unsigned __int128)a.max * b.max) >> 64 == 0) {
+                facts.min = a.min * b.min;
+                facts.max = a.max * b.max;
+            }
+            break;
+        }
+        case AVMOpcode::MULH:
+            facts.min = performCalculation(AVMOpcode::MULH, a.min, b.min);
+            facts.max = performCalculation(AVMOpcode::MULH, a.max, b.max);
+            break;
+        case AVMOpcode::DIV:
+            // Division by zero gives zero
+            facts.min = b.min == 0 ? 0 : a.min / b.max;
+            facts.max = a.max / std::max<u64>(b.min, 1);
+            break;
+        case AVMOpcode::MOD:
+            // The remainder by zero is the dividend
+            if (b.min > a.max)
+                return a;
+            facts.max = b.min == 0 ? a.max : std::min(a.max, b.max - 1);
+            break;
+        case AVMOpcode::SLL:
+            if (!b.isConstant())
+                break;
+            {
+                u64 shift = b.knownOne & 63;
+                facts.knownZero = (a.knownZero << shift) | (((u64)1 << shift) - 1);
+                facts.knownOne = a.knownOne << shift;
+                if (a.max <= UINT64_MAX >> shift) {
+                    facts.min = a.min << shift;
+                    facts.max = a.max << shift;
+                }
+            }
+            break;
+        case AVMOpcode::SLR:
+            if (b.isConstant())
+            {
+                u64 shift = b.knownOne & 63;
+                facts.knownZero = (a.knownZero >> shift) | ~(UINT64_MAX >> shift);
+                facts.knownOne = a.knownOne >> shift;
+                facts.min = a.min >> shift;
+                facts.max = a.max >> shift;
+            }
+            else if (b.max < 64) {
+                facts.min = a.min >> b.max;
+                facts.max = a.max >> b.min;
+            }
+            else {
+                facts.max = a.max;
+            }
+            break;
+        case AVMOpcode::ASR:
+            if (b.isConstant())
+            {
+                // Each mask's top bit is copied down, as the value's sign bit is
+                u64 shift = b.knownOne & 63;
+                facts.knownZero = (u64)((i64)a.knownZero >> shift);
+                facts.knownOne = (u64)((i64)a.knownOne >> shift);
+            }
+            break;
+        case AVMOpcode::AND:
+            facts.knownZero = a.knownZero | b.knownZero;
+            facts.knownOne = a.knownOne & b.knownOne;
+            facts.max = std::min(a.max, b.max);
+            break;
+        case AVMOpcode::ORR:
+            facts.knownZero = a.knownZero & b.knownZero;
+            facts.knownOne = a.knownOne | b.knownOne;
+            facts.min = std::max(a.min, b.min);
+            break;
+        case AVMOpcode::XOR:
+            facts.knownZero = (a.knownZero & b.knownZero) | (a.knownOne & b.knownOne);
+            facts.knownOne = (a.knownZero & b.knownOne) | (a.knownOne & b.knownZero);
+            break;
+        default:
+            break;
+    }
+    return normaliseFacts(facts);
+}
+
+static std::optional<bool> compareFacts(CMPCode code, const AVMValueFacts& a, const AVMValueFacts& b) {
+    switch (code) {
+        case CMPCode::LT:
+            if (a.max < b.min)
+                return true;
+            if (a.min >= b.max)
+                return false;
+            return {};
+        case CMPCode::LTEQ:
+            if (a.max <= b.min)
+                return true;
+            if (a.min > b.max)
+                return false;
+            return {};
+        case CMPCode::MT:
+            return compareFacts(CMPCode::LT, b, a);
+        case CMPCode::MTEQ:
+            return compareFacts(CMPCode::LTEQ, b, a);
+        case CMPCode::EQ:
+            if (a.isConstant() && b.isConstant())
+                return a.knownOne == b.knownOne;
+            if (a.max < b.min || b.max < a.min || (a.knownZero & b.knownOne) != 0 || (a.knownOne & b.knownZero) != 0)
+                return false;
+            return {};
+        case CMPCode::NEQ: {
+            auto equal = compareFacts(CMPCode::EQ, a, b);
+            if (equal)
+                return !*equal;
+            return {};
+        }
+        default:
+            return {};
+    }
+}
+
+AVMValueTracking::AVMValueTracking(AVMFunction* function, AVMDefUse& defUse) {
+    // A value still changing after this many updates is given up on, which ends the iteration
+    const u32 maxUpdates = 16;
+    // Phis that keep changing have their ranges widened to the full range, as loops may count to any bound
+    const u32 updatesBeforeWidening = 2;
+    AVMControlFlowGraph cfg(function);
+    std::deque<AVMInstruction*> worklist;
+    std::set<AVMInstruction*> queued;
+    std::unordered_map<std::string, u32> updates;
+    auto push = [&](AVMInstruction* instruction) {
+        auto* destination = getInstructionDestination(instruction);
+        if (destination != nullptr && defUse.isSSAValue(*destination) && queued.insert(instruction).second)
+            worklist.push_back(instruction);
+    };
+    // Blocks are visited in reverse post order, so every value but a phi's is seen after its operands
+    for (auto block : cfg.reversePostOrder)
+    {
+        for (auto* instruction : cfg.blocks.at(block)->sequenceOfInstructions)
+            push(instruction);
+    }
+
+    while (!worklist.empty())
+    {
+        auto* instruction = worklist.front();
+        worklist.pop_front();
+        queued.erase(instruction);
+        auto& dest = *getInstructionDestination(instruction);
+        bool operandsReached = true;
+        for (auto* operand : getInstructionOperands(instruction))
+        {
+            if (defUse.isSSAValue(*operand) && !values.count(*operand) && instruction->getInstructionType() != AVMInstructionType::PHI)
+                operandsReached = false;
+        }
+        if (!operandsReached)
+            continue;
+
+        AVMValueFacts result;
+        switch (instruction->getInstructionType()) {
+            case AVMInstructionType::ARITHMETIC: {
+                auto* arithmeticInstruction = dynamic_cast<ArithmeticInstruction*>(instruction);
+                result = arithmeticFacts(arithmeticInstruction->opcode, facts(arithmeticInstruction->src1), facts(arithmeticInstruction->src2));
+                break;
+            }
+            case AVMInstructionType::CMP: {
+                auto* comparisonInstruction = dynamic_cast<ComparisonInstruction*>(instruction);
+                auto decided = decideComparison(comparisonInstruction->compareCode, comparisonInstruction->op1, comparisonInstruction->op2);
+                result = decided ? constantFacts(*decided) : normaliseFacts({~(u64)1, 0, 0, 1});
+                break;
+            }
+            case AVMInstructionType::MV:
+                result = facts(dynamic_cast<MoveInstruction*>(instruction)->valueToBeMoved);
+                break;
+            case AVMInstructionType::CSEL: {
+                auto* selectInstruction = dynamic_cast<CSELInstruction*>(instruction);
+                auto falseFacts = facts(selectInstruction->falseValue);
+                if (selectInstruction->incrementFalse)
+                    falseFacts = arithmeticFacts(AVMOpcode::ADD, falseFacts, constantFacts(1));
+                result = facts(selectInstruction->trueValue);
+                result.knownZero &= falseFacts.knownZero;
+                result.knownOne &= falseFacts.knownOne;
+                result.min = std::min(result.min, falseFacts.min);
+                result.max = std::max(result.max, falseFacts.max);
+                break;
+            }
+            case AVMInstructionType::PHI: {
+                // Incoming values not reached yet are left out, to be joined in once they are
+                bool first = true;
+                for (const auto& [value, label] : dynamic_cast<PhiInstruction*>(instruction)->incoming)
+                {
+                    if (defUse.isSSAValue(value) && !values.count(value))
+                        continue;
+                    auto incoming = facts(value);
+                    if (first) {
+                        result = incoming;
+                        first = false;
+                        continue;
+                    }
+                    result.knownZero &= incoming.knownZero;
+                    result.knownOne &= incoming.knownOne;
+                    result.min = std::min(result.min, incoming.min);
+                    result.max = std::max(result.max, incoming.max);
+                }
+                if (first)
+                    continue;
+                auto previous = values.find(dest);
+                if (previous != values.end() && updates[dest] >= updatesBeforeWidening)
+                {
+                    if (result.min < previous->second.min)
+                        result.min = 0;
+                    if (result.max > previous->second.max)
+                        result.max = UINT64_MAX;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+
+        auto previous = values.find(dest);
+        if (previous != values.end() && previous->second == result)
+            continue;
+        if (++updates[dest] > maxUpdates)
+            result = AVMValueFacts();
+        if (previous != values.end() && previous->second == result)
+            continue;
+        values[dest] = result;
+        for (auto [user, block] : defUse.uses[dest])
+            push(user);
+    }
+}
+
+AVMValueFacts AVMValueTracking::facts(const std::string& operand) {
+    if (isAVMConstant(operand))
+        return constantFacts(getAVMConstant(operand));
+    auto found = values.find(operand);
+    if (found == values.end())
+        return {};
+    return found->second;
+}
+
+std::optional<bool> AVMValueTracking::decideComparison(CMPCode code, const std::string& op1, const std::string& op2) {
+    if (op1 == op2 && (code == CMPCode::EQ || code == CMPCode::LTEQ || code == CMPCode::MTEQ))
+        return true;
+    if (op1 == op2 && (code == CMPCode::NEQ || code == CMPCode::LT || code == CMPCode::MT))
+        return false;
+    return compareFacts(code, facts(op1), facts(op2));
+}
+
+AVMAliasAnalysis::AVMAliasAnalysis(AVMFunction* function, AVMDefUse& defUse, const std::vector<Symbol*>& globals)
+    : defUse(defUse) {
+    for (auto* symbol : globals)
+    {
+        if (symbol->type != nullptr)
+            variableTypes["@" + symbol->identifier] = symbol->type->accessTypeAsString();
+    }
+    for (auto* symbol : function->variablesInFunction)
+    {
+        if (symbol->type != nullptr)
+            variableTypes[symbol->identifier] = symbol->type->accessTypeAsString();
+    }
+    for (auto* symbol : function->incomingSymbols)
+    {
+        if (symbol->type != nullptr && symbol->type->isRestrict())
+            restrictParameters.insert(symbol->identifier);
+    }
+
+    // Follow every address taken from a local through pointer arithmetic to the loads and stores using it
+    for (auto* basicBlock : function->basicBlocksInFunction)
+    {
+        for (auto* instruction : basicBlock->sequenceOfInstructions)
+        {
+            if (instruction->getInstructionType() != AVMInstructionType::GEP)
+                continue;
+            auto* gepInstruction = dynamic_cast<GetElementPtr*>(instruction);
+            if (!isAVMLocalVariable(gepInstruction->src) || escaped.count(gepInstruction->src))
+                continue;
+            if (!defUse.isSSAValue(gepInstruction->dest)) {
+                escaped.insert(gepInstruction->src);
+                continue;
+            }
+            std::set<std::string> derived{gepInstruction->dest};
+            std::vector<std::string> worklist{gepInstruction->dest};
+            while (!worklist.empty() && !escaped.count(gepInstruction->src))
+            {
+                std::string address = worklist.back();
+                worklist.pop_back();
+                for (const auto& [user, block] : defUse.uses[address])
+                {
+                    auto type = user->getInstructionType();
+                    if (type == AVMInstructionType::LOAD)
+                        continue;
+                    if (type == AVMInstructionType::STORE && dynamic_cast<StoreMemoryInstruction*>(user)->src != address)
+                        continue;
+                    if (type == AVMInstructionType::ARITHMETIC)
+                    {
+                        auto* arithmeticInstruction = dynamic_cast<ArithmeticInstruction*>(user);
+                        if ((arithmeticInstruction->opcode == AVMOpcode::ADD || arithmeticInstruction->opcode == AVMOpcode::SUB)
+                            && defUse.isSSAValue(arithmeticInstruction->dest))
+                        {
+                            if (derived.insert(arithmeticInstruction->dest).second)
+                                worklist.push_back(arithmeticInstruction->dest);
+                            continue;
+                        }
+                    }
+                    escaped.insert(gepInstruction->src);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+AVMMemoryLocation AVMAliasAnalysis::locationOfAddress(const std::string& address, u32 depth) {
+    const u32 maxDepth = 8;
+    AVMMemoryLocation location;
+    if (depth > maxDepth)
+        return location;
+    if (restrictParameters.count(address) && defUse.isStableValue(address))
+    {
+        location.base = AVMMemoryLocation::Base::RestrictParameter;
+        location.name = address;
+        return location;
+    }
+    if (!defUse.isSSAValue(address))
+        return location;
+    auto* definition = defUse.definition.at(address).first;
+    switch (definition->getInstructionType()) {
+        case AVMInstructionType::GEP:
+            location.base = AVMMemoryLocation::Base::Variable;
+            location.name = dynamic_cast<GetElementPtr*>(definition)->src;
+            location.exact = true;
+            return location;
+        case AVMInstructionType::MV:
+            return locationOfAddress(dynamic_cast<MoveInstruction*>(definition)->valueToBeMoved, depth + 1);
+        case AVMInstructionType::ARITHMETIC: {
+            auto* arithmeticInstruction = dynamic_cast<ArithmeticInstruction*>(definition);
+            if (arithmeticInstruction->opcode != AVMOpcode::ADD && arithmeticInstruction->opcode != AVMOpcode::SUB)
+                return location;
+            // Only one side of pointer arithmetic is a pointer
+            auto first = locationOfAddress(arithmeticInstruction->src1, depth + 1);
+            AVMMemoryLocation second;
+            if (arithmeticInstruction->opcode == AVMOpcode::ADD)
+                second = locationOfAddress(arithmeticInstruction->src2, depth + 1);
+            if (first.base != AVMMemoryLocation::Base::Unknown && second.base != AVMMemoryLocation::Base::Unknown)
+                return location;
+            location = first.base != AVMMemoryLocation::Base::Unknown ? first : second;
+            location.exact = false;
+            return location;
+        }
+        default:
+            return location;
+    }
+}
+
+AVMMemoryLocation AVMAliasAnalysis::locationOf(AVMInstruction* access) {
+    AVMMemoryLocation location;
+    if (access->getInstructionType() == AVMInstructionType::LOAD)
+    {
+        auto* loadInstruction = dynamic_cast<LoadMemoryInstruction*>(access);
+        location = locationOfAddress(loadInstruction->addrVar, 0);
+        location.address = loadInstruction->addrVar;
+        location.accessType = loadInstruction->accessType;
+    }
+    else if (access->getInstructionType() == AVMInstructionType::STORE)
+    {
+        auto* storeInstruction = dynamic_cast<StoreMemoryInstruction*>(access);
+        location = locationOfAddress(storeInstruction->addrVar, 0);
+        location.address = storeInstruction->addrVar;
+        location.accessType = storeInstruction->accessType;
+    }
+    return location;
+}
+
+AVMMemoryLocation AVMAliasAnalysis::locationOfVariable(const std::string& variable) {
+    AVMMemoryLocation location;
+    location.base = AVMMemoryLocation::Base::Variable;
+    location.name = variable;
+    location.exact = true;
+    auto type = variableTypes.find(variable);
+    if (type != variableTypes.end())
+        location.accessType = type->second;
+    return location;
+}
+
+bool AVMAliasAnalysis::isMemoryVariable(const std::string& variable) {
+    if (variable.empty() || isAVMConstant(variable))
+        return false;
+    return !isAVMLocalVariable(variable) || defUse.addressTaken.count(variable);
+}
+
+bool AVMAliasAnalysis::isEscaped(const std::string& variable) {
+    return !isAVMLocalVariable(variable) || escaped.count(variable);
+}
+
+bool AVMAliasAnalysis::outlivesFunction(const AVMMemoryLocation& location) {
+    return location.base != AVMMemoryLocation::Base::Variable || !isAVMLocalVariable(location.name);
+}
+
+bool AVMAliasAnalysis::mayAlias(const AVMMemoryLocation& first, const AVMMemoryLocation& second) {
+    using Base = AVMMemoryLocation::Base;
+    if (first.base == Base::Variable && second.base == Base::Variable)
+        return first.name == second.name;
+    // A pointer derived from a restrict parameter in a way not followed here is unknown, so may still alias it
+    if (first.base == Base::RestrictParameter && second.base != Base::Unknown)
+        return second.base == Base::RestrictParameter && first.name == second.name;
+    if (second.base == Base::RestrictParameter && first.base != Base::Unknown)
+        return false;
+    for (const auto* location : {&first, &second})
+    {
+        if (location->base == Base::Variable && !isEscaped(location->name))
+            return false;
+    }
+    if (!first.accessType.empty() && !second.accessType.empty() && first.accessType != second.accessType
+        && first.accessType != "char" && second.accessType != "char")
+        return false;
+    return true;
+}
+
+bool AVMAliasAnalysis::mustAlias(const AVMMemoryLocation& first, const AVMMemoryLocation& second) {
+    bool sameType = first.accessType.empty() || second.accessType.empty() || first.accessType == second.accessType;
+    if (first.base == AVMMemoryLocation::Base::Variable && second.base == AVMMemoryLocation::Base::Variable)
+        return first.exact && second.exact && first.name == second.name && sameType;
+    return !first.address.empty() && first.address == second.address && defUse.isStableValue(first.address)
+           && first.accessType == second.accessType;
+}
+
+bool AVMAliasAnalysis::mayRead(AVMInstruction* instruction, const AVMMemoryLocation& location) {
+    for (auto* operand : getInstructionOperands(instruction))
+    {
+        if (isMemoryVariable(*operand) && mayAlias(locationOfVariable(*operand), location))
+            return true;
+    }
+    switch (instruction->getInstructionType()) {
+        case AVMInstructionType::LOAD:
+            return mayAlias(locationOf(instruction), location);
+        case AVMInstructionType::CALL:
+            return outlivesFunction(location) || isEscaped(location.name);
+        case AVMInstructionType::RET:
+            return outlivesFunction(location);
+        default:
+            return false;
+    }
+}
+
+bool AVMAliasAnalysis::mayWrite(AVMInstruction* instruction, const AVMMemoryLocation& location) {
+    switch (instruction->getInstructionType()) {
+        case AVMInstructionType::STORE:
+            return mayAlias(locationOf(instruction), location);
+        case AVMInstructionType::CALL:
+            if (outlivesFunction(location) || isEscaped(location.name))
+                return true;
+            break;
+        default:
+            break;
+    }
+    auto* destination = getInstructionDestination(instruction);
+    return destination != nullptr && isMemoryVariable(*destination) && mayAlias(locationOfVariable(*destination), location);
+}
+
+bool AVMAliasAnalysis::mustWrite(AVMInstruction* instruction, const AVMMemoryLocation& location) {
+    if (instruction->getInstructionType() == AVMInstructionType::STORE)
+        return mustAlias(locationOf(instruction), location);
+    auto* destination = getInstructionDestination(instruction);
+    return destination != nullptr && isMemoryVariable(*destination) && mustAlias(locationOfVariable(*destination), location);
+}
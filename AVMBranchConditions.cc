@@ -0,0 +1,108 @@
+#include <AVMAnalysis.hh>
+#include <algorithm>
+
+/*
+ * Combining of short-circuited conditions, on a function in SSA form.
+ *
+ * Short-circuit lowering gives a && b a branch on a to a block that does nothing but compare for b
+ * and branch again, with both branches sharing the target taken when the condition fails; a || b
+ * likewise shares the target taken when it holds. When both conditions are booleans only read by
+ * their branches, the second comparison is moved up and the two branches become one, on the and or
+ * the or of the two conditions. The code generator emits such chains of comparisons as cmp
+ * followed by ccmp, with a single conditional branch at the end.
+ *
+ * Comparisons cannot trap, so evaluating the second one when the first already decided the outcome
+ * is harmless. Phis in the shared target must receive the same value along both edges.
+ * */
+void AVM::optCombineBranchConditions(AVMFunction *function) {
+    normaliseControlFlow(function);
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        AVMControlFlowGraph cfg(function);
+        AVMDefUse defUse(function);
+        auto conditionalBranchOf = [&](u32 block) {
+            auto* terminator = getTerminator(cfg.blocks.at(block));
+            auto* branchInstruction = terminator != nullptr && terminator->getInstructionType() == AVMInstructionType::BRANCH
+                                      ? dynamic_cast<BranchInstruction*>(terminator) : nullptr;
+            if (branchInstruction == nullptr || branchInstruction->falseTarget == "NULL"
+                || branchInstruction->trueTarget == branchInstruction->falseTarget
+                || !cfg.labelToIndex.count(branchInstruction->trueTarget) || !cfg.labelToIndex.count(branchInstruction->falseTarget))
+                return static_cast<BranchInstruction*>(nullptr);
+            auto& condition = branchInstruction->dependantComparison;
+            if (!defUse.isBooleanValue(condition) || defUse.uses[condition].size() != 1)
+                return static_cast<BranchInstruction*>(nullptr);
+            return branchInstruction;
+        };
+        // Whether every phi in the target receives the same value from both blocks
+        auto agreesAt = [&](u32 target, const std::string& label, const std::string& otherLabel) {
+            for (auto* instruction : cfg.blocks.at(target)->sequenceOfInstructions)
+            {
+                if (instruction->getInstructionType() != AVMInstructionType::PHI)
+                    break;
+                std::string value;
+                std::string otherValue;
+                for (auto& [incomingValue, incomingLabel] : dynamic_cast<PhiInstruction*>(instruction)->incoming)
+                {
+                    if (incomingLabel == label)
+                        value = incomingValue;
+                    if (incomingLabel == otherLabel)
+                        otherValue = incomingValue;
+                }
+                if (value != otherValue)
+                    return false;
+            }
+            return true;
+        };
+
+        // In reverse postorder, so that a chain is combined from its first condition onwards
+        for (auto block : cfg.reversePostOrder)
+        {
+            if (changed)
+                break;
+            auto* branchInstruction = conditionalBranchOf(block);
+            if (branchInstruction == nullptr)
+                continue;
+            for (bool isAnd : {true, false})
+            {
+                // The block testing the second condition: the true target for &&, the false target for ||
+                u32 second = cfg.labelToIndex.at(isAnd ? branchInstruction->trueTarget : branchInstruction->falseTarget);
+                auto& shared = isAnd ? branchInstruction->falseTarget : branchInstruction->trueTarget;
+                auto* secondBranchInstruction = conditionalBranchOf(second);
+                auto& sequence = cfg.blocks.at(second)->sequenceOfInstructions;
+                if (second == block || second == 0 || cfg.predecessors.at(second).size() != 1 || secondBranchInstruction == nullptr
+                    || sequence.size() != 2 || sequence.front()->getInstructionType() != AVMInstructionType::CMP
+                    || *getInstructionDestination(sequence.front()) != secondBranchInstruction->dependantComparison
+                    || (isAnd ? secondBranchInstruction->falseTarget : secondBranchInstruction->trueTarget) != shared
+                    || !agreesAt(cfg.labelToIndex.at(shared), cfg.blocks.at(block)->label, cfg.blocks.at(second)->label))
+                    continue;
+
+                // The target only the second block reached now comes straight from the first
+                auto& label = cfg.blocks.at(second)->label;
+                auto& onward = isAnd ? secondBranchInstruction->trueTarget : secondBranchInstruction->falseTarget;
+                for (auto* instruction : cfg.blocks.at(cfg.labelToIndex.at(onward))->sequenceOfInstructions)
+                {
+                    if (instruction->getInstructionType() != AVMInstructionType::PHI)
+                        break;
+                    for (auto& incoming : dynamic_cast<PhiInstruction*>(instruction)->incoming)
+                    {
+                        if (incoming.second == label)
+                            incoming.second = cfg.blocks.at(block)->label;
+                    }
+                }
+                std::string combined = genSSAName("cond");
+                insertBeforeTerminator(cfg.blocks.at(block), sequence.front());
+                insertBeforeTerminator(cfg.blocks.at(block), createArithmetic(isAnd ? AVMOpcode::AND : AVMOpcode::ORR, combined,
+                                                                              branchInstruction->dependantComparison,
+                                                                              secondBranchInstruction->dependantComparison));
+                sequence.erase(sequence.begin());
+                branchInstruction->dependantComparison = combined;
+                (isAnd ? branchInstruction->trueTarget : branchInstruction->falseTarget) = onward;
+                changed = true;
+                break;
+            }
+        }
+        removeUnreachableBlocks(function);
+    }
+}
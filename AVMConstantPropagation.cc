@@ -0,0 +1,257 @@
+#include <AVMAnalysis.hh>
+#include <algorithm>
+
+enum class LatticeState {
+    UNDEFINED,
+    CONSTANT,
+    OVERDEFINED
+};
+struct LatticeValue {
+    LatticeState state = LatticeState::UNDEFINED;
+    u64 value = 0;
+    bool operator==(const LatticeValue& other) const {
+        return state == other.state && (state != LatticeState::CONSTANT || value == other.value);
+    }
+};
+
+/*
+ * Sparse conditional constant propagation (Wegman & Zadeck) over a function in SSA form.
+ *
+ * Every SSA value starts out undefined and is only ever lowered to a constant and then to
+ * overdefined. Instructions are evaluated only once their block is found to be executable, and a
+ * branch whose condition is constant only makes the edge it takes executable, so constants
+ * flowing around loops and through untaken paths are found.
+ *
+ * Afterwards every use of a constant value is rewritten to an immediate, the now unused
+ * definitions are deleted, branches on constants become unconditional and blocks that can
+ * never execute are removed.
+ * */
+void AVM::optPropagateConstants(AVMFunction* function) {
+    AVMControlFlowGraph cfg(function);
+    AVMDefUse defUse(function);
+    u32 size = cfg.blocks.size();
+    if (size == 0)
+        return;
+
+    std::unordered_map<std::string, LatticeValue> lattice;
+    std::vector<bool> executableBlock(size, false);
+    std::set<std::pair<u32, u32>> executableEdge;
+    std::vector<std::pair<u32, u32>> flowWorklist;
+    std::vector<std::string> ssaWorklist;
+
+    auto valueOf = [&](const std::string& operand) -> LatticeValue {
+        if (isAVMConstant(operand))
+            return {LatticeState::CONSTANT, getAVMConstant(operand)};
+        if (!defUse.isSSAValue(operand))
+            return {LatticeState::OVERDEFINED, 0};
+        return lattice[operand];
+    };
+    auto update = [&](const std::string& variable, LatticeValue value) {
+        if (!defUse.isSSAValue(variable) || value.state == LatticeState::UNDEFINED)
+            return;
+        auto& current = lattice[variable];
+        if (current == value || current.state == LatticeState::OVERDEFINED)
+            return;
+        // Two different constants meet at overdefined
+        if (current.state == LatticeState::CONSTANT && value.state == LatticeState::CONSTANT)
+            value = {LatticeState::OVERDEFINED, 0};
+        current = value;
+        ssaWorklist.push_back(variable);
+    };
+    auto addEdge = [&](u32 from, const std::string& label) {
+        auto found = cfg.labelToIndex.find(label);
+        if (found != cfg.labelToIndex.end())
+            flowWorklist.emplace_back(from, found->second);
+    };
+
+    auto visit = [&](AVMInstruction* instruction, u32 block) {
+        switch (instruction->getInstructionType()) {
+            case AVMInstructionType::PHI: {
+                auto* phi = dynamic_cast<PhiInstruction*>(instruction);
+                LatticeValue result;
+                for (const auto& [value, label] : phi->incoming)
+                {
+                    auto found = cfg.labelToIndex.find(label);
+                    if (found == cfg.labelToIndex.end() || !executableEdge.count({found->second, block}))
+                        continue;
+                    auto incoming = valueOf(value);
+                    if (incoming.state == LatticeState::UNDEFINED)
+                        continue;
+                    if (result.state == LatticeState::UNDEFINED)
+                        result = incoming;
+                    else if (!(result == incoming))
+                        result = {LatticeState::OVERDEFINED, 0};
+                }
+                update(phi->dest, result);
+                break;
+            }
+            case AVMInstructionType::MV: {
+                auto* moveInstruction = dynamic_cast<MoveInstruction*>(instruction);
+                update(moveInstruction->dest, valueOf(moveInstruction->valueToBeMoved));
+                break;
+            }
+            case AVMInstructionType::ARITHMETIC: {
+                auto* arithmeticInstruction = dynamic_cast<ArithmeticInstruction*>(instruction);
+                auto operand1 = valueOf(arithmeticInstruction->src1);
+                auto operand2 = valueOf(arithmeticInstruction->src2);
+                auto opcode = arithmeticInstruction->opcode;
+                if (operand1.state == LatticeState::CONSTANT && operand2.state == LatticeState::CONSTANT)
+                {
+                    update(arithmeticInstruction->dest, {LatticeState::CONSTANT, performCalculation(opcode, operand1.value, operand2.value)});
+                }
+                else if ((opcode == AVMOpcode::MUL || opcode == AVMOpcode::AND)
+                         && ((operand1.state == LatticeState::CONSTANT && operand1.value == 0)
+                             || (operand2.state == LatticeState::CONSTANT && operand2.value == 0)))
+                {
+                    // Zero regardless of the other operand
+                    update(arithmeticInstruction->dest, {LatticeState::CONSTANT, 0});
+                }
+                else if (operand1.state == LatticeState::OVERDEFINED || operand2.state == LatticeState::OVERDEFINED)
+                {
+                    update(arithmeticInstruction->dest, {LatticeState::OVERDEFINED, 0});
+                }
+                break;
+            }
+            case AVMInstructionType::CMP: {
+                auto* comparisonInstruction = dynamic_cast<ComparisonInstruction*>(instruction);
+                auto operand1 = valueOf(comparisonInstruction->op1);
+                auto operand2 = valueOf(comparisonInstruction->op2);
+                if (operand1.state == LatticeState::CONSTANT && operand2.state == LatticeState::CONSTANT)
+                    update(comparisonInstruction->dest, {LatticeState::CONSTANT, performComparison(comparisonInstruction->compareCode, operand1.value, operand2.value)});
+                else if (operand1.state == LatticeState::OVERDEFINED || operand2.state == LatticeState::OVERDEFINED)
+                    update(comparisonInstruction->dest, {LatticeState::OVERDEFINED, 0});
+                break;
+            }
+            case AVMInstructionType::BRANCH: {
+                auto* branchInstruction = dynamic_cast<BranchInstruction*>(instruction);
+                if (branchInstruction->falseTarget == "NULL")
+                {
+                    addEdge(block, branchInstruction->trueTarget);
+                    break;
+                }
+                auto condition = valueOf(branchInstruction->dependantComparison);
+                if (condition.state == LatticeState::CONSTANT)
+                {
+                    addEdge(block, condition.value != 0 ? branchInstruction->trueTarget : branchInstruction->falseTarget);
+                }
+                else if (condition.state == LatticeState::OVERDEFINED)
+                {
+                    addEdge(block, branchInstruction->trueTarget);
+                    addEdge(block, branchInstruction->falseTarget);
+                }
+                break;
+            }
+            default: {
+                // Loads, calls and address generation produce values we cannot know
+                auto* destination = getInstructionDestination(instruction);
+                if (destination != nullptr)
+                    update(*destination, {LatticeState::OVERDEFINED, 0});
+                break;
+            }
+        }
+    };
+
+    executableBlock.at(0) = true;
+    for (auto* instruction : cfg.blocks.at(0)->sequenceOfInstructions)
+        visit(instruction, 0);
+    if (getTerminator(cfg.blocks.at(0)) == nullptr)
+        for (auto successor : cfg.successors.at(0))
+            flowWorklist.emplace_back(0, successor);
+
+    while (!flowWorklist.empty() || !ssaWorklist.empty())
+    {
+        while (!flowWorklist.empty())
+        {
+            auto edge = flowWorklist.back();
+            flowWorklist.pop_back();
+            if (executableEdge.count(edge))
+                continue;
+            executableEdge.insert(edge);
+            u32 block = edge.second;
+            if (executableBlock.at(block))
+            {
+                // Only the phis can see the newly executable edge
+                for (auto* instruction : cfg.blocks.at(block)->sequenceOfInstructions)
+                {
+                    if (instruction->getInstructionType() != AVMInstructionType::PHI)
+                        break;
+                    visit(instruction, block);
+                }
+                continue;
+            }
+            executableBlock.at(block) = true;
+            for (auto* instruction : cfg.blocks.at(block)->sequenceOfInstructions)
+                visit(instruction, block);
+            if (getTerminator(cfg.blocks.at(block)) == nullptr)
+                for (auto successor : cfg.successors.at(block))
+                    flowWorklist.emplace_back(block, successor);
+        }
+        while (!ssaWorklist.empty())
+        {
+            std::string variable = ssaWorklist.back();
+            ssaWorklist.pop_back();
+            for (auto& [instruction, block] : defUse.uses[variable])
+            {
+                if (executableBlock.at(block))
+                    visit(instruction, block);
+            }
+        }
+    }
+
+    // Rewrite constant uses to immediates and drop the definitions they came from
+    auto isConstant = [&](const std::string& variable) {
+        auto found = lattice.find(variable);
+        return found != lattice.end() && found->second.state == LatticeState::CONSTANT;
+    };
+    for (auto x = 0; x < size; x++)
+    {
+        auto* basicBlock = cfg.blocks.at(x);
+        auto& sequence = basicBlock->sequenceOfInstructions;
+        for (auto* instruction : sequence)
+        {
+            for (auto* operand : getInstructionOperands(instruction))
+            {
+                if (isConstant(*operand))
+                    *operand = makeAVMConstant(lattice[*operand].value);
+            }
+        }
+        sequence.erase(std::remove_if(sequence.begin(), sequence.end(), [&](AVMInstruction* instruction) {
+            auto type = instruction->getInstructionType();
+            if (type != AVMInstructionType::MV && type != AVMInstructionType::ARITHMETIC
+                && type != AVMInstructionType::CMP && type != AVMInstructionType::PHI)
+                return false;
+            if (!isConstant(*getInstructionDestination(instruction)))
+                return false;
+            delete instruction;
+            return true;
+        }), sequence.end());
+
+        auto* terminator = getTerminator(basicBlock);
+        if (!executableBlock.at(x) || terminator == nullptr || terminator->getInstructionType() != AVMInstructionType::BRANCH)
+            continue;
+        auto* branchInstruction = dynamic_cast<BranchInstruction*>(terminator);
+        if (branchInstruction->falseTarget == "NULL" || !isAVMConstant(branchInstruction->dependantComparison))
+            continue;
+        bool taken = getAVMConstant(branchInstruction->dependantComparison) != 0;
+        std::string target = taken ? branchInstruction->trueTarget : branchInstruction->falseTarget;
+        std::string notTaken = taken ? branchInstruction->falseTarget : branchInstruction->trueTarget;
+        branchInstruction->trueTarget = target;
+        branchInstruction->falseTarget = "NULL";
+        branchInstruction->dependantComparison = "#1";
+        if (notTaken == target)
+            continue;
+        auto found = cfg.labelToIndex.find(notTaken);
+        if (found == cfg.labelToIndex.end())
+            continue;
+        for (auto* instruction : cfg.blocks.at(found->second)->sequenceOfInstructions)
+        {
+            if (instruction->getInstructionType() != AVMInstructionType::PHI)
+                break;
+            auto& incoming = dynamic_cast<PhiInstruction*>(instruction)->incoming;
+            incoming.erase(std::remove_if(incoming.begin(), incoming.end(), [&](const std::pair<std::string, std::string>& i) {
+                return i.second == basicBlock->label;
+            }), incoming.end());
+        }
+    }
+    removeUnreachableBlocks(function);
+}
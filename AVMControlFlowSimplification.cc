@@ -0,0 +1,164 @@
+#include <AVMAnalysis.hh>
+#include <algorithm>
+
+/*
+ * Control flow simplification, on a function that is not in SSA form.
+ *
+ * Repeated until nothing changes:
+ *  - a conditional branch on a constant, or with both targets the same, becomes unconditional;
+ *  - an edge to a block that only branches on is sent straight to where that block branches, when
+ *    the branch is unconditional or tests the same condition as the branch taking the edge;
+ *  - an unconditional branch to a block that compares values known at the end of the branching
+ *    block and then branches on the result is threaded: the comparison is copied into the
+ *    branching block, which jumps directly to the target the comparison selects;
+ *  - a block whose only predecessor branches unconditionally to it is merged into that predecessor.
+ * Blocks left unreachable are then deleted, which removes the empty forwarding blocks.
+ * */
+void AVM::optSimplifyControlFlow(AVMFunction *function) {
+    normaliseControlFlow(function);
+    auto& blocks = function->basicBlocksInFunction;
+    std::set<AVMBasicBlock*> threaded;
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        std::unordered_map<std::string, AVMBasicBlock*> blockOf;
+        for (auto* basicBlock : blocks)
+            blockOf[basicBlock->label] = basicBlock;
+        auto branchOf = [&](AVMBasicBlock* basicBlock) {
+            auto* terminator = getTerminator(basicBlock);
+            if (terminator == nullptr || terminator->getInstructionType() != AVMInstructionType::BRANCH)
+                return static_cast<BranchInstruction*>(nullptr);
+            return dynamic_cast<BranchInstruction*>(terminator);
+        };
+        // Follows a chain of blocks that only branch unconditionally, stopping if it runs in a circle
+        auto forwardingTarget = [&](const std::string& label) {
+            std::set<std::string> visited;
+            std::string target = label;
+            while (blockOf.count(target) && visited.insert(target).second)
+            {
+                auto* basicBlock = blockOf.at(target);
+                auto* branchInstruction = branchOf(basicBlock);
+                if (basicBlock->label == "entry" || basicBlock->sequenceOfInstructions.size() != 1
+                    || branchInstruction == nullptr || branchInstruction->falseTarget != "NULL")
+                    return target;
+                target = branchInstruction->trueTarget;
+            }
+            return label;
+        };
+        // Value of a local at the end of a block, if a constant is moved into it there and no call or
+        // store could have changed it since
+        auto knownValue = [&](AVMBasicBlock* basicBlock, const std::string& operand) -> std::string {
+            if (isAVMConstant(operand))
+                return operand;
+            if (!isAVMLocalVariable(operand))
+                return {};
+            auto& sequence = basicBlock->sequenceOfInstructions;
+            for (auto it = sequence.rbegin(); it != sequence.rend(); it++)
+            {
+                auto type = (*it)->getInstructionType();
+                if (type == AVMInstructionType::STORE || (type == AVMInstructionType::CALL
+                                                          && dynamic_cast<CallInstruction*>(*it)->returnVal != operand))
+                    return {};
+                auto* destination = getInstructionDestination(*it);
+                if (destination == nullptr || *destination != operand)
+                    continue;
+                if ((*it)->getInstructionType() != AVMInstructionType::MV)
+                    return {};
+                auto& value = dynamic_cast<MoveInstruction*>(*it)->valueToBeMoved;
+                return isAVMConstant(value) ? value : std::string();
+            }
+            return {};
+        };
+
+        for (auto* basicBlock : blocks)
+        {
+            auto* branchInstruction = branchOf(basicBlock);
+            if (branchInstruction == nullptr)
+                continue;
+            bool conditional = branchInstruction->falseTarget != "NULL";
+            if (conditional && (isAVMConstant(branchInstruction->dependantComparison)
+                                || branchInstruction->trueTarget == branchInstruction->falseTarget))
+            {
+                bool taken = !isAVMConstant(branchInstruction->dependantComparison)
+                             || getAVMConstant(branchInstruction->dependantComparison) != 0;
+                std::string target = taken ? branchInstruction->trueTarget : branchInstruction->falseTarget;
+                basicBlock->sequenceOfInstructions.back() = createUnconditionalBranch(target);
+                delete branchInstruction;
+                changed = true;
+                continue;
+            }
+
+            for (auto* target : {&branchInstruction->trueTarget, &branchInstruction->falseTarget})
+            {
+                if (*target == "NULL" || !blockOf.count(*target))
+                    continue;
+                auto forwarded = forwardingTarget(*target);
+                if (forwarded != *target) {
+                    *target = forwarded;
+                    changed = true;
+                }
+                auto* successor = blockOf.at(*target);
+                auto* successorBranch = branchOf(successor);
+                if (successor == basicBlock || successorBranch == nullptr || successorBranch->falseTarget == "NULL")
+                    continue;
+                auto& sequence = successor->sequenceOfInstructions;
+                if (conditional && sequence.size() == 1 && successorBranch->dependantComparison == branchInstruction->dependantComparison)
+                {
+                    // The successor tests the condition that has just been tested
+                    std::string threadedTarget = target == &branchInstruction->trueTarget ? successorBranch->trueTarget
+                                                                                           : successorBranch->falseTarget;
+                    if (threadedTarget != successor->label) {
+                        *target = threadedTarget;
+                        changed = true;
+                    }
+                }
+                else if (!conditional && sequence.size() == 2 && !threaded.count(basicBlock)
+                         && sequence.front()->getInstructionType() == AVMInstructionType::CMP)
+                {
+                    auto* comparisonInstruction = dynamic_cast<ComparisonInstruction*>(sequence.front());
+                    std::string op1 = knownValue(basicBlock, comparisonInstruction->op1);
+                    std::string op2 = knownValue(basicBlock, comparisonInstruction->op2);
+                    if (comparisonInstruction->dest != successorBranch->dependantComparison || op1.empty() || op2.empty())
+                        continue;
+                    bool result = performComparison(comparisonInstruction->compareCode, getAVMConstant(op1), getAVMConstant(op2));
+                    std::string threadedTarget = result ? successorBranch->trueTarget : successorBranch->falseTarget;
+                    if (threadedTarget == successor->label)
+                        continue;
+                    insertBeforeTerminator(basicBlock, cloneInstruction(comparisonInstruction));
+                    *target = threadedTarget;
+                    threaded.insert(basicBlock);
+                    changed = true;
+                }
+            }
+        }
+
+        std::unordered_map<std::string, u32> predecessorCount;
+        for (auto* basicBlock : blocks)
+        {
+            for (const auto& target : getBranchTargets(basicBlock))
+                predecessorCount[target]++;
+        }
+        for (auto x = 0; x < blocks.size(); x++)
+        {
+            auto* branchInstruction = branchOf(blocks.at(x));
+            if (branchInstruction == nullptr || branchInstruction->falseTarget != "NULL" || !blockOf.count(branchInstruction->trueTarget))
+                continue;
+            auto* successor = blockOf.at(branchInstruction->trueTarget);
+            if (successor == blocks.at(x) || successor->label == "entry" || predecessorCount[successor->label] != 1)
+                continue;
+            auto& sequence = blocks.at(x)->sequenceOfInstructions;
+            delete sequence.back();
+            sequence.pop_back();
+            sequence.insert(sequence.end(), successor->sequenceOfInstructions.begin(), successor->sequenceOfInstructions.end());
+            successor->sequenceOfInstructions.clear();
+            // Leave the emptied block as an unreachable forwarder, deleted below
+            successor->sequenceOfInstructions.push_back(createUnconditionalBranch(successor->label));
+            predecessorCount[successor->label] = 0;
+            blockOf.erase(successor->label);
+            changed = true;
+        }
+        if (removeUnreachableBlocks(function))
+            changed = true;
+    }
+}
@@ -0,0 +1,60 @@
+#include <AVMAnalysis.hh>
+#include <algorithm>
+
+/*
+ * Global copy propagation over a function in SSA form.
+ *
+ * A move "mov x, y" where x is an SSA value makes x another name for y, provided y cannot change
+ * while x is live: y is a constant, another SSA value, or a parameter that is never reassigned.
+ * Every use of x is rewritten to y (following chains of moves to their source), after which
+ * the moves have no uses left and are deleted.
+ * */
+void AVM::copyPropagation(AVMFunction *function) {
+    AVMDefUse defUse(function);
+
+    std::unordered_map<std::string, std::string> copyOf;
+    for (auto* basicBlock : function->basicBlocksInFunction)
+    {
+        for (auto* instruction : basicBlock->sequenceOfInstructions)
+        {
+            if (instruction->getInstructionType() != AVMInstructionType::MV)
+                continue;
+            auto* moveInstruction = dynamic_cast<MoveInstruction*>(instruction);
+            if (defUse.isSSAValue(moveInstruction->dest) && defUse.isStableValue(moveInstruction->valueToBeMoved)
+                && moveInstruction->dest != moveInstruction->valueToBeMoved)
+                copyOf[moveInstruction->dest] = moveInstruction->valueToBeMoved;
+        }
+    }
+    if (copyOf.empty())
+        return;
+
+    auto source = [&](std::string value) {
+        auto found = copyOf.find(value);
+        while (found != copyOf.end())
+        {
+            value = found->second;
+            found = copyOf.find(value);
+        }
+        return value;
+    };
+    for (auto* basicBlock : function->basicBlocksInFunction)
+    {
+        auto& sequence = basicBlock->sequenceOfInstructions;
+        for (auto* instruction : sequence)
+        {
+            for (auto* operand : getInstructionOperands(instruction))
+            {
+                if (copyOf.count(*operand))
+                    *operand = source(*operand);
+            }
+        }
+        sequence.erase(std::remove_if(sequence.begin(), sequence.end(), [&](AVMInstruction* instruction) {
+            if (instruction->getInstructionType() != AVMInstructionType::MV)
+                return false;
+            if (!copyOf.count(dynamic_cast<MoveInstruction*>(instruction)->dest))
+                return false;
+            delete instruction;
+            return true;
+        }), sequence.end());
+    }
+}
@@ -0,0 +1,89 @@
+#include <AVMAnalysis.hh>
+#include <algorithm>
+
+/*
+ * Mark-and-sweep dead code elimination.
+ *
+ * Instructions with effects outside the values they define are live from the start: stores,
+ * calls, branches, returns, allocas, and anything writing a variable that is not an SSA value
+ * (globals, address-taken locals), as later code may read those through memory.
+ * Liveness then flows from every live instruction to the definitions of the values it reads.
+ * Everything left unmarked is deleted, and calls whose result is never read lose their
+ * return value. Blocks that can no longer be reached from the entry block are removed first.
+ * */
+void AVM::optEliminateDeadCode(AVMFunction *function) {
+    removeUnreachableBlocks(function);
+    AVMDefUse defUse(function);
+
+    std::set<AVMInstruction*> live;
+    std::vector<AVMInstruction*> worklist;
+    auto mark = [&](AVMInstruction* instruction) {
+        if (live.insert(instruction).second)
+            worklist.push_back(instruction);
+    };
+    for (auto* basicBlock : function->basicBlocksInFunction)
+    {
+        for (auto* instruction : basicBlock->sequenceOfInstructions)
+        {
+            switch (instruction->getInstructionType()) {
+                case AVMInstructionType::ARITHMETIC:
+                case AVMInstructionType::LOAD:
+                case AVMInstructionType::GEP:
+                case AVMInstructionType::CMP:
+                case AVMInstructionType::MV:
+                case AVMInstructionType::CSEL:
+                case AVMInstructionType::PHI: {
+                    auto* destination = getInstructionDestination(instruction);
+                    if (destination == nullptr || !defUse.isSSAValue(*destination))
+                        mark(instruction);
+                    break;
+                }
+                default:
+                    mark(instruction);
+                    break;
+            }
+        }
+    }
+    while (!worklist.empty())
+    {
+        auto* instruction = worklist.back();
+        worklist.pop_back();
+        for (auto* operand : getInstructionOperands(instruction))
+        {
+            auto found = defUse.definition.find(*operand);
+            if (found != defUse.definition.end())
+                mark(found->second.first);
+        }
+    }
+
+    auto isRead = [&](const std::string& variable) {
+        auto found = defUse.uses.find(variable);
+        if (found == defUse.uses.end())
+            return false;
+        return std::any_of(found->second.begin(), found->second.end(), [&](const std::pair<AVMInstruction*, u32>& use) {
+            return live.count(use.first) != 0;
+        });
+    };
+    for (auto* basicBlock : function->basicBlocksInFunction)
+    {
+        auto& sequence = basicBlock->sequenceOfInstructions;
+        for (auto* instruction : sequence)
+        {
+            if (instruction->getInstructionType() != AVMInstructionType::CALL)
+                continue;
+            auto& returnVal = dynamic_cast<CallInstruction*>(instruction)->returnVal;
+            if (defUse.isSSAValue(returnVal) && !isRead(returnVal))
+                returnVal.clear();
+        }
+    }
+    for (auto* basicBlock : function->basicBlocksInFunction)
+    {
+        auto& sequence = basicBlock->sequenceOfInstructions;
+        sequence.erase(std::remove_if(sequence.begin(), sequence.end(), [&](AVMInstruction* instruction) {
+            if (live.count(instruction))
+                return false;
+            delete instruction;
+            return true;
+        }), sequence.end());
+    }
+}
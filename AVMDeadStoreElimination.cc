@@ -0,0 +1,119 @@
+#include <AVMAnalysis.hh>
+#include <algorithm>
+#include <deque>
+
+/*
+ * Dead store elimination, on a function in SSA form.
+ *
+ * Stores, and moves or computations into globals and address-taken locals, are writes to memory;
+ * AVMAliasAnalysis decides which instructions may read the memory written and which overwrite all
+ * of it.
+ *
+ * A write is dead when it is overwritten before any possible read on every path from it: either
+ * later in its own block, or in the nearest post-dominating block that overwrites it, with no
+ * possible read in the blocks between. Locals are no longer read once the function returns, so a
+ * write to a local is also dead when no block it reaches reads it, which drops every write to a
+ * local that is never read at all. Volatile stores and the initial values of locals are kept.
+ * */
+void AVM::optEliminateDeadStores(AVMFunction *function) {
+    AVMControlFlowGraph cfg(function);
+    if (cfg.blocks.empty())
+        return;
+    AVMPostDominatorTree postDominatorTree(cfg);
+    AVMDefUse defUse(function);
+    AVMAliasAnalysis aliasAnalysis(function, defUse, globalSyms);
+
+    enum class Effect { None, Read, Write };
+    auto effectOn = [&](AVMInstruction* instruction, const AVMMemoryLocation& location) {
+        if (aliasAnalysis.mayRead(instruction, location))
+            return Effect::Read;
+        return aliasAnalysis.mustWrite(instruction, location) ? Effect::Write : Effect::None;
+    };
+    // First effect on the location in a block, from the given position
+    auto firstEffect = [&](u32 block, u32 from, const AVMMemoryLocation& location) {
+        auto& sequence = cfg.blocks.at(block)->sequenceOfInstructions;
+        for (auto x = from; x < sequence.size(); x++)
+        {
+            auto effect = effectOn(sequence.at(x), location);
+            if (effect != Effect::None)
+                return effect;
+        }
+        return Effect::None;
+    };
+    // Blocks reached from the successors of a block without passing through the stopping block
+    auto blocksBetween = [&](u32 block, i64 stop) {
+        std::set<u32> between;
+        std::deque<u32> worklist(cfg.successors.at(block).begin(), cfg.successors.at(block).end());
+        while (!worklist.empty())
+        {
+            u32 next = worklist.front();
+            worklist.pop_front();
+            if (next == stop || !between.insert(next).second)
+                continue;
+            worklist.insert(worklist.end(), cfg.successors.at(next).begin(), cfg.successors.at(next).end());
+        }
+        return between;
+    };
+    auto isDead = [&](u32 block, u32 position, const AVMMemoryLocation& location) {
+        auto effect = firstEffect(block, position + 1, location);
+        if (effect != Effect::None)
+            return effect == Effect::Write;
+        for (i64 runner = postDominatorTree.immediatePostDominator.at(block); runner != -1;
+             runner = postDominatorTree.immediatePostDominator.at(runner))
+        {
+            for (auto between : blocksBetween(block, runner))
+            {
+                if (firstEffect(between, 0, location) == Effect::Read)
+                    return false;
+            }
+            // Nothing reads a local once the function has returned
+            if (runner == postDominatorTree.exit)
+                return location.base == AVMMemoryLocation::Base::Variable && isAVMLocalVariable(location.name);
+            effect = firstEffect(runner, 0, location);
+            if (effect != Effect::None)
+                return effect == Effect::Write;
+        }
+        return false;
+    };
+
+    std::set<AVMInstruction*> deadStores;
+    for (auto x = 0; x < cfg.blocks.size(); x++)
+    {
+        if (!cfg.reachable.at(x))
+            continue;
+        auto& sequence = cfg.blocks.at(x)->sequenceOfInstructions;
+        for (auto y = 0; y < sequence.size(); y++)
+        {
+            auto* instruction = sequence.at(y);
+            auto* destination = getInstructionDestination(instruction);
+            std::optional<AVMMemoryLocation> location;
+            switch (instruction->getInstructionType()) {
+                case AVMInstructionType::STORE:
+                    if (!dynamic_cast<StoreMemoryInstruction*>(instruction)->isVolatile)
+                        location = aliasAnalysis.locationOf(instruction);
+                    break;
+                case AVMInstructionType::MV:
+                case AVMInstructionType::ARITHMETIC:
+                case AVMInstructionType::CMP:
+                case AVMInstructionType::GEP:
+                    if (aliasAnalysis.isMemoryVariable(*destination))
+                        location = aliasAnalysis.locationOfVariable(*destination);
+                    break;
+                default:
+                    break;
+            }
+            if (location.has_value() && isDead(x, y, *location))
+                deadStores.insert(instruction);
+        }
+    }
+    for (auto* basicBlock : cfg.blocks)
+    {
+        auto& sequence = basicBlock->sequenceOfInstructions;
+        sequence.erase(std::remove_if(sequence.begin(), sequence.end(), [&](AVMInstruction* instruction) {
+            if (!deadStores.count(instruction))
+                return false;
+            delete instruction;
+            return true;
+        }), sequence.end());
+    }
+}
@@ -0,0 +1,212 @@
+#include <AVMAnalysis.hh>
+#include <algorithm>
+
+/*
+ * If-conversion, on a function in SSA form.
+ *
+ * A conditional branch whose two sides meet again straight away, as a diamond where each side is a
+ * block of its own or a triangle where one side goes straight to the join, is replaced by the code
+ * of both sides followed by a conditional select for each phi at the join, so there is no branch
+ * left to mispredict. When the join is also entered from elsewhere its phis stay, taking the
+ * selected values from the branching block. The sides must only be entered from the branch and may only compute SSA
+ * values with arithmetic, comparisons, moves, address generation and selects: none of these can trap on
+ * ARMv8, so running them on the path that did not need them is harmless.
+ *
+ * A branch is converted when the code of both sides and the selects together come to at most
+ * ifConversionThreshold instructions, about the cost of a mispredicted branch. A select choosing
+ * between x and x + 1 computed on its own side becomes a csinc, inverting the comparison when the
+ * increment is on the true side, and a select between a boolean condition and another boolean
+ * becomes an and or an or. Diamonds nested inside a side are converted first.
+ * */
+void AVM::optConvertIfsToSelects(AVMFunction *function) {
+    const u64 ifConversionThreshold = 6;
+
+    normaliseControlFlow(function);
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        AVMControlFlowGraph cfg(function);
+        AVMDefUse defUse(function);
+        auto branchOf = [&](u32 block) {
+            auto* terminator = getTerminator(cfg.blocks.at(block));
+            if (terminator == nullptr || terminator->getInstructionType() != AVMInstructionType::BRANCH)
+                return static_cast<BranchInstruction*>(nullptr);
+            return dynamic_cast<BranchInstruction*>(terminator);
+        };
+        // A side of a branch: entered only from the branching block, running straight on to one block
+        auto isSide = [&](u32 side, u32 block) {
+            auto* branchInstruction = branchOf(side);
+            if (side == block || side == 0 || cfg.predecessors.at(side).size() != 1 || cfg.successors.at(side).size() != 1
+                || branchInstruction == nullptr || branchInstruction->falseTarget != "NULL")
+                return false;
+            auto& sequence = cfg.blocks.at(side)->sequenceOfInstructions;
+            return std::all_of(sequence.begin(), sequence.end() - 1, [&](AVMInstruction* instruction) {
+                auto type = instruction->getInstructionType();
+                auto* destination = getInstructionDestination(instruction);
+                return (type == AVMInstructionType::ARITHMETIC || type == AVMInstructionType::CMP
+                        || type == AVMInstructionType::MV || type == AVMInstructionType::GEP || type == AVMInstructionType::CSEL)
+                       && defUse.isSSAValue(*destination);
+            });
+        };
+        // x, if the value is x + 1 computed on the given side for the join alone
+        auto incrementOf = [&](const std::string& value, i64 side) -> std::string {
+            if (side == -1 || !defUse.isSSAValue(value) || defUse.uses[value].size() != 1)
+                return {};
+            auto [definition, block] = defUse.definition.at(value);
+            if (block != side || definition->getInstructionType() != AVMInstructionType::ARITHMETIC)
+                return {};
+            auto* arithmeticInstruction = dynamic_cast<ArithmeticInstruction*>(definition);
+            if (arithmeticInstruction->opcode != AVMOpcode::ADD || arithmeticInstruction->src2 != "#1")
+                return {};
+            return arithmeticInstruction->src1;
+        };
+
+        for (u32 block = 0; block < cfg.blocks.size() && !changed; block++)
+        {
+            auto* branchInstruction = branchOf(block);
+            if (!cfg.reachable.at(block) || branchInstruction == nullptr || branchInstruction->falseTarget == "NULL"
+                || isAVMConstant(branchInstruction->dependantComparison)
+                || !cfg.labelToIndex.count(branchInstruction->trueTarget) || !cfg.labelToIndex.count(branchInstruction->falseTarget))
+                continue;
+            u32 trueTarget = cfg.labelToIndex.at(branchInstruction->trueTarget);
+            u32 falseTarget = cfg.labelToIndex.at(branchInstruction->falseTarget);
+            if (trueTarget == falseTarget)
+                continue;
+            // The block each side's value comes from at the join, -1 for a side going straight there
+            i64 trueSide = -1;
+            i64 falseSide = -1;
+            u32 join;
+            if (isSide(trueTarget, block) && isSide(falseTarget, block)
+                && cfg.successors.at(trueTarget).front() == cfg.successors.at(falseTarget).front())
+            {
+                trueSide = trueTarget;
+                falseSide = falseTarget;
+                join = cfg.successors.at(trueTarget).front();
+            }
+            else if (isSide(trueTarget, block) && cfg.successors.at(trueTarget).front() == falseTarget) {
+                trueSide = trueTarget;
+                join = falseTarget;
+            }
+            else if (isSide(falseTarget, block) && cfg.successors.at(falseTarget).front() == trueTarget) {
+                falseSide = falseTarget;
+                join = trueTarget;
+            }
+            else
+                continue;
+            if (join == block)
+                continue;
+            // A join entered from elsewhere too keeps its phis, which take the selected values from this block
+            bool joinKeepsPhis = cfg.predecessors.at(join).size() != 2;
+
+            auto& joinSequence = cfg.blocks.at(join)->sequenceOfInstructions;
+            auto firstNonPhi = std::find_if(joinSequence.begin(), joinSequence.end(), [](AVMInstruction* instruction) {
+                return instruction->getInstructionType() != AVMInstructionType::PHI;
+            });
+            u64 cost = firstNonPhi - joinSequence.begin();
+            for (auto side : {trueSide, falseSide})
+            {
+                if (side != -1)
+                    cost += cfg.blocks.at(side)->sequenceOfInstructions.size() - 1;
+            }
+            if (cost > ifConversionThreshold)
+                continue;
+
+            std::string trueLabel = cfg.blocks.at(trueSide != -1 ? trueSide : block)->label;
+            std::string falseLabel = cfg.blocks.at(falseSide != -1 ? falseSide : block)->label;
+            std::vector<std::pair<std::string, std::string>> values;
+            for (auto it = joinSequence.begin(); it != firstNonPhi; it++)
+            {
+                auto& incoming = dynamic_cast<PhiInstruction*>(*it)->incoming;
+                auto valueFrom = [&](const std::string& label) -> std::string {
+                    auto found = std::find_if(incoming.begin(), incoming.end(), [&](const std::pair<std::string, std::string>& i) {
+                        return i.second == label;
+                    });
+                    return found == incoming.end() ? std::string() : found->first;
+                };
+                values.emplace_back(valueFrom(trueLabel), valueFrom(falseLabel));
+            }
+            if (std::any_of(values.begin(), values.end(), [](const std::pair<std::string, std::string>& value) {
+                return value.first.empty() || value.second.empty();
+            }))
+                continue;
+
+            // With a single select, an increment on the true side is moved to the false side by
+            // inverting the comparison, which nothing else reads
+            std::string& condition = branchInstruction->dependantComparison;
+            if (values.size() == 1 && incrementOf(values.front().second, falseSide).empty()
+                && !incrementOf(values.front().first, trueSide).empty()
+                && defUse.isSSAValue(condition) && defUse.uses[condition].size() == 1
+                && defUse.definition.at(condition).first->getInstructionType() == AVMInstructionType::CMP)
+            {
+                auto* comparisonInstruction = dynamic_cast<ComparisonInstruction*>(defUse.definition.at(condition).first);
+                comparisonInstruction->compareCode = invertComparison(comparisonInstruction->compareCode);
+                std::swap(values.front().first, values.front().second);
+                std::swap(trueSide, falseSide);
+            }
+
+            auto& sequence = cfg.blocks.at(block)->sequenceOfInstructions;
+            sequence.pop_back();
+            for (auto side : {trueSide, falseSide})
+            {
+                if (side == -1)
+                    continue;
+                auto& sideSequence = cfg.blocks.at(side)->sequenceOfInstructions;
+                sequence.insert(sequence.end(), sideSequence.begin(), sideSequence.end() - 1);
+                sideSequence.erase(sideSequence.begin(), sideSequence.end() - 1);
+            }
+            for (auto x = 0; x < values.size(); x++)
+            {
+                auto* phi = dynamic_cast<PhiInstruction*>(joinSequence.at(x));
+                auto& [trueValue, falseValue] = values.at(x);
+                std::string dest = phi->dest;
+                if (joinKeepsPhis)
+                {
+                    dest = genSSAName(phi->dest.substr(1, phi->dest.rfind('_') - 1));
+                    auto& incoming = phi->incoming;
+                    incoming.erase(std::remove_if(incoming.begin(), incoming.end(), [&](const std::pair<std::string, std::string>& i) {
+                        return i.second == trueLabel || i.second == falseLabel;
+                    }), incoming.end());
+                    incoming.emplace_back(dest, cfg.blocks.at(block)->label);
+                }
+                if (trueValue == falseValue || (trueValue == "#1" && falseValue == "#0" && defUse.isBooleanValue(condition)))
+                {
+                    // A comparison's result is already the 1 or 0 selected
+                    sequence.push_back(createMove(dest, trueValue == falseValue ? trueValue : condition));
+                    continue;
+                }
+                // Choosing between a boolean condition and another boolean is an and or an or, as a
+                // short-circuited && or || used as a value gives
+                if (defUse.isBooleanValue(condition) && ((falseValue == condition && defUse.isBooleanValue(trueValue))
+                                                         || (trueValue == condition && defUse.isBooleanValue(falseValue))))
+                {
+                    sequence.push_back(falseValue == condition ? createArithmetic(AVMOpcode::AND, dest, condition, trueValue)
+                                                               : createArithmetic(AVMOpcode::ORR, dest, condition, falseValue));
+                    continue;
+                }
+                auto* selectInstruction = new CSELInstruction;
+                selectInstruction->opcode = AVMOpcode::CSEL;
+                selectInstruction->dest = dest;
+                selectInstruction->condition = condition;
+                selectInstruction->trueValue = trueValue;
+                selectInstruction->falseValue = falseValue;
+                auto incremented = incrementOf(falseValue, falseSide);
+                if (!incremented.empty()) {
+                    selectInstruction->falseValue = incremented;
+                    selectInstruction->incrementFalse = true;
+                }
+                sequence.push_back(selectInstruction);
+            }
+            if (!joinKeepsPhis)
+            {
+                for (auto it = joinSequence.begin(); it != firstNonPhi; it++)
+                    delete *it;
+                joinSequence.erase(joinSequence.begin(), firstNonPhi);
+            }
+            sequence.push_back(createUnconditionalBranch(cfg.blocks.at(join)->label));
+            delete branchInstruction;
+            changed = true;
+        }
+        removeUnreachableBlocks(function);
+    }
+}
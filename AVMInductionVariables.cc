@@ -0,0 +1,209 @@
+#include <AVMAnalysis.hh>
+#include <algorithm>
+
+/*
+ * A basic induction variable: a header phi that starts at init on entry to the loop and is
+ * advanced by a loop-invariant step along the back edge.
+ * */
+struct BasicInductionVariable {
+    PhiInstruction* phi;
+    std::string init;
+    std::string step;
+    // Instruction computing the value for the next iteration, and the block it lives in
+    ArithmeticInstruction* increment;
+    u32 incrementBlock;
+};
+
+/*
+ * Induction variable strength reduction and linear function test replacement, on SSA form.
+ *
+ * For each loop with a preheader and a single latch, basic induction variables i are found
+ * among the header's phis. A derived induction variable d = i * c or d = i << k, with c
+ * loop-invariant, is replaced by a new induction variable starting at init * c and advanced by
+ * step * c next to the increment of i, turning a multiply per iteration into an add.
+ *
+ * If i is then only used to compute its next value and to test that value against a
+ * loop-invariant bound n, the test is rewritten to compare the new variable against n * c, so
+ * i itself becomes dead. The rewritten test must give the same answer on every iteration:
+ * this holds for (in)equality whenever c is odd, as multiplying by an odd number cannot make
+ * two different values equal, and for the ordered comparisons when every value involved is a
+ * constant small enough that multiplying by c cannot overflow.
+ * */
+void AVM::optStrengthReduceInductionVariables(AVMFunction *function) {
+    AVMControlFlowGraph cfg(function);
+    if (cfg.blocks.empty())
+        return;
+    AVMDominatorTree dominatorTree(cfg);
+    AVMLoopInfo loopInfo(cfg, dominatorTree);
+
+    for (auto& loop : loopInfo.loops)
+    {
+        i64 preheader = loopInfo.preheader(loop);
+        if (preheader == -1 || loop.latches.size() != 1)
+            continue;
+        auto* preheaderBlock = cfg.blocks.at(preheader);
+        auto* header = cfg.blocks.at(loop.header);
+        auto* latch = cfg.blocks.at(loop.latches.front());
+        AVMDefUse defUse(function);
+        auto isInvariant = [&](const std::string& operand) {
+            if (isAVMConstant(operand))
+                return true;
+            if (!defUse.isStableValue(operand))
+                return false;
+            auto found = defUse.definition.find(operand);
+            return found == defUse.definition.end() || !loop.blocks.count(found->second.second);
+        };
+        // Computes a * b in the preheader, folding it if both are constants
+        auto multiplyInPreheader = [&](const std::string& a, const std::string& b, const std::string& name) {
+            if (isAVMConstant(a) && isAVMConstant(b))
+                return makeAVMConstant(getAVMConstant(a) * getAVMConstant(b));
+            auto* arithmeticInstruction = new ArithmeticInstruction;
+            arithmeticInstruction->opcode = AVMOpcode::MUL;
+            arithmeticInstruction->dest = genSSAName(name);
+            arithmeticInstruction->src1 = a;
+            arithmeticInstruction->src2 = b;
+            insertBeforeTerminator(preheaderBlock, arithmeticInstruction);
+            return arithmeticInstruction->dest;
+        };
+
+        std::vector<BasicInductionVariable> inductionVariables;
+        for (auto* instruction : header->sequenceOfInstructions)
+        {
+            if (instruction->getInstructionType() != AVMInstructionType::PHI)
+                break;
+            auto* phi = dynamic_cast<PhiInstruction*>(instruction);
+            if (phi->incoming.size() != 2 || !defUse.isSSAValue(phi->dest))
+                continue;
+            std::string init, next;
+            for (const auto& [value, label] : phi->incoming)
+            {
+                if (label == preheaderBlock->label)
+                    init = value;
+                else if (label == latch->label)
+                    next = value;
+            }
+            auto found = defUse.definition.find(next);
+            if (init.empty() || next.empty() || found == defUse.definition.end()
+                || found->second.first->getInstructionType() != AVMInstructionType::ARITHMETIC)
+                continue;
+            auto* increment = dynamic_cast<ArithmeticInstruction*>(found->second.first);
+            BasicInductionVariable inductionVariable{phi, init, {}, increment, found->second.second};
+            if (increment->opcode == AVMOpcode::ADD && increment->src1 == phi->dest && isInvariant(increment->src2))
+                inductionVariable.step = increment->src2;
+            else if (increment->opcode == AVMOpcode::ADD && increment->src2 == phi->dest && isInvariant(increment->src1))
+                inductionVariable.step = increment->src1;
+            else if (increment->opcode == AVMOpcode::SUB && increment->src1 == phi->dest && isAVMConstant(increment->src2))
+                inductionVariable.step = makeAVMConstant(-getAVMConstant(increment->src2));
+            if (!inductionVariable.step.empty() && loop.blocks.count(inductionVariable.incrementBlock))
+                inductionVariables.push_back(inductionVariable);
+        }
+
+        for (auto& inductionVariable : inductionVariables)
+        {
+            auto& variable = inductionVariable.phi->dest;
+            auto& incrementBlock = cfg.blocks.at(inductionVariable.incrementBlock)->sequenceOfInstructions;
+            std::string scale;
+            std::string reducedNext;
+            for (auto [user, block] : defUse.uses[variable])
+            {
+                if (user->getInstructionType() != AVMInstructionType::ARITHMETIC || !loop.blocks.count(block))
+                    continue;
+                auto* derived = dynamic_cast<ArithmeticInstruction*>(user);
+                std::string factor;
+                if (derived->opcode == AVMOpcode::MUL && derived->src1 == variable && isInvariant(derived->src2))
+                    factor = derived->src2;
+                else if (derived->opcode == AVMOpcode::MUL && derived->src2 == variable && isInvariant(derived->src1))
+                    factor = derived->src1;
+                else if (derived->opcode == AVMOpcode::SLL && derived->src1 == variable && isAVMConstant(derived->src2)
+                         && getAVMConstant(derived->src2) < 64)
+                    factor = makeAVMConstant(1ull << getAVMConstant(derived->src2));
+                if (factor.empty() || !defUse.isSSAValue(derived->dest) || factor == variable)
+                    continue;
+
+                auto* reduced = new PhiInstruction;
+                reduced->opcode = AVMOpcode::PHI;
+                reduced->dest = genSSAName(derived->dest);
+                auto* advance = new ArithmeticInstruction;
+                advance->opcode = AVMOpcode::ADD;
+                advance->dest = genSSAName(derived->dest);
+                advance->src1 = reduced->dest;
+                advance->src2 = multiplyInPreheader(inductionVariable.step, factor, derived->dest);
+                reduced->incoming.emplace_back(multiplyInPreheader(inductionVariable.init, factor, derived->dest), preheaderBlock->label);
+                reduced->incoming.emplace_back(advance->dest, latch->label);
+                header->sequenceOfInstructions.insert(header->sequenceOfInstructions.begin(), reduced);
+                auto position = std::find(incrementBlock.begin(), incrementBlock.end(), inductionVariable.increment);
+                incrementBlock.insert(position+1, advance);
+
+                for (auto [derivedUser, derivedUserBlock] : defUse.uses[derived->dest])
+                {
+                    for (auto* operand : getInstructionOperands(derivedUser))
+                    {
+                        if (*operand == derived->dest)
+                            *operand = reduced->dest;
+                    }
+                }
+                auto& derivedBlock = cfg.blocks.at(block)->sequenceOfInstructions;
+                derivedBlock.erase(std::find(derivedBlock.begin(), derivedBlock.end(), derived));
+                if (scale.empty()) {
+                    scale = factor;
+                    reducedNext = advance->dest;
+                }
+                delete derived;
+            }
+            if (scale.empty())
+                continue;
+
+            // Linear function test replacement
+            defUse = AVMDefUse(function);
+            auto& variableUses = defUse.uses[variable];
+            if (variableUses.size() != 1 || variableUses.front().first != inductionVariable.increment)
+                continue;
+            ComparisonInstruction* test = nullptr;
+            bool replaceable = true;
+            for (auto [user, block] : defUse.uses[inductionVariable.increment->dest])
+            {
+                if (user == inductionVariable.phi)
+                    continue;
+                if (user->getInstructionType() != AVMInstructionType::CMP || test != nullptr)
+                    replaceable = false;
+                else
+                    test = dynamic_cast<ComparisonInstruction*>(user);
+            }
+            if (!replaceable || test == nullptr)
+                continue;
+            auto& next = inductionVariable.increment->dest;
+            std::string& bound = test->op1 == next ? test->op2 : test->op1;
+            if (!isInvariant(bound) || bound == next)
+                continue;
+            bool equality = test->compareCode == CMPCode::EQ || test->compareCode == CMPCode::NEQ;
+            bool valid = equality && isAVMConstant(scale) && (getAVMConstant(scale) & 1);
+            // An ordered test must be the latch's condition for staying in the loop while the value is below the bound
+            auto* latchBranch = dynamic_cast<BranchInstruction*>(getTerminator(latch));
+            bool staysWhileBelow = latchBranch != nullptr && latchBranch->dependantComparison == test->dest
+                                   && latchBranch->trueTarget == header->label
+                                   && (test->op1 == next ? test->compareCode == CMPCode::LT || test->compareCode == CMPCode::LTEQ
+                                                         : test->compareCode == CMPCode::MT || test->compareCode == CMPCode::MTEQ);
+            if (!valid && staysWhileBelow && isAVMConstant(scale) && isAVMConstant(bound)
+                && isAVMConstant(inductionVariable.init) && isAVMConstant(inductionVariable.step))
+            {
+                // Every value the test sees is at most max(init, bound) + step, which must not overflow when scaled
+                unsigned __int128 largest = std::max(getAVMConstant(inductionVariable.init), getAVMConstant(bound));
+                largest += getAVMConstant(inductionVariable.step);
+                i64 step = getAVMConstant(inductionVariable.step);
+                valid = step > 0 && getAVMConstant(scale) != 0
+                        && largest * getAVMConstant(scale) <= UINT64_MAX;
+            }
+            if (!valid)
+                continue;
+            std::string scaledBound = multiplyInPreheader(bound, scale, next);
+            if (test->op1 == next) {
+                test->op1 = reducedNext;
+                test->op2 = scaledBound;
+            }
+            else {
+                test->op1 = scaledBound;
+                test->op2 = reducedNext;
+            }
+        }
+    }
+}
@@ -0,0 +1,192 @@
+#include <AVMAnalysis.hh>
+#include <algorithm>
+
+/*
+ * Function inlining, run on a caller before anything else so the inlined code is optimised
+ * together with it.
+ *
+ * A call to a function defined in this compilation unit is replaced by a copy of the callee's
+ * blocks: the calling block is split after the call, its first half moves the arguments into the
+ * callee's parameters and branches to the copy of the callee's entry, and every return moves the
+ * returned value into the call's result and branches to the second half. Every variable and
+ * temporary of the callee is given a fresh name, and its locals start from the value the code
+ * generator would have initialised them with.
+ *
+ * A call is inlined when the callee's size, less the instructions the call itself costs, is at
+ * most inlineThreshold, raised by inlineKeywordBonus for functions declared inline and by
+ * singleCallSiteBonus for static functions called only here, as those are deleted afterwards.
+ * Recursive functions, and callees that take the address of a local, are never inlined, and
+ * the caller is not grown beyond maxCallerSize instructions, nor beyond maxFrameSlots stack slots.
+ * Unroll pragmas on the callee's loops carry over to their copies.
+ * */
+void AVM::optInlineCalls(AVMFunction *function) {
+    const u64 inlineThreshold = 12;
+    const u64 inlineKeywordBonus = 36;
+    const u64 singleCallSiteBonus = 200;
+    const u64 maxCallerSize = 1024;
+
+    std::unordered_map<std::string, AVMFunction*> functions;
+    std::unordered_map<std::string, u32> callSites;
+    u64 callerSize = 0;
+    u64 callerSlots = countFrameSlots(function);
+    for (auto* callee : compilationUnit)
+    {
+        functions["@" + callee->name] = callee;
+        for (auto* basicBlock : callee->basicBlocksInFunction)
+        {
+            for (auto* instruction : basicBlock->sequenceOfInstructions)
+            {
+                if (instruction->getInstructionType() == AVMInstructionType::CALL)
+                    callSites[dynamic_cast<CallInstruction*>(instruction)->funcName]++;
+                if (callee == function)
+                    callerSize++;
+            }
+        }
+    }
+
+    // Size of a callee in instructions, or 0 if it cannot be inlined
+    auto inlinableSize = [&](AVMFunction* callee) -> u64 {
+        u64 size = 0;
+        for (auto* basicBlock : callee->basicBlocksInFunction)
+        {
+            for (auto* instruction : basicBlock->sequenceOfInstructions)
+            {
+                auto type = instruction->getInstructionType();
+                if (type == AVMInstructionType::GEP && isAVMLocalVariable(dynamic_cast<GetElementPtr*>(instruction)->src))
+                    return 0;
+                if (type == AVMInstructionType::CALL && dynamic_cast<CallInstruction*>(instruction)->funcName == "@" + callee->name)
+                    return 0;
+                if (type != AVMInstructionType::ALLOCA && type != AVMInstructionType::END)
+                    size++;
+            }
+        }
+        return size;
+    };
+
+    std::vector<CallInstruction*> calls;
+    for (auto* basicBlock : function->basicBlocksInFunction)
+    {
+        for (auto* instruction : basicBlock->sequenceOfInstructions)
+        {
+            if (instruction->getInstructionType() == AVMInstructionType::CALL)
+                calls.push_back(dynamic_cast<CallInstruction*>(instruction));
+        }
+    }
+    normaliseControlFlow(function);
+    for (auto* call : calls)
+    {
+        auto found = functions.find(call->funcName);
+        if (found == functions.end() || found->second == function || found->second->basicBlocksInFunction.empty())
+            continue;
+        auto* callee = found->second;
+        if (call->args.size() != callee->incomingSymbols.size())
+            continue;
+        u64 size = inlinableSize(callee);
+        u64 callCost = call->args.size() + 2;
+        u64 threshold = inlineThreshold;
+        if (callee->isInline)
+            threshold += inlineKeywordBonus;
+        if (callee->isStatic && callSites[call->funcName] == 1)
+            threshold += singleCallSiteBonus;
+        u64 slots = countFrameSlots(callee);
+        if (size == 0 || size > threshold + callCost || callerSize + size > maxCallerSize
+            || callerSlots + slots > maxFrameSlots)
+            continue;
+        callerSize += size;
+        callerSlots += slots;
+        callSites[call->funcName]--;
+        normaliseControlFlow(callee);
+
+        auto& blocks = function->basicBlocksInFunction;
+        auto caller = std::find_if(blocks.begin(), blocks.end(), [&](AVMBasicBlock* basicBlock) {
+            auto& sequence = basicBlock->sequenceOfInstructions;
+            return std::find(sequence.begin(), sequence.end(), call) != sequence.end();
+        });
+        auto& sequence = (*caller)->sequenceOfInstructions;
+        auto position = std::find(sequence.begin(), sequence.end(), call);
+        auto* continuation = new AVMBasicBlock;
+        continuation->label = genLabel();
+        continuation->sequenceOfInstructions.assign(position + 1, sequence.end());
+        sequence.erase(position, sequence.end());
+
+        std::unordered_map<std::string, std::string> names;
+        auto rename = [&](std::string& operand) {
+            if (!isAVMLocalVariable(operand))
+                return;
+            auto name = names.find(operand);
+            if (name == names.end())
+                name = names.emplace(operand, genSSAName(operand)).first;
+            operand = name->second;
+        };
+        std::unordered_map<std::string, std::string> labels;
+        for (auto* basicBlock : callee->basicBlocksInFunction)
+            labels[basicBlock->label] = genLabel();
+        for (const auto& [header, requested] : callee->unrollPragmas)
+        {
+            if (labels.count(header))
+                function->unrollPragmas[labels.at(header)] = requested;
+        }
+
+        for (auto x = 0; x < call->args.size(); x++)
+        {
+            std::string parameter = callee->incomingSymbols.at(x)->identifier;
+            rename(parameter);
+            sequence.push_back(createMove(parameter, call->args.at(x)));
+        }
+        std::vector<AVMBasicBlock*> inlined;
+        for (auto* basicBlock : callee->basicBlocksInFunction)
+        {
+            auto* copy = new AVMBasicBlock;
+            copy->label = labels.at(basicBlock->label);
+            for (auto* instruction : basicBlock->sequenceOfInstructions)
+            {
+                switch (instruction->getInstructionType()) {
+                    case AVMInstructionType::ALLOCA: {
+                        std::string local = dynamic_cast<AllocaInstruction*>(instruction)->target;
+                        u64 value = getInitialValue(callee, local);
+                        rename(local);
+                        sequence.push_back(createMove(local, makeAVMConstant(value)));
+                        continue;
+                    }
+                    case AVMInstructionType::END:
+                        continue;
+                    case AVMInstructionType::RET: {
+                        auto& value = dynamic_cast<RetInstruction*>(instruction)->value;
+                        if (!call->returnVal.empty())
+                        {
+                            std::string returned = value.empty() ? "#0" : value;
+                            rename(returned);
+                            copy->sequenceOfInstructions.push_back(createMove(call->returnVal, returned));
+                        }
+                        copy->sequenceOfInstructions.push_back(createUnconditionalBranch(continuation->label));
+                        continue;
+                    }
+                    default:
+                        break;
+                }
+                auto* clone = cloneInstruction(instruction);
+                for (auto* operand : getInstructionOperands(clone))
+                    rename(*operand);
+                auto* destination = getInstructionDestination(clone);
+                if (destination != nullptr)
+                    rename(*destination);
+                if (clone->getInstructionType() == AVMInstructionType::BRANCH)
+                {
+                    auto* branchInstruction = dynamic_cast<BranchInstruction*>(clone);
+                    branchInstruction->trueTarget = labels.at(branchInstruction->trueTarget);
+                    if (branchInstruction->falseTarget != "NULL")
+                        branchInstruction->falseTarget = labels.at(branchInstruction->falseTarget);
+                }
+                copy->sequenceOfInstructions.push_back(clone);
+            }
+            inlined.push_back(copy);
+        }
+        // Running off the end of the callee returns
+        if (getTerminator(inlined.back()) == nullptr)
+            inlined.back()->sequenceOfInstructions.push_back(createUnconditionalBranch(continuation->label));
+        sequence.push_back(createUnconditionalBranch(inlined.front()->label));
+        inlined.push_back(continuation);
+        blocks.insert(caller + 1, inlined.begin(), inlined.end());
+        delete call;
+    }
+}
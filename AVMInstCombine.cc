@@ -0,0 +1,282 @@
+#include <AVMAnalysis.hh>
+#include <algorithm>
+
+/*
+ * An algebraic identity: an arithmetic instruction whose operands match the pattern always
+ * computes either its other operand or a constant.
+ * */
+enum class IdentityMatch {
+    // x op #constant
+    ConstantRight,
+    // #constant op x
+    ConstantLeft,
+    // x op x
+    SameOperands
+};
+struct IdentityRule {
+    AVMOpcode opcode;
+    IdentityMatch match;
+    u64 constant;
+    // The instruction computes its non-constant operand, otherwise it computes result
+    bool yieldsOperand;
+    u64 result;
+};
+static const IdentityRule identityRules[] = {
+    {AVMOpcode::ADD, IdentityMatch::ConstantRight, 0, true, 0},
+    {AVMOpcode::SUB, IdentityMatch::ConstantRight, 0, true, 0},
+    {AVMOpcode::SUB, IdentityMatch::SameOperands, 0, false, 0},
+    {AVMOpcode::MUL, IdentityMatch::ConstantRight, 1, true, 0},
+    {AVMOpcode::MUL, IdentityMatch::ConstantRight, 0, false, 0},
+    {AVMOpcode::DIV, IdentityMatch::ConstantRight, 1, true, 0},
+    {AVMOpcode::DIV, IdentityMatch::ConstantLeft, 0, false, 0},
+    {AVMOpcode::MOD, IdentityMatch::ConstantRight, 1, false, 0},
+    {AVMOpcode::MOD, IdentityMatch::ConstantLeft, 0, false, 0},
+    {AVMOpcode::MOD, IdentityMatch::SameOperands, 0, false, 0},
+    {AVMOpcode::SLL, IdentityMatch::ConstantRight, 0, true, 0},
+    {AVMOpcode::SLL, IdentityMatch::ConstantLeft, 0, false, 0},
+    {AVMOpcode::SLR, IdentityMatch::ConstantRight, 0, true, 0},
+    {AVMOpcode::SLR, IdentityMatch::ConstantLeft, 0, false, 0},
+    {AVMOpcode::ASR, IdentityMatch::ConstantRight, 0, true, 0},
+    {AVMOpcode::ASR, IdentityMatch::ConstantLeft, 0, false, 0},
+    {AVMOpcode::AND, IdentityMatch::ConstantRight, 0, false, 0},
+    {AVMOpcode::AND, IdentityMatch::ConstantRight, UINT64_MAX, true, 0},
+    {AVMOpcode::AND, IdentityMatch::SameOperands, 0, true, 0},
+    {AVMOpcode::ORR, IdentityMatch::ConstantRight, 0, true, 0},
+    {AVMOpcode::ORR, IdentityMatch::ConstantRight, UINT64_MAX, false, UINT64_MAX},
+    {AVMOpcode::ORR, IdentityMatch::SameOperands, 0, true, 0},
+    {AVMOpcode::XOR, IdentityMatch::ConstantRight, 0, true, 0},
+    {AVMOpcode::XOR, IdentityMatch::SameOperands, 0, false, 0},
+};
+
+/*
+ * Operations where (x op c1) op c2 is x op (c1 op' c2), with op' the operation combining constants.
+ * */
+static bool isReassociable(AVMOpcode opcode) {
+    return (isCommutative(opcode) && opcode != AVMOpcode::MULH) || opcode == AVMOpcode::SLL || opcode == AVMOpcode::SLR;
+}
+
+/*
+ * Instruction combining over a function in SSA form.
+ *
+ * Every arithmetic instruction and comparison is put on a worklist. Taking one off, its operands
+ * are put in canonical order, with constants on the right and subtraction of a constant turned
+ * into addition, and it is then matched against identityRules, folded if every operand is a
+ * constant or the known bits and ranges from AVMValueTracking decide its result, cancelled against
+ * the instruction computing its operand when both negate or both complement, or reassociated
+ * with the instruction computing its first operand when both have a constant second operand, as
+ * in (x + 1) + 2 => x + 3. An instruction found to
+ * compute an existing value is deleted and its uses are rewritten to that value, putting the
+ * users back on the worklist, until nothing more can be simplified.
+ * */
+void AVM::optCombineInstructions(AVMFunction *function) {
+    AVMDefUse defUse(function);
+    AVMValueTracking valueTracking(function, defUse);
+    std::vector<AVMInstruction*> worklist;
+    std::set<AVMInstruction*> queued;
+    std::set<AVMInstruction*> erased;
+    auto push = [&](AVMInstruction* instruction) {
+        auto type = instruction->getInstructionType();
+        if ((type == AVMInstructionType::ARITHMETIC || type == AVMInstructionType::CMP)
+            && !erased.count(instruction) && queued.insert(instruction).second)
+            worklist.push_back(instruction);
+    };
+    for (auto* basicBlock : function->basicBlocksInFunction)
+    {
+        for (auto it = basicBlock->sequenceOfInstructions.rbegin(); it != basicBlock->sequenceOfInstructions.rend(); it++)
+            push(*it);
+    }
+    std::reverse(worklist.begin(), worklist.end());
+
+    auto replaceAllUses = [&](AVMInstruction* instruction, const std::string& value) {
+        auto& dest = *getInstructionDestination(instruction);
+        for (auto [user, block] : defUse.uses[dest])
+        {
+            if (erased.count(user))
+                continue;
+            for (auto* operand : getInstructionOperands(user))
+            {
+                if (*operand == dest)
+                    *operand = value;
+            }
+            if (!isAVMConstant(value))
+                defUse.uses[value].emplace_back(user, block);
+            push(user);
+        }
+        erased.insert(instruction);
+    };
+    // The arithmetic instruction computing an SSA value, if any
+    auto arithmeticDefinition = [&](const std::string& value) -> ArithmeticInstruction* {
+        if (!defUse.isSSAValue(value))
+            return nullptr;
+        auto found = defUse.definition.find(value);
+        if (found == defUse.definition.end() || erased.count(found->second.first)
+            || found->second.first->getInstructionType() != AVMInstructionType::ARITHMETIC)
+            return nullptr;
+        return dynamic_cast<ArithmeticInstruction*>(found->second.first);
+    };
+
+    while (!worklist.empty())
+    {
+        auto* instruction = worklist.back();
+        worklist.pop_back();
+        queued.erase(instruction);
+        if (erased.count(instruction))
+            continue;
+        auto* destination = getInstructionDestination(instruction);
+        bool replaceable = destination != nullptr && defUse.isSSAValue(*destination);
+
+        if (instruction->getInstructionType() == AVMInstructionType::CMP)
+        {
+            auto* comparisonInstruction = dynamic_cast<ComparisonInstruction*>(instruction);
+            auto& op1 = comparisonInstruction->op1;
+            auto& op2 = comparisonInstruction->op2;
+            if (isAVMConstant(op1) && !isAVMConstant(op2)) {
+                std::swap(op1, op2);
+                comparisonInstruction->compareCode = swapComparison(comparisonInstruction->compareCode);
+            }
+            if (!replaceable)
+                continue;
+            if (isAVMConstant(op1) && isAVMConstant(op2)) {
+                replaceAllUses(instruction, makeAVMConstant(performComparison(comparisonInstruction->compareCode,
+                                                                              getAVMConstant(op1), getAVMConstant(op2))));
+                continue;
+            }
+            // Includes comparisons every unsigned value gives the same answer to, such as x < 0
+            auto result = valueTracking.decideComparison(comparisonInstruction->compareCode, op1, op2);
+            if (result)
+                replaceAllUses(instruction, makeAVMConstant(*result));
+            continue;
+        }
+
+        auto* arithmeticInstruction = dynamic_cast<ArithmeticInstruction*>(instruction);
+        auto& src1 = arithmeticInstruction->src1;
+        auto& src2 = arithmeticInstruction->src2;
+        if (isCommutative(arithmeticInstruction->opcode) && isAVMConstant(src1) && !isAVMConstant(src2))
+            std::swap(src1, src2);
+        if (arithmeticInstruction->opcode == AVMOpcode::SUB && !isAVMConstant(src1) && isAVMConstant(src2)
+            && getAVMConstant(src2) != 0)
+        {
+            arithmeticInstruction->opcode = AVMOpcode::ADD;
+            src2 = makeAVMConstant(-getAVMConstant(src2));
+        }
+        if (!replaceable)
+            continue;
+        if (isAVMConstant(src1) && isAVMConstant(src2)) {
+            replaceAllUses(instruction, makeAVMConstant(performCalculation(arithmeticInstruction->opcode,
+                                                                           getAVMConstant(src1), getAVMConstant(src2))));
+            continue;
+        }
+
+        bool simplified = false;
+        for (const auto& rule : identityRules)
+        {
+            if (rule.opcode != arithmeticInstruction->opcode)
+                continue;
+            const std::string* operand = nullptr;
+            if (rule.match == IdentityMatch::SameOperands && src1 == src2)
+                operand = &src1;
+            else if (rule.match == IdentityMatch::ConstantRight && isAVMConstant(src2) && getAVMConstant(src2) == rule.constant)
+                operand = &src1;
+            else if (rule.match == IdentityMatch::ConstantLeft && isAVMConstant(src1) && getAVMConstant(src1) == rule.constant)
+                operand = &src2;
+            if (operand == nullptr)
+                continue;
+            // A value that may change cannot stand in for the instruction everywhere it is used
+            if (rule.yieldsOperand && !defUse.isStableValue(*operand))
+                break;
+            replaceAllUses(instruction, rule.yieldsOperand ? *operand : makeAVMConstant(rule.result));
+            simplified = true;
+            break;
+        }
+        if (simplified)
+            continue;
+
+        // What is known of the operands' bits and ranges can show that the instruction computes a
+        // constant or leaves an operand as it is, as when masking a value that has no bits outside the mask
+        auto facts = valueTracking.facts(*destination);
+        if (facts.isConstant()) {
+            replaceAllUses(instruction, makeAVMConstant(facts.knownOne));
+            continue;
+        }
+        auto facts1 = valueTracking.facts(src1);
+        auto facts2 = valueTracking.facts(src2);
+        const std::string* unchanged = nullptr;
+        switch (arithmeticInstruction->opcode) {
+            case AVMOpcode::AND:
+                if ((~facts1.knownZero & ~facts2.knownOne) == 0)
+                    unchanged = &src1;
+                else if ((~facts2.knownZero & ~facts1.knownOne) == 0)
+                    unchanged = &src2;
+                break;
+            case AVMOpcode::ORR:
+                if ((~facts2.knownZero & ~facts1.knownOne) == 0)
+                    unchanged = &src1;
+                else if ((~facts1.knownZero & ~facts2.knownOne) == 0)
+                    unchanged = &src2;
+                break;
+            case AVMOpcode::MOD:
+                if (facts1.max < facts2.min)
+                    unchanged = &src1;
+                break;
+            case AVMOpcode::ASR:
+                // Without the sign bit set the shift is logical, the form other rules look for
+                if (facts1.knownZero >> 63) {
+                    arithmeticInstruction->opcode = AVMOpcode::SLR;
+                    push(instruction);
+                }
+                break;
+            default:
+                break;
+        }
+        if (unchanged != nullptr && defUse.isStableValue(*unchanged)) {
+            replaceAllUses(instruction, *unchanged);
+            continue;
+        }
+
+        // Negating twice: 0 - (0 - x) => x
+        auto* inner = arithmeticDefinition(src2);
+        if (arithmeticInstruction->opcode == AVMOpcode::SUB && isAVMConstant(src1) && getAVMConstant(src1) == 0
+            && inner != nullptr && inner->opcode == AVMOpcode::SUB && isAVMConstant(inner->src1)
+            && getAVMConstant(inner->src1) == 0 && defUse.isStableValue(inner->src2))
+        {
+            replaceAllUses(instruction, inner->src2);
+            continue;
+        }
+
+        // Complementing twice, as two A_LNOTs lower to: (x ^ -1) ^ -1 => x
+        inner = arithmeticDefinition(src1);
+        if (arithmeticInstruction->opcode == AVMOpcode::XOR && isAVMConstant(src2) && getAVMConstant(src2) == UINT64_MAX
+            && inner != nullptr && inner->opcode == AVMOpcode::XOR && isAVMConstant(inner->src2)
+            && getAVMConstant(inner->src2) == UINT64_MAX && defUse.isStableValue(inner->src1))
+        {
+            replaceAllUses(instruction, inner->src1);
+            continue;
+        }
+
+        if (isReassociable(arithmeticInstruction->opcode) && isAVMConstant(src2) && inner != nullptr
+            && inner->opcode == arithmeticInstruction->opcode && isAVMConstant(inner->src2) && !isAVMConstant(inner->src1)
+            && defUse.isStableValue(inner->src1))
+        {
+            u64 c1 = getAVMConstant(inner->src2);
+            u64 c2 = getAVMConstant(src2);
+            bool isShift = arithmeticInstruction->opcode == AVMOpcode::SLL || arithmeticInstruction->opcode == AVMOpcode::SLR;
+            if (isShift && (c1 >= 64 || c2 >= 64 || c1 + c2 >= 64))
+                continue;
+            src2 = makeAVMConstant(isShift ? c1 + c2 : performCalculation(arithmeticInstruction->opcode, c1, c2));
+            src1 = inner->src1;
+            defUse.uses[src1].emplace_back(instruction, defUse.definition.at(*destination).second);
+            push(instruction);
+        }
+    }
+
+    for (auto* basicBlock : function->basicBlocksInFunction)
+    {
+        auto& sequence = basicBlock->sequenceOfInstructions;
+        sequence.erase(std::remove_if(sequence.begin(), sequence.end(), [&](AVMInstruction* instruction) {
+            if (!erased.count(instruction))
+                return false;
+            delete instruction;
+            return true;
+        }), sequence.end());
+    }
+}
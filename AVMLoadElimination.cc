@@ -0,0 +1,114 @@
+#include <AVMAnalysis.hh>
+#include <algorithm>
+#include <functional>
+
+/*
+ * Redundant load elimination and store-to-load forwarding, on a function in SSA form.
+ *
+ * The dominator tree is walked in preorder with a table of the values known to be in memory at each
+ * address: the result of a load, or the value a store wrote. A load from an address in the table is
+ * deleted and its result replaced everywhere by the known value. Addresses taken from the same
+ * variable are treated as the same address.
+ *
+ * An entry is dropped when an instruction may write its memory, as AVMAliasAnalysis decides, and the
+ * whole table is dropped at a volatile access. The table is also emptied on entering a block with
+ * more than one predecessor, as memory may have been changed on the other paths into it.
+ * */
+void AVM::optEliminateRedundantLoads(AVMFunction *function) {
+    AVMControlFlowGraph cfg(function);
+    if (cfg.blocks.empty())
+        return;
+    AVMDominatorTree dominatorTree(cfg);
+    AVMDefUse defUse(function);
+    AVMAliasAnalysis aliasAnalysis(function, defUse, globalSyms);
+
+    std::unordered_map<std::string, std::string> replacement;
+    auto replace = [&](std::string* operand) {
+        auto found = replacement.find(*operand);
+        if (found != replacement.end())
+            *operand = found->second;
+    };
+    // Addresses are compared by the variable they were taken from, when known
+    auto addressOf = [&](const std::string& operand) -> std::string {
+        if (!defUse.isStableValue(operand))
+            return {};
+        auto definition = defUse.definition.find(operand);
+        if (definition != defUse.definition.end() && definition->second.first != nullptr
+            && definition->second.first->getInstructionType() == AVMInstructionType::GEP)
+            return "&" + dynamic_cast<GetElementPtr*>(definition->second.first)->src;
+        return operand;
+    };
+
+    // Known values by address, with the memory they were found in
+    using AvailableValues = std::unordered_map<std::string, std::pair<std::string, AVMMemoryLocation>>;
+    std::function<void(u32, AvailableValues)> visit = [&](u32 block, AvailableValues available) {
+        if (cfg.predecessors.at(block).size() != 1)
+            available.clear();
+        auto& sequence = cfg.blocks.at(block)->sequenceOfInstructions;
+        sequence.erase(std::remove_if(sequence.begin(), sequence.end(), [&](AVMInstruction* instruction) {
+            auto type = instruction->getInstructionType();
+            if (type != AVMInstructionType::PHI)
+            {
+                for (auto* operand : getInstructionOperands(instruction))
+                    replace(operand);
+            }
+            if (type == AVMInstructionType::LOAD)
+            {
+                auto* loadInstruction = dynamic_cast<LoadMemoryInstruction*>(instruction);
+                if (loadInstruction->isVolatile) {
+                    available.clear();
+                    return false;
+                }
+                std::string address = addressOf(loadInstruction->addrVar);
+                if (address.empty() || !defUse.isSSAValue(loadInstruction->dest))
+                    return false;
+                auto found = available.find(address);
+                if (found == available.end())
+                {
+                    available.emplace(address, std::make_pair(loadInstruction->dest, aliasAnalysis.locationOf(instruction)));
+                    return false;
+                }
+                replacement[loadInstruction->dest] = found->second.first;
+                delete instruction;
+                return true;
+            }
+            if (type == AVMInstructionType::STORE && dynamic_cast<StoreMemoryInstruction*>(instruction)->isVolatile)
+            {
+                available.clear();
+                return false;
+            }
+            for (auto it = available.begin(); it != available.end();)
+            {
+                if (aliasAnalysis.mayWrite(instruction, it->second.second))
+                    it = available.erase(it);
+                else
+                    it++;
+            }
+            if (type == AVMInstructionType::STORE)
+            {
+                auto* storeInstruction = dynamic_cast<StoreMemoryInstruction*>(instruction);
+                std::string address = addressOf(storeInstruction->addrVar);
+                if (!address.empty() && defUse.isStableValue(storeInstruction->src))
+                    available[address] = {storeInstruction->src, aliasAnalysis.locationOf(instruction)};
+            }
+            return false;
+        }), sequence.end());
+        for (auto child : dominatorTree.children.at(block))
+        {
+            visit(child, available);
+        }
+    };
+    visit(0, {});
+
+    // Phis read their operands at the end of a predecessor, which the walk may not have reached yet
+    for (auto* basicBlock : cfg.blocks)
+    {
+        for (auto* instruction : basicBlock->sequenceOfInstructions)
+        {
+            if (instruction->getInstructionType() != AVMInstructionType::PHI)
+                break;
+            for (auto* operand : getInstructionOperands(instruction))
+                replace(operand);
+        }
+    }
+}
@@ -0,0 +1,187 @@
+#include <AVMAnalysis.hh>
+#include <algorithm>
+
+/*
+ * Gives every loop a preheader: a block that is the only way into the loop from outside and
+ * that branches straight to the header, so code can be placed where it runs once before the loop.
+ * Predecessors of the header outside the loop are redirected to the new block, and the incoming
+ * values of the header's phis from those predecessors are merged by a phi in the preheader.
+ * Returns true if any block was inserted.
+ * */
+bool AVM::insertLoopPreheaders(AVMFunction *function) {
+    normaliseControlFlow(function);
+    AVMControlFlowGraph cfg(function);
+    AVMDominatorTree dominatorTree(cfg);
+    AVMLoopInfo loopInfo(cfg, dominatorTree);
+    bool changed = false;
+    for (auto& loop : loopInfo.loops)
+    {
+        if (loopInfo.preheader(loop) != -1)
+            continue;
+        std::vector<AVMBasicBlock*> outside;
+        for (auto predecessor : cfg.predecessors.at(loop.header))
+        {
+            if (!loop.blocks.count(predecessor) && cfg.reachable.at(predecessor))
+                outside.push_back(cfg.blocks.at(predecessor));
+        }
+        if (outside.empty())
+            continue;
+        auto* header = cfg.blocks.at(loop.header);
+        auto* preheader = new AVMBasicBlock;
+        preheader->label = genLabel();
+        for (auto* predecessor : outside)
+        {
+            retargetBranch(predecessor, header->label, preheader->label);
+        }
+        for (auto* instruction : header->sequenceOfInstructions)
+        {
+            if (instruction->getInstructionType() != AVMInstructionType::PHI)
+                break;
+            auto* phi = dynamic_cast<PhiInstruction*>(instruction);
+            std::vector<std::pair<std::string, std::string>> entering;
+            auto& incoming = phi->incoming;
+            incoming.erase(std::remove_if(incoming.begin(), incoming.end(), [&](const std::pair<std::string, std::string>& i) {
+                bool fromOutside = std::any_of(outside.begin(), outside.end(), [&](AVMBasicBlock* basicBlock) {
+                    return basicBlock->label == i.second;
+                });
+                if (fromOutside)
+                    entering.push_back(i);
+                return fromOutside;
+            }), incoming.end());
+            if (entering.empty())
+                continue;
+            bool sameValue = std::all_of(entering.begin(), entering.end(), [&](const std::pair<std::string, std::string>& i) {
+                return i.first == entering.front().first;
+            });
+            if (sameValue)
+            {
+                incoming.emplace_back(entering.front().first, preheader->label);
+                continue;
+            }
+            auto* merge = new PhiInstruction;
+            merge->opcode = AVMOpcode::PHI;
+            merge->dest = genSSAName(phi->dest);
+            merge->incoming = entering;
+            preheader->sequenceOfInstructions.push_back(merge);
+            incoming.emplace_back(merge->dest, preheader->label);
+        }
+        preheader->sequenceOfInstructions.push_back(createUnconditionalBranch(header->label));
+        auto& blocks = function->basicBlocksInFunction;
+        blocks.insert(std::find(blocks.begin(), blocks.end(), header), preheader);
+        changed = true;
+    }
+    return changed;
+}
+
+/*
+ * Loop-invariant code motion.
+ *
+ * Loops are visited innermost first. An instruction computing an SSA value is invariant when
+ * every operand is a constant or is defined outside the loop; a global or address-taken variable
+ * only counts if nothing in the loop may write it, as AVMAliasAnalysis decides.
+ * Invariant arithmetic, comparisons, moves and address generation are moved to the end of the
+ * preheader, repeatedly, so that chains of invariant computations move together. None of these
+ * can trap on ARMv8, so they are hoisted even from blocks that do not run on every iteration.
+ * Loads are only hoisted from blocks that run whenever the loop is left, so a load the original
+ * program would never have performed is never introduced, and only when nothing in the loop may
+ * write the memory they read. Volatile loads stay put.
+ * */
+void AVM::optHoistLoopInvariants(AVMFunction *function) {
+    insertLoopPreheaders(function);
+    AVMControlFlowGraph cfg(function);
+    AVMDominatorTree dominatorTree(cfg);
+    AVMLoopInfo loopInfo(cfg, dominatorTree);
+    AVMDefUse defUse(function);
+    AVMAliasAnalysis aliasAnalysis(function, defUse, globalSyms);
+
+    for (auto& loop : loopInfo.loops)
+    {
+        i64 preheader = loopInfo.preheader(loop);
+        if (preheader == -1)
+            continue;
+        std::vector<AVMInstruction*> writes;
+        std::set<std::string> definedInLoop;
+        for (auto block : loop.blocks)
+        {
+            for (auto* instruction : cfg.blocks.at(block)->sequenceOfInstructions)
+            {
+                auto type = instruction->getInstructionType();
+                auto* destination = getInstructionDestination(instruction);
+                if (type == AVMInstructionType::CALL || type == AVMInstructionType::STORE
+                    || (destination != nullptr && aliasAnalysis.isMemoryVariable(*destination)))
+                    writes.push_back(instruction);
+                if (destination != nullptr)
+                    definedInLoop.insert(*destination);
+            }
+        }
+        auto writtenInLoop = [&](const AVMMemoryLocation& location) {
+            return std::any_of(writes.begin(), writes.end(), [&](AVMInstruction* instruction) {
+                return aliasAnalysis.mayWrite(instruction, location);
+            });
+        };
+        std::vector<u32> exiting;
+        for (auto block : loop.blocks)
+        {
+            for (auto successor : cfg.successors.at(block))
+            {
+                if (!loop.blocks.count(successor)) {
+                    exiting.push_back(block);
+                    break;
+                }
+            }
+        }
+        auto isInvariant = [&](const std::string& operand) {
+            if (isAVMConstant(operand))
+                return true;
+            if (definedInLoop.count(operand))
+                return false;
+            return defUse.isStableValue(operand) || !writtenInLoop(aliasAnalysis.locationOfVariable(operand));
+        };
+        auto runsOnExit = [&](u32 block) {
+            return !exiting.empty() && std::all_of(exiting.begin(), exiting.end(), [&](u32 exitingBlock) {
+                return dominatorTree.dominates(block, exitingBlock);
+            });
+        };
+
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            for (auto block : cfg.reversePostOrder)
+            {
+                if (!loop.blocks.count(block))
+                    continue;
+                auto& sequence = cfg.blocks.at(block)->sequenceOfInstructions;
+                for (auto it = sequence.begin(); it != sequence.end();)
+                {
+                    auto* instruction = *it;
+                    auto type = instruction->getInstructionType();
+                    bool hoistable = type == AVMInstructionType::ARITHMETIC || type == AVMInstructionType::CMP
+                                     || type == AVMInstructionType::MV || type == AVMInstructionType::GEP
+                                     || (type == AVMInstructionType::LOAD && runsOnExit(block)
+                                         && !dynamic_cast<LoadMemoryInstruction*>(instruction)->isVolatile
+                                         && !writtenInLoop(aliasAnalysis.locationOf(instruction)));
+                    auto* destination = getInstructionDestination(instruction);
+                    if (hoistable)
+                    {
+                        hoistable = destination != nullptr && defUse.isSSAValue(*destination);
+                        for (auto* operand : getInstructionOperands(instruction))
+                        {
+                            if (!isInvariant(*operand))
+                                hoistable = false;
+                        }
+                    }
+                    if (!hoistable)
+                    {
+                        it++;
+                        continue;
+                    }
+                    definedInLoop.erase(*destination);
+                    insertBeforeTerminator(cfg.blocks.at(preheader), instruction);
+                    it = sequence.erase(it);
+                    changed = true;
+                }
+            }
+        }
+    }
+}
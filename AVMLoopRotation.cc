@@ -0,0 +1,71 @@
+#include <AVMAnalysis.hh>
+#include <algorithm>
+
+/*
+ * Loop rotation: turns a loop that tests its condition at the top into a guarded do-while.
+ *
+ *     preheader: br test                 preheader: <test>, br cond body exit
+ *     test:      <test>, br cond body exit
+ *     body:      ...                     body:      ...
+ *     latch:     br test                 latch:     <test>, br cond body exit
+ *
+ * The header's instructions are copied into the preheader, as a guard that skips the loop
+ * entirely, and into every latch, so each iteration ends in a single conditional branch back to
+ * the body. The original header is left unreachable and removed.
+ *
+ * This runs before SSA construction: the copies define the same variables as the original
+ * header, which is only correct while every name may be assigned more than once.
+ * Headers longer than maxRotatedHeaderSize instructions are not copied.
+ * */
+void AVM::optRotateLoops(AVMFunction *function) {
+    const u32 maxRotatedHeaderSize = 16;
+    insertLoopPreheaders(function);
+    AVMControlFlowGraph cfg(function);
+    AVMDominatorTree dominatorTree(cfg);
+    AVMLoopInfo loopInfo(cfg, dominatorTree);
+
+    bool changed = false;
+    for (auto& loop : loopInfo.loops)
+    {
+        i64 preheader = loopInfo.preheader(loop);
+        auto* header = cfg.blocks.at(loop.header);
+        auto* terminator = getTerminator(header);
+        if (preheader == -1 || terminator == nullptr || terminator->getInstructionType() != AVMInstructionType::BRANCH)
+            continue;
+        auto* branchInstruction = dynamic_cast<BranchInstruction*>(terminator);
+        if (branchInstruction->falseTarget == "NULL" || header->sequenceOfInstructions.size() > maxRotatedHeaderSize)
+            continue;
+        // The header must be the loop's only exit test, and every latch must jump straight back to it
+        u32 exitingTargets = 0;
+        for (auto successor : cfg.successors.at(loop.header))
+        {
+            if (!loop.blocks.count(successor))
+                exitingTargets++;
+        }
+        if (exitingTargets != 1)
+            continue;
+        bool latchesUnconditional = std::all_of(loop.latches.begin(), loop.latches.end(), [&](u32 latch) {
+            return latch != loop.header && cfg.successors.at(latch).size() == 1;
+        });
+        if (!latchesUnconditional)
+            continue;
+
+        auto copyHeaderInto = [&](AVMBasicBlock* basicBlock) {
+            auto& sequence = basicBlock->sequenceOfInstructions;
+            delete sequence.back();
+            sequence.pop_back();
+            for (auto* instruction : header->sequenceOfInstructions)
+            {
+                sequence.push_back(cloneInstruction(instruction));
+            }
+        };
+        copyHeaderInto(cfg.blocks.at(preheader));
+        for (auto latch : loop.latches)
+        {
+            copyHeaderInto(cfg.blocks.at(latch));
+        }
+        changed = true;
+    }
+    if (changed)
+        removeUnreachableBlocks(function);
+}
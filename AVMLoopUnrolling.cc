@@ -0,0 +1,302 @@
+#include <AVMAnalysis.hh>
+#include <algorithm>
+
+/*
+ * How a loop is to be unrolled. The loop's body is laid out copies times in a row, after
+ * peeled copies that run before the loop is entered.
+ * */
+struct UnrollDecision {
+    std::string header;
+    u64 copies;
+    u64 peeled;
+    // The loop's exit test is only kept where it can fail: when the trip count is known this is the
+    // last copy of the loop, or nowhere once the loop is unrolled completely
+    bool tripCountKnown;
+    bool complete;
+};
+
+/*
+ * Number of times the header of a loop in SSA form runs, or 0 if it is not known at compile time.
+ *
+ * The loop must be left from a single block that runs on every iteration, through a comparison
+ * of a constant against a basic induction variable with a constant start and step (either the
+ * header phi or its value for the next iteration). The comparison is then evaluated for each
+ * iteration in turn until it leaves the loop, giving up after maxSimulatedTrips iterations.
+ * */
+static u64 computeTripCount(const AVMLoop& loop, u32 preheader, AVMControlFlowGraph& cfg, AVMDominatorTree& dominatorTree,
+                            AVMDefUse& defUse) {
+    const u64 maxSimulatedTrips = 65536;
+    if (loop.latches.size() != 1)
+        return 0;
+    i64 exiting = -1;
+    for (auto block : loop.blocks)
+    {
+        for (auto successor : cfg.successors.at(block))
+        {
+            if (loop.blocks.count(successor))
+                continue;
+            if (exiting != -1 && exiting != block)
+                return 0;
+            exiting = block;
+        }
+    }
+    if (exiting == -1 || !dominatorTree.dominates(exiting, loop.latches.front()))
+        return 0;
+    auto* branchInstruction = dynamic_cast<BranchInstruction*>(getTerminator(cfg.blocks.at(exiting)));
+    if (branchInstruction == nullptr || branchInstruction->falseTarget == "NULL")
+        return 0;
+    bool staysWhenTrue = loop.blocks.count(cfg.labelToIndex.at(branchInstruction->trueTarget));
+    auto found = defUse.definition.find(branchInstruction->dependantComparison);
+    if (found == defUse.definition.end() || found->second.first->getInstructionType() != AVMInstructionType::CMP)
+        return 0;
+    auto* comparisonInstruction = dynamic_cast<ComparisonInstruction*>(found->second.first);
+
+    // Value of an operand of the comparison on iteration k, as its start and step
+    auto inductionVariable = [&](const std::string& operand, u64& start, u64& step) {
+        if (isAVMConstant(operand)) {
+            start = getAVMConstant(operand);
+            step = 0;
+            return true;
+        }
+        for (auto* instruction : cfg.blocks.at(loop.header)->sequenceOfInstructions)
+        {
+            if (instruction->getInstructionType() != AVMInstructionType::PHI)
+                break;
+            auto* phi = dynamic_cast<PhiInstruction*>(instruction);
+            if (phi->incoming.size() != 2)
+                continue;
+            std::string init, next;
+            for (const auto& [value, label] : phi->incoming)
+            {
+                if (label == cfg.blocks.at(preheader)->label)
+                    init = value;
+                else if (label == cfg.blocks.at(loop.latches.front())->label)
+                    next = value;
+            }
+            if (operand != phi->dest && operand != next)
+                continue;
+            auto increment = defUse.definition.find(next);
+            if (!isAVMConstant(init) || increment == defUse.definition.end()
+                || increment->second.first->getInstructionType() != AVMInstructionType::ARITHMETIC)
+                return false;
+            auto* arithmeticInstruction = dynamic_cast<ArithmeticInstruction*>(increment->second.first);
+            if (arithmeticInstruction->opcode == AVMOpcode::ADD && arithmeticInstruction->src1 == phi->dest
+                && isAVMConstant(arithmeticInstruction->src2))
+                step = getAVMConstant(arithmeticInstruction->src2);
+            else if (arithmeticInstruction->opcode == AVMOpcode::ADD && arithmeticInstruction->src2 == phi->dest
+                     && isAVMConstant(arithmeticInstruction->src1))
+                step = getAVMConstant(arithmeticInstruction->src1);
+            else if (arithmeticInstruction->opcode == AVMOpcode::SUB && arithmeticInstruction->src1 == phi->dest
+                     && isAVMConstant(arithmeticInstruction->src2))
+                step = -getAVMConstant(arithmeticInstruction->src2);
+            else
+                return false;
+            start = getAVMConstant(init) + (operand == next ? step : 0);
+            return true;
+        }
+        return false;
+    };
+    u64 start1, step1, start2, step2;
+    if (!inductionVariable(comparisonInstruction->op1, start1, step1)
+        || !inductionVariable(comparisonInstruction->op2, start2, step2) || (step1 != 0 && step2 != 0))
+        return 0;
+    for (u64 trip = 0; trip < maxSimulatedTrips; trip++)
+    {
+        bool result = performComparison(comparisonInstruction->compareCode, start1 + trip * step1, start2 + trip * step2);
+        if (result != staysWhenTrue)
+            return trip + 1;
+    }
+    return 0;
+}
+
+/*
+ * Loop unrolling.
+ *
+ * Innermost loops are unrolled on SSA form, where their trip count can be worked out, and the
+ * copies are made with the function taken out of SSA form, where duplicated code can assign the
+ * same names. A loop with a known trip count small enough that the whole of it fits in
+ * maxUnrolledSize instructions is unrolled completely, leaving straight-line code. Otherwise it is
+ * unrolled by unrollFactor, reduced until the unrolled body fits, with the exit test removed from
+ * every copy but the last; when the factor does not divide the trip count the remaining
+ * iterations are peeled off in front of the loop.
+ *
+ * A loop marked with #pragma unroll(N) is unrolled N times instead, up to maxRequestedUnrolledSize
+ * instructions, keeping every exit test if its trip count is not known; a bare #pragma unroll asks
+ * for complete unrolling. The pass never unrolls a loop by itself when its trip count is unknown.
+ *
+ * Every copy of a value defined in the loop gets a stack slot of its own, so no loop is unrolled
+ * further than keeps the function within maxFrameSlots, requested or not.
+ * */
+void AVM::optUnrollLoops(AVMFunction *function) {
+    const u64 maxUnrolledSize = 128;
+    const u64 maxRequestedUnrolledSize = 2048;
+    insertLoopPreheaders(function);
+    AVMControlFlowGraph cfg(function);
+    if (cfg.blocks.empty())
+        return;
+    AVMDominatorTree dominatorTree(cfg);
+    AVMLoopInfo loopInfo(cfg, dominatorTree);
+    AVMDefUse defUse(function);
+    u64 frameSlots = countFrameSlots(function);
+
+    std::vector<UnrollDecision> decisions;
+    for (auto x = 0; x < loopInfo.loops.size(); x++)
+    {
+        auto& loop = loopInfo.loops.at(x);
+        bool innermost = std::none_of(loopInfo.loops.begin(), loopInfo.loops.end(), [&](const AVMLoop& other) {
+            return other.parent == x;
+        });
+        i64 preheader = loopInfo.preheader(loop);
+        if (!innermost || preheader == -1)
+            continue;
+        auto& label = cfg.blocks.at(loop.header)->label;
+        auto pragma = function->unrollPragmas.find(label);
+        u64 requested = pragma == function->unrollPragmas.end() ? 0 : pragma->second;
+        u64 size = 0;
+        // Every copy of a value defined in the loop takes a stack slot of its own
+        u64 defined = 0;
+        for (auto block : loop.blocks)
+        {
+            size += cfg.blocks.at(block)->sequenceOfInstructions.size();
+            for (auto* instruction : cfg.blocks.at(block)->sequenceOfInstructions)
+            {
+                auto* destination = getInstructionDestination(instruction);
+                if (destination != nullptr && isAVMLocalVariable(*destination))
+                    defined++;
+            }
+        }
+        u64 tripCount = computeTripCount(loop, preheader, cfg, dominatorTree, defUse);
+        u64 limit = requested == 0 ? maxUnrolledSize : maxRequestedUnrolledSize;
+        u64 fitting = limit / size;
+        if (defined != 0)
+            fitting = std::min(fitting, (maxFrameSlots - std::min(frameSlots, maxFrameSlots)) / defined + 1);
+
+        UnrollDecision decision{label, 1, 0, tripCount != 0, false};
+        if (requested == 1 || (requested == 0 && unrollFactor <= 1))
+            continue;
+        if (tripCount != 0 && (requested == 0 || requested >= tripCount) && tripCount <= fitting)
+        {
+            decision.copies = tripCount;
+            decision.complete = true;
+        }
+        else if (requested != UINT64_MAX)
+        {
+            if (tripCount == 0 && requested == 0)
+                continue;
+            decision.copies = std::min(requested == 0 ? unrollFactor : requested, fitting);
+            if (requested == 0)
+                decision.copies = std::min(decision.copies, tripCount / 2);
+            if (decision.copies <= 1)
+                continue;
+            if (tripCount != 0)
+                decision.peeled = tripCount % decision.copies;
+        }
+        if (decision.copies + decision.peeled > fitting)
+            continue;
+        if (decision.copies > 1 || decision.complete)
+        {
+            decisions.push_back(decision);
+            frameSlots += defined * (decision.copies + decision.peeled - 1);
+        }
+    }
+    if (decisions.empty())
+        return;
+
+    destructSSA(function);
+    normaliseControlFlow(function);
+    for (auto& decision : decisions)
+    {
+        AVMControlFlowGraph loopCFG(function);
+        AVMDominatorTree loopDominatorTree(loopCFG);
+        AVMLoopInfo loops(loopCFG, loopDominatorTree);
+        auto found = std::find_if(loops.loops.begin(), loops.loops.end(), [&](const AVMLoop& loop) {
+            return loopCFG.blocks.at(loop.header)->label == decision.header;
+        });
+        if (found == loops.loops.end() || found->latches.size() != 1)
+            continue;
+        auto& loop = *found;
+        auto* header = loopCFG.blocks.at(loop.header);
+        // Taking the function out of SSA form may have split edges, but the loop is still left from one block
+        AVMBasicBlock* exiting = nullptr;
+        std::string stayTarget, exitTarget;
+        for (auto block : loop.blocks)
+        {
+            for (auto successor : loopCFG.successors.at(block))
+            {
+                if (loop.blocks.count(successor))
+                    continue;
+                exiting = loopCFG.blocks.at(block);
+                exitTarget = loopCFG.blocks.at(successor)->label;
+            }
+        }
+        if (decision.tripCountKnown)
+        {
+            auto targets = getBranchTargets(exiting);
+            stayTarget = targets.front() == exitTarget ? targets.back() : targets.front();
+        }
+
+        // Every copy of the loop, in the order they run, mapping each original label to its copy
+        std::vector<std::unordered_map<std::string, std::string>> copies(decision.peeled + decision.copies);
+        std::vector<AVMBasicBlock*> newBlocks;
+        std::unordered_map<std::string, AVMBasicBlock*> blockOf;
+        for (auto block : loop.blocks)
+            blockOf[loopCFG.blocks.at(block)->label] = loopCFG.blocks.at(block);
+        for (auto copy = 0; copy < copies.size(); copy++)
+        {
+            bool original = copy == decision.peeled;
+            for (auto block : loop.blocks)
+            {
+                auto& label = loopCFG.blocks.at(block)->label;
+                copies.at(copy)[label] = original ? label : genLabel();
+            }
+            if (original)
+                continue;
+            for (auto block : loop.blocks)
+            {
+                auto* basicBlock = new AVMBasicBlock;
+                basicBlock->label = copies.at(copy).at(loopCFG.blocks.at(block)->label);
+                for (auto* instruction : loopCFG.blocks.at(block)->sequenceOfInstructions)
+                    basicBlock->sequenceOfInstructions.push_back(cloneInstruction(instruction));
+                newBlocks.push_back(basicBlock);
+                blockOf[basicBlock->label] = basicBlock;
+            }
+        }
+        // Peeled copies run first, so the loop is now entered through the first copy
+        for (auto predecessor : loopCFG.predecessors.at(loop.header))
+        {
+            if (!loop.blocks.count(predecessor))
+                retargetBranch(loopCFG.blocks.at(predecessor), header->label, copies.front().at(header->label));
+        }
+        for (auto copy = 0; copy < copies.size(); copy++)
+        {
+            auto& labels = copies.at(copy);
+            bool last = copy + 1 == copies.size();
+            bool lastPeeled = copy + 1 == decision.peeled;
+            std::string nextHeader = last || lastPeeled ? header->label : copies.at(copy + 1).at(header->label);
+            for (auto block : loop.blocks)
+            {
+                auto* basicBlock = blockOf.at(labels.at(loopCFG.blocks.at(block)->label));
+                if (loopCFG.blocks.at(block) == exiting && decision.tripCountKnown && (decision.complete || !last))
+                {
+                    delete basicBlock->sequenceOfInstructions.back();
+                    basicBlock->sequenceOfInstructions.back() = createUnconditionalBranch(last ? exitTarget : stayTarget);
+                }
+                auto* branchInstruction = dynamic_cast<BranchInstruction*>(getTerminator(basicBlock));
+                if (branchInstruction == nullptr)
+                    continue;
+                for (auto* target : {&branchInstruction->trueTarget, &branchInstruction->falseTarget})
+                {
+                    if (*target == header->label)
+                        *target = nextHeader;
+                    else if (labels.count(*target))
+                        *target = labels.at(*target);
+                }
+            }
+        }
+        auto& blocks = function->basicBlocksInFunction;
+        auto position = std::find(blocks.begin(), blocks.end(), loopCFG.blocks.at(*loop.blocks.rbegin()));
+        blocks.insert(position + 1, newBlocks.begin(), newBlocks.end());
+    }
+    removeUnreachableBlocks(function);
+    constructSSA(function);
+}
@@ -0,0 +1,169 @@
+#include <AVMAnalysis.hh>
+#include <algorithm>
+
+/*
+ * A loop to be unswitched: the block whose branch tests a condition the loop never changes.
+ * */
+struct UnswitchDecision {
+    std::string header;
+    std::string branchBlock;
+    std::string condition;
+};
+
+/*
+ * Loop unswitching.
+ *
+ * A conditional branch inside a loop whose condition is computed before the loop takes the same
+ * direction on every iteration. The test is moved in front of the loop, which is duplicated: the
+ * original runs when the condition holds, with the branch replaced by a jump to its true target,
+ * and the copy runs otherwise, jumping to the false target. Each loop then has one fewer branch
+ * per iteration, and the side it no longer reaches is removed.
+ *
+ * As with unrolling, loops are picked on SSA form and copied with the function taken out of it.
+ * The outermost loop the condition is invariant in is unswitched, so the test runs only once.
+ * A loop is only copied if it has at most maxUnswitchedSize instructions, and the pass stops once
+ * it has added maxUnswitchGrowth instructions to the function, as every unswitch of a loop that
+ * holds several invariant conditions doubles it again.
+ * */
+void AVM::optUnswitchLoops(AVMFunction *function) {
+    const u64 maxUnswitchedSize = 64;
+    const u64 maxUnswitchGrowth = 256;
+    u64 growth = 0;
+    while (growth < maxUnswitchGrowth)
+    {
+        insertLoopPreheaders(function);
+        AVMControlFlowGraph cfg(function);
+        if (cfg.blocks.empty())
+            return;
+        AVMDominatorTree dominatorTree(cfg);
+        AVMLoopInfo loopInfo(cfg, dominatorTree);
+        AVMDefUse defUse(function);
+
+        std::vector<UnswitchDecision> decisions;
+        std::set<u32> claimed;
+        // Outermost loops first, as loops are ordered innermost first
+        for (auto x = loopInfo.loops.size(); x-- > 0;)
+        {
+            auto& loop = loopInfo.loops.at(x);
+            if (loopInfo.preheader(loop) == -1 || std::any_of(loop.blocks.begin(), loop.blocks.end(), [&](u32 block) {
+                    return claimed.count(block);
+                }))
+                continue;
+            u64 size = 0;
+            for (auto block : loop.blocks)
+                size += cfg.blocks.at(block)->sequenceOfInstructions.size();
+            if (size > maxUnswitchedSize || growth + size > maxUnswitchGrowth)
+                continue;
+            for (auto block : loop.blocks)
+            {
+                auto* branchInstruction = dynamic_cast<BranchInstruction*>(getTerminator(cfg.blocks.at(block)));
+                if (branchInstruction == nullptr || branchInstruction->falseTarget == "NULL"
+                    || branchInstruction->trueTarget == branchInstruction->falseTarget)
+                    continue;
+                auto& condition = branchInstruction->dependantComparison;
+                if (isAVMConstant(condition) || !defUse.isStableValue(condition))
+                    continue;
+                auto found = defUse.definition.find(condition);
+                if (found != defUse.definition.end() && loop.blocks.count(found->second.second))
+                    continue;
+                decisions.push_back({cfg.blocks.at(loop.header)->label, cfg.blocks.at(block)->label, condition});
+                claimed.insert(loop.blocks.begin(), loop.blocks.end());
+                growth += size + 1;
+                break;
+            }
+        }
+        if (decisions.empty())
+            return;
+
+        destructSSA(function);
+        normaliseControlFlow(function);
+        for (auto& decision : decisions)
+        {
+            AVMControlFlowGraph loopCFG(function);
+            AVMDominatorTree loopDominatorTree(loopCFG);
+            AVMLoopInfo loops(loopCFG, loopDominatorTree);
+            auto found = std::find_if(loops.loops.begin(), loops.loops.end(), [&](const AVMLoop& loop) {
+                return loopCFG.blocks.at(loop.header)->label == decision.header;
+            });
+            if (found == loops.loops.end())
+                continue;
+            auto& loop = *found;
+            auto* header = loopCFG.blocks.at(loop.header);
+            // Copies made when leaving SSA form must not have put a definition of the condition in the loop
+            bool invariant = true;
+            AVMBasicBlock* branchBlock = nullptr;
+            for (auto block : loop.blocks)
+            {
+                auto* basicBlock = loopCFG.blocks.at(block);
+                if (basicBlock->label == decision.branchBlock)
+                    branchBlock = basicBlock;
+                for (auto* instruction : basicBlock->sequenceOfInstructions)
+                {
+                    auto* destination = getInstructionDestination(instruction);
+                    if (destination != nullptr && *destination == decision.condition)
+                        invariant = false;
+                }
+            }
+            if (!invariant || branchBlock == nullptr)
+                continue;
+
+            std::unordered_map<std::string, std::string> labels;
+            for (auto block : loop.blocks)
+                labels[loopCFG.blocks.at(block)->label] = genLabel();
+            std::vector<AVMBasicBlock*> newBlocks;
+            // The test moved out of the loop picks the copy to run
+            auto* dispatch = new AVMBasicBlock;
+            dispatch->label = genLabel();
+            auto* originalBranch = dynamic_cast<BranchInstruction*>(getTerminator(branchBlock));
+            auto* dispatchBranch = dynamic_cast<BranchInstruction*>(cloneInstruction(originalBranch));
+            dispatchBranch->trueTarget = header->label;
+            dispatchBranch->falseTarget = labels.at(header->label);
+            dispatch->sequenceOfInstructions.push_back(dispatchBranch);
+            newBlocks.push_back(dispatch);
+            for (auto block : loop.blocks)
+            {
+                auto* basicBlock = new AVMBasicBlock;
+                basicBlock->label = labels.at(loopCFG.blocks.at(block)->label);
+                for (auto* instruction : loopCFG.blocks.at(block)->sequenceOfInstructions)
+                    basicBlock->sequenceOfInstructions.push_back(cloneInstruction(instruction));
+                auto* branchInstruction = dynamic_cast<BranchInstruction*>(getTerminator(basicBlock));
+                if (loopCFG.blocks.at(block) == branchBlock)
+                {
+                    auto target = branchInstruction->falseTarget;
+                    delete basicBlock->sequenceOfInstructions.back();
+                    branchInstruction = createUnconditionalBranch(target);
+                    basicBlock->sequenceOfInstructions.back() = branchInstruction;
+                }
+                if (branchInstruction != nullptr)
+                {
+                    for (auto* target : {&branchInstruction->trueTarget, &branchInstruction->falseTarget})
+                    {
+                        if (labels.count(*target))
+                            *target = labels.at(*target);
+                    }
+                }
+                newBlocks.push_back(basicBlock);
+            }
+            auto trueTarget = originalBranch->trueTarget;
+            delete branchBlock->sequenceOfInstructions.back();
+            branchBlock->sequenceOfInstructions.back() = createUnconditionalBranch(trueTarget);
+
+            for (auto predecessor : loopCFG.predecessors.at(loop.header))
+            {
+                if (!loop.blocks.count(predecessor))
+                    retargetBranch(loopCFG.blocks.at(predecessor), header->label, dispatch->label);
+            }
+            // The copy is unrolled as the original was asked to be
+            if (function->unrollPragmas.count(header->label))
+            {
+                u64 requested = function->unrollPragmas.at(header->label);
+                function->unrollPragmas[labels.at(header->label)] = requested;
+            }
+            auto& blocks = function->basicBlocksInFunction;
+            auto position = std::find(blocks.begin(), blocks.end(), loopCFG.blocks.at(*loop.blocks.rbegin()));
+            blocks.insert(position + 1, newBlocks.begin(), newBlocks.end());
+        }
+        removeUnreachableBlocks(function);
+        constructSSA(function);
+    }
+}
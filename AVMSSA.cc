@@ -0,0 +1,327 @@
+#include <AVMAnalysis.hh>
+#include <algorithm>
+#include <functional>
+#include <map>
+
+/*
+ * Builds pruned SSA form (Cytron et al.) for every local that never has its address taken.
+ * Allocas of promoted locals are deleted, phis are placed on the iterated dominance frontier
+ * of each variable's definitions wherever it is live, and every definition is given a fresh
+ * name. Temporaries are promoted too, so that code duplicated by earlier passes is renamed.
+ *
+ * A use that no definition reaches reads the variable's initial value: incoming parameters keep
+ * their own name, locals read the value the code generator would have initialised them with.
+ * */
+void AVM::constructSSA(AVMFunction* function) {
+    normaliseControlFlow(function);
+    removeUnreachableBlocks(function);
+
+    std::set<std::string> addressTaken;
+    std::unordered_map<std::string, std::string> initialValue;
+    for (auto* basicBlock : function->basicBlocksInFunction)
+    {
+        for (auto* instruction : basicBlock->sequenceOfInstructions)
+        {
+            if (instruction->getInstructionType() == AVMInstructionType::GEP)
+                addressTaken.insert(dynamic_cast<GetElementPtr*>(instruction)->src);
+            if (instruction->getInstructionType() == AVMInstructionType::ALLOCA)
+            {
+                auto& target = dynamic_cast<AllocaInstruction*>(instruction)->target;
+                u64 value = 0;
+                for (auto* symbol : function->variablesInFunction)
+                {
+                    if (symbol->identifier == target) {
+                        value = symbol->value;
+                        break;
+                    }
+                }
+                initialValue[target] = makeAVMConstant(value);
+            }
+        }
+    }
+    for (auto* symbol : function->incomingSymbols)
+    {
+        initialValue[symbol->identifier] = symbol->identifier;
+    }
+    auto isPromotable = [&](const std::string& variable) {
+        return isAVMLocalVariable(variable) && !addressTaken.count(variable);
+    };
+
+    AVMControlFlowGraph cfg(function);
+    AVMDominatorTree dominatorTree(cfg);
+    AVMLiveness liveness(cfg);
+
+    // Place phis on the iterated dominance frontier of every promotable variable's definitions
+    std::map<std::string, std::vector<u32>> definitionSites;
+    for (auto x = 0; x < cfg.blocks.size(); x++)
+    {
+        for (auto* instruction : cfg.blocks.at(x)->sequenceOfInstructions)
+        {
+            auto* destination = getInstructionDestination(instruction);
+            if (destination != nullptr && isPromotable(*destination))
+                definitionSites[*destination].push_back(x);
+        }
+    }
+    std::unordered_map<PhiInstruction*, std::string> phiVariable;
+    for (auto& [variable, sites] : definitionSites)
+    {
+        std::vector<bool> hasPhi(cfg.blocks.size(), false);
+        std::vector<u32> worklist = sites;
+        while (!worklist.empty())
+        {
+            u32 block = worklist.back();
+            worklist.pop_back();
+            for (auto frontier : dominatorTree.dominanceFrontier.at(block))
+            {
+                if (hasPhi.at(frontier) || !liveness.liveIn.at(frontier).count(variable))
+                    continue;
+                hasPhi.at(frontier) = true;
+                auto* phi = new PhiInstruction;
+                phi->opcode = AVMOpcode::PHI;
+                phi->dest = variable;
+                auto& sequence = cfg.blocks.at(frontier)->sequenceOfInstructions;
+                sequence.insert(sequence.begin(), phi);
+                phiVariable[phi] = variable;
+                worklist.push_back(frontier);
+            }
+        }
+    }
+
+    // Rename every definition and use by walking the dominator tree
+    std::unordered_map<std::string, std::vector<std::string>> stacks;
+    std::set<std::string> namesUsed;
+    auto currentName = [&](const std::string& variable) -> std::string {
+        auto found = stacks.find(variable);
+        if (found != stacks.end() && !found->second.empty())
+            return found->second.back();
+        auto initial = initialValue.find(variable);
+        if (initial != initialValue.end())
+            return initial->second;
+        return "#0";
+    };
+    std::function<void(u32)> rename = [&](u32 block) {
+        std::vector<std::string> pushed;
+        for (auto* instruction : cfg.blocks.at(block)->sequenceOfInstructions)
+        {
+            if (instruction->getInstructionType() != AVMInstructionType::PHI)
+            {
+                for (auto* operand : getInstructionOperands(instruction))
+                {
+                    if (isPromotable(*operand))
+                        *operand = currentName(*operand);
+                }
+            }
+            auto* destination = getInstructionDestination(instruction);
+            if (destination == nullptr || !isPromotable(*destination))
+                continue;
+            std::string variable = *destination;
+            // Temporaries keep their name for their first definition
+            std::string name = variable;
+            if (variable.at(0) != '%' || namesUsed.count(variable))
+                name = genSSAName(variable);
+            namesUsed.insert(name);
+            *destination = name;
+            stacks[variable].push_back(name);
+            pushed.push_back(variable);
+        }
+        for (auto successor : cfg.successors.at(block))
+        {
+            for (auto* instruction : cfg.blocks.at(successor)->sequenceOfInstructions)
+            {
+                if (instruction->getInstructionType() != AVMInstructionType::PHI)
+                    break;
+                auto* phi = dynamic_cast<PhiInstruction*>(instruction);
+                auto found = phiVariable.find(phi);
+                if (found == phiVariable.end())
+                    continue;
+                phi->incoming.emplace_back(currentName(found->second), cfg.blocks.at(block)->label);
+            }
+        }
+        for (auto child : dominatorTree.children.at(block))
+        {
+            rename(child);
+        }
+        for (const auto& variable : pushed)
+        {
+            stacks[variable].pop_back();
+        }
+    };
+    if (!cfg.blocks.empty())
+        rename(0);
+
+    for (auto* basicBlock : function->basicBlocksInFunction)
+    {
+        auto& sequence = basicBlock->sequenceOfInstructions;
+        sequence.erase(std::remove_if(sequence.begin(), sequence.end(), [&](AVMInstruction* instruction) {
+            if (instruction->getInstructionType() != AVMInstructionType::ALLOCA)
+                return false;
+            if (!isPromotable(dynamic_cast<AllocaInstruction*>(instruction)->target))
+                return false;
+            delete instruction;
+            return true;
+        }), sequence.end());
+    }
+}
+
+/*
+ * Sequentialises a set of copies that must happen simultaneously, such as the phis of one block
+ * seen from one predecessor. A copy is emitted once nothing still pending reads its destination,
+ * and cycles are broken by saving one destination into a fresh variable.
+ * */
+std::vector<MoveInstruction*> sequentialiseParallelCopy(AVM* avm, std::vector<std::pair<std::string, std::string>> copies) {
+    std::vector<MoveInstruction*> moves;
+    auto emit = [&](const std::string& dest, const std::string& value) {
+        moves.push_back(createMove(dest, value));
+    };
+    copies.erase(std::remove_if(copies.begin(), copies.end(), [](const std::pair<std::string, std::string>& i) {
+        return i.first == i.second;
+    }), copies.end());
+    while (!copies.empty())
+    {
+        bool progress = false;
+        for (auto x = 0; x < copies.size(); x++)
+        {
+            bool destinationRead = false;
+            for (auto y = 0; y < copies.size(); y++)
+            {
+                if (y != x && copies.at(y).second == copies.at(x).first)
+                    destinationRead = true;
+            }
+            if (!destinationRead)
+            {
+                emit(copies.at(x).first, copies.at(x).second);
+                copies.erase(copies.begin()+x);
+                progress = true;
+                break;
+            }
+        }
+        if (progress)
+            continue;
+        // Every remaining destination is still read by another copy, so they form cycles
+        std::string saved = copies.front().first;
+        std::string temporary = avm->genSSAName("swap");
+        emit(temporary, saved);
+        for (auto& i : copies)
+        {
+            if (i.second == saved)
+                i.second = temporary;
+        }
+    }
+    return moves;
+}
+
+/*
+ * Leaves SSA form by replacing each phi with copies at the end of its predecessors.
+ * Edges out of blocks with several successors are split first where needed, so that a copy only
+ * ever has an effect on the edge it belongs to, and the copies for one edge are sequentialised
+ * so phis that read each other's results (the swap problem) stay correct.
+ * */
+void AVM::destructSSA(AVMFunction* function) {
+    normaliseControlFlow(function);
+    AVMControlFlowGraph cfg(function);
+    AVMLiveness liveness(cfg);
+    auto hasPhis = [&](u32 block) {
+        auto& sequence = cfg.blocks.at(block)->sequenceOfInstructions;
+        return !sequence.empty() && sequence.front()->getInstructionType() == AVMInstructionType::PHI;
+    };
+    auto phiDestinations = [&](u32 block) {
+        std::set<std::string> destinations;
+        for (auto* instruction : cfg.blocks.at(block)->sequenceOfInstructions)
+        {
+            if (instruction->getInstructionType() != AVMInstructionType::PHI)
+                break;
+            destinations.insert(dynamic_cast<PhiInstruction*>(instruction)->dest);
+        }
+        return destinations;
+    };
+    /*
+     * A predecessor with several successors can keep the copies for all of its edges, as one
+     * parallel copy before its branch, if no successor reads a value the copies for another
+     * successor overwrite and the branch does not test one of those values. This keeps the back
+     * edge of a rotated loop a single conditional branch.
+     * */
+    auto copiesFitInPredecessor = [&](u32 predecessor) {
+        auto* branchInstruction = dynamic_cast<BranchInstruction*>(getTerminator(cfg.blocks.at(predecessor)));
+        if (branchInstruction == nullptr)
+            return false;
+        for (auto successor : cfg.successors.at(predecessor))
+        {
+            for (const auto& variable : phiDestinations(successor))
+            {
+                if (variable == branchInstruction->dependantComparison)
+                    return false;
+                for (auto other : cfg.successors.at(predecessor))
+                {
+                    if (other != successor && liveness.liveIn.at(other).count(variable))
+                        return false;
+                }
+            }
+        }
+        return true;
+    };
+    std::vector<std::pair<AVMBasicBlock*, AVMBasicBlock*>> edgeBlocks; // (block to insert after, new block)
+    for (auto x = 0; x < cfg.blocks.size(); x++)
+    {
+        auto* basicBlock = cfg.blocks.at(x);
+        if (!hasPhis(x))
+            continue;
+        for (auto predecessor : cfg.predecessors.at(x))
+        {
+            if (cfg.successors.at(predecessor).size() < 2 || copiesFitInPredecessor(predecessor))
+                continue;
+            auto* predecessorBlock = cfg.blocks.at(predecessor);
+            auto* edgeBlock = new AVMBasicBlock;
+            edgeBlock->label = genLabel();
+            edgeBlock->sequenceOfInstructions.push_back(createUnconditionalBranch(basicBlock->label));
+            retargetBranch(predecessorBlock, basicBlock->label, edgeBlock->label);
+            for (auto* instruction : basicBlock->sequenceOfInstructions)
+            {
+                if (instruction->getInstructionType() != AVMInstructionType::PHI)
+                    break;
+                for (auto& i : dynamic_cast<PhiInstruction*>(instruction)->incoming)
+                {
+                    if (i.second == predecessorBlock->label)
+                        i.second = edgeBlock->label;
+                }
+            }
+            edgeBlocks.emplace_back(predecessorBlock, edgeBlock);
+        }
+    }
+    for (auto& [after, edgeBlock] : edgeBlocks)
+    {
+        auto& blocks = function->basicBlocksInFunction;
+        blocks.insert(std::find(blocks.begin(), blocks.end(), after)+1, edgeBlock);
+    }
+
+    std::unordered_map<std::string, AVMBasicBlock*> labelToBlock;
+    for (auto* basicBlock : function->basicBlocksInFunction)
+    {
+        labelToBlock[basicBlock->label] = basicBlock;
+    }
+    // The copies into every successor of a block happen at once, at the end of that block
+    std::map<std::string, std::vector<std::pair<std::string, std::string>>> copiesPerPredecessor;
+    for (auto* basicBlock : function->basicBlocksInFunction)
+    {
+        auto& sequence = basicBlock->sequenceOfInstructions;
+        while (!sequence.empty() && sequence.front()->getInstructionType() == AVMInstructionType::PHI)
+        {
+            auto* phi = dynamic_cast<PhiInstruction*>(sequence.front());
+            for (const auto& [value, label] : phi->incoming)
+            {
+                copiesPerPredecessor[label].emplace_back(phi->dest, value);
+            }
+            delete phi;
+            sequence.erase(sequence.begin());
+        }
+    }
+    for (auto& [label, copies] : copiesPerPredecessor)
+    {
+        auto found = labelToBlock.find(label);
+        if (found == labelToBlock.end())
+            continue;
+        for (auto* moveInstruction : sequentialiseParallelCopy(this, copies))
+        {
+            insertBeforeTerminator(found->second, moveInstruction);
+        }
+    }
+}
@@ -0,0 +1,160 @@
+#include <AVMAnalysis.hh>
+#include <algorithm>
+
+/*
+ * Globals to be kept in registers across a loop, named by the loop's header.
+ * */
+struct PromotionDecision {
+    std::string header;
+    std::vector<std::string> globals;
+};
+
+/*
+ * Scalar promotion of globals written in loops.
+ *
+ * Every read of a global is a load and every write a store, so a loop updating a global counter
+ * goes through memory on each iteration. When all of a loop's accesses to a scalar global name it
+ * directly, and alias analysis finds that nothing else in the loop may read or write it (which
+ * rules out calls), the global is loaded into a local in front of the loop, the loop works on the
+ * local, and the local is stored back on every edge leaving the loop. Volatile globals stay in memory.
+ *
+ * Globals only read by a loop are left to loop-invariant code motion. The outermost loop a global
+ * can be promoted in is chosen, so that nested loops only load and store it once. As with unrolling,
+ * loops are picked on SSA form and rewritten with the function taken out of it, so the local is
+ * given its phis when the function is put back into SSA form.
+ * */
+void AVM::optPromoteGlobalsInLoops(AVMFunction *function) {
+    insertLoopPreheaders(function);
+    AVMControlFlowGraph cfg(function);
+    if (cfg.blocks.empty())
+        return;
+    AVMDominatorTree dominatorTree(cfg);
+    AVMLoopInfo loopInfo(cfg, dominatorTree);
+    AVMDefUse defUse(function);
+    AVMAliasAnalysis aliasAnalysis(function, defUse, globalSyms);
+
+    std::set<std::string> scalarGlobals;
+    for (auto* symbol : globalSyms)
+    {
+        if (symbol->type != nullptr && (symbol->type->isNumVar() || symbol->type->isPtr())
+            && !symbol->type->isArray() && !symbol->type->isVolatile())
+            scalarGlobals.insert("@" + symbol->identifier);
+    }
+
+    std::vector<PromotionDecision> decisions;
+    // Blocks of the loops each global has already been promoted in
+    std::unordered_map<std::string, std::set<u32>> promotedIn;
+    // Outermost loops first, as loops are ordered innermost first
+    for (auto x = loopInfo.loops.size(); x-- > 0;)
+    {
+        auto& loop = loopInfo.loops.at(x);
+        if (loopInfo.preheader(loop) == -1)
+            continue;
+        std::set<std::string> written;
+        for (auto block : loop.blocks)
+        {
+            for (auto* instruction : cfg.blocks.at(block)->sequenceOfInstructions)
+            {
+                auto* destination = getInstructionDestination(instruction);
+                if (destination != nullptr && scalarGlobals.count(*destination))
+                    written.insert(*destination);
+            }
+        }
+        PromotionDecision decision{cfg.blocks.at(loop.header)->label, {}};
+        for (const auto& global : written)
+        {
+            if (promotedIn[global].count(loop.header))
+                continue;
+            auto location = aliasAnalysis.locationOfVariable(global);
+            bool onlyNamed = std::all_of(loop.blocks.begin(), loop.blocks.end(), [&](u32 block) {
+                return std::all_of(cfg.blocks.at(block)->sequenceOfInstructions.begin(),
+                                   cfg.blocks.at(block)->sequenceOfInstructions.end(), [&](AVMInstruction* instruction) {
+                    auto* destination = getInstructionDestination(instruction);
+                    auto operands = getInstructionOperands(instruction);
+                    bool named = (destination != nullptr && *destination == global)
+                                 || std::any_of(operands.begin(), operands.end(), [&](std::string* operand) {
+                                        return *operand == global;
+                                    });
+                    auto type = instruction->getInstructionType();
+                    // Any other access to the global, or an access that may also reach it through memory
+                    if (type == AVMInstructionType::LOAD || type == AVMInstructionType::STORE
+                        || type == AVMInstructionType::CALL || type == AVMInstructionType::RET || !named)
+                        return !aliasAnalysis.mayRead(instruction, location) && !aliasAnalysis.mayWrite(instruction, location);
+                    return true;
+                });
+            });
+            if (!onlyNamed)
+                continue;
+            decision.globals.push_back(global);
+            promotedIn[global].insert(loop.blocks.begin(), loop.blocks.end());
+        }
+        if (!decision.globals.empty())
+            decisions.push_back(decision);
+    }
+    if (decisions.empty())
+        return;
+
+    destructSSA(function);
+    normaliseControlFlow(function);
+    for (auto& decision : decisions)
+    {
+        AVMControlFlowGraph loopCFG(function);
+        AVMDominatorTree loopDominatorTree(loopCFG);
+        AVMLoopInfo loops(loopCFG, loopDominatorTree);
+        auto found = std::find_if(loops.loops.begin(), loops.loops.end(), [&](const AVMLoop& loop) {
+            return loopCFG.blocks.at(loop.header)->label == decision.header;
+        });
+        if (found == loops.loops.end())
+            continue;
+        auto& loop = *found;
+
+        std::unordered_map<std::string, std::string> locals;
+        for (const auto& global : decision.globals)
+            locals[global] = genSSAName(global.substr(1));
+        for (auto block : loop.blocks)
+        {
+            for (auto* instruction : loopCFG.blocks.at(block)->sequenceOfInstructions)
+            {
+                auto operands = getInstructionOperands(instruction);
+                if (auto* destination = getInstructionDestination(instruction))
+                    operands.push_back(destination);
+                for (auto* operand : operands)
+                {
+                    auto local = locals.find(*operand);
+                    if (local != locals.end())
+                        *operand = local->second;
+                }
+            }
+        }
+        // Loaded wherever the loop is entered
+        for (auto predecessor : loopCFG.predecessors.at(loop.header))
+        {
+            if (loop.blocks.count(predecessor))
+                continue;
+            for (const auto& global : decision.globals)
+                insertBeforeTerminator(loopCFG.blocks.at(predecessor), createMove(locals.at(global), global));
+        }
+        // Stored on a new block on every edge leaving the loop, as an exit may also be reached from elsewhere
+        std::vector<AVMBasicBlock*> newBlocks;
+        for (auto block : loop.blocks)
+        {
+            for (auto successor : loopCFG.successors.at(block))
+            {
+                if (loop.blocks.count(successor))
+                    continue;
+                auto* edgeBlock = new AVMBasicBlock;
+                edgeBlock->label = genLabel();
+                for (const auto& global : decision.globals)
+                    edgeBlock->sequenceOfInstructions.push_back(createMove(global, locals.at(global)));
+                edgeBlock->sequenceOfInstructions.push_back(createUnconditionalBranch(loopCFG.blocks.at(successor)->label));
+                retargetBranch(loopCFG.blocks.at(block), loopCFG.blocks.at(successor)->label, edgeBlock->label);
+                newBlocks.push_back(edgeBlock);
+            }
+        }
+        auto& blocks = function->basicBlocksInFunction;
+        auto position = std::find(blocks.begin(), blocks.end(), loopCFG.blocks.at(*loop.blocks.rbegin()));
+        blocks.insert(position + 1, newBlocks.begin(), newBlocks.end());
+    }
+    removeUnreachableBlocks(function);
+    constructSSA(function);
+}
@@ -0,0 +1,80 @@
+#include <AVMAnalysis.hh>
+#include <algorithm>
+
+/*
+ * Tail recursion elimination.
+ *
+ * A call a function makes to itself whose result is returned straight away is replaced by a
+ * branch back to the start of the function: the arguments are moved into the parameters, through
+ * fresh temporaries as they may read each other, and every local is reset to the value the code
+ * generator initialises it with. The entry block keeps its allocas and branches to a new block
+ * holding the rest of its code, which becomes the loop header, as the entry block itself cannot be
+ * the target of a branch.
+ *
+ * Functions that take the address of a local are left alone, as each call needs its own copy.
+ * */
+void AVM::optEliminateTailRecursion(AVMFunction *function) {
+    normaliseControlFlow(function);
+    auto& blocks = function->basicBlocksInFunction;
+    std::vector<AVMBasicBlock*> tailCalls;
+    for (auto* basicBlock : blocks)
+    {
+        auto& sequence = basicBlock->sequenceOfInstructions;
+        for (auto* instruction : sequence)
+        {
+            if (instruction->getInstructionType() == AVMInstructionType::GEP
+                && isAVMLocalVariable(dynamic_cast<GetElementPtr*>(instruction)->src))
+                return;
+        }
+        if (sequence.size() < 2 || sequence.back()->getInstructionType() != AVMInstructionType::RET
+            || sequence.at(sequence.size() - 2)->getInstructionType() != AVMInstructionType::CALL)
+            continue;
+        auto* callInstruction = dynamic_cast<CallInstruction*>(sequence.at(sequence.size() - 2));
+        auto* retInstruction = dynamic_cast<RetInstruction*>(sequence.back());
+        if (callInstruction->funcName == "@" + function->name && callInstruction->args.size() == function->incomingSymbols.size()
+            && (retInstruction->value.empty() || retInstruction->value == callInstruction->returnVal))
+            tailCalls.push_back(basicBlock);
+    }
+    if (tailCalls.empty())
+        return;
+
+    auto* entry = blocks.front();
+    auto* header = new AVMBasicBlock;
+    header->label = genLabel();
+    auto firstInstruction = std::find_if(entry->sequenceOfInstructions.begin(), entry->sequenceOfInstructions.end(), [](AVMInstruction* instruction) {
+        return instruction->getInstructionType() != AVMInstructionType::ALLOCA;
+    });
+    header->sequenceOfInstructions.assign(firstInstruction, entry->sequenceOfInstructions.end());
+    entry->sequenceOfInstructions.erase(firstInstruction, entry->sequenceOfInstructions.end());
+    entry->sequenceOfInstructions.push_back(createUnconditionalBranch(header->label));
+    blocks.insert(blocks.begin() + 1, header);
+    std::replace(tailCalls.begin(), tailCalls.end(), entry, header);
+
+    std::vector<std::pair<std::string, std::string>> locals;
+    for (auto* instruction : entry->sequenceOfInstructions)
+    {
+        if (instruction->getInstructionType() != AVMInstructionType::ALLOCA)
+            continue;
+        auto& target = dynamic_cast<AllocaInstruction*>(instruction)->target;
+        locals.emplace_back(target, makeAVMConstant(getInitialValue(function, target)));
+    }
+    for (auto* basicBlock : tailCalls)
+    {
+        auto& sequence = basicBlock->sequenceOfInstructions;
+        auto* callInstruction = dynamic_cast<CallInstruction*>(sequence.at(sequence.size() - 2));
+        std::vector<std::string> arguments;
+        for (auto x = 0; x < callInstruction->args.size(); x++)
+        {
+            arguments.push_back(genSSAName(function->incomingSymbols.at(x)->identifier));
+            sequence.insert(sequence.end() - 2, createMove(arguments.back(), callInstruction->args.at(x)));
+        }
+        for (auto x = 0; x < arguments.size(); x++)
+            sequence.insert(sequence.end() - 2, createMove(function->incomingSymbols.at(x)->identifier, arguments.at(x)));
+        for (const auto& [local, value] : locals)
+            sequence.insert(sequence.end() - 2, createMove(local, value));
+        delete sequence.back();
+        sequence.pop_back();
+        delete sequence.back();
+        sequence.back() = createUnconditionalBranch(header->label);
+    }
+}
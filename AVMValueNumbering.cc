@@ -0,0 +1,116 @@
+#include <AVMAnalysis.hh>
+#include <algorithm>
+#include <functional>
+
+/*
+ * Dominator-based global value numbering.
+ *
+ * In SSA form a value's name is its value number, so two computations are equal when they
+ * apply the same operation to the same names. The dominator tree is walked in preorder with a
+ * scoped table of the expressions available in the current block; an arithmetic instruction,
+ * comparison or address generation whose expression is already in the table is deleted, and its
+ * result is replaced everywhere by the dominating instruction's result.
+ * Operands of commutative operations are put in a canonical order first, and comparisons are
+ * canonicalised by swapping their operands together with the comparison code.
+ * */
+void AVM::optGlobalValueNumbering(AVMFunction *function) {
+    AVMControlFlowGraph cfg(function);
+    if (cfg.blocks.empty())
+        return;
+    AVMDominatorTree dominatorTree(cfg);
+    AVMDefUse defUse(function);
+
+    std::unordered_map<std::string, std::string> available;
+    std::unordered_map<std::string, std::string> replacement;
+    auto replace = [&](std::string* operand) {
+        auto found = replacement.find(*operand);
+        if (found != replacement.end())
+            *operand = found->second;
+    };
+    // Operands are ordered by name, with constants last as optCombineInstructions puts them
+    auto outOfOrder = [](const std::string& first, const std::string& second) {
+        if (isAVMConstant(first) != isAVMConstant(second))
+            return isAVMConstant(first);
+        return second < first;
+    };
+    auto expressionOf = [&](AVMInstruction* instruction) -> std::string {
+        switch (instruction->getInstructionType()) {
+            case AVMInstructionType::ARITHMETIC: {
+                auto* arithmeticInstruction = dynamic_cast<ArithmeticInstruction*>(instruction);
+                auto& src1 = arithmeticInstruction->src1;
+                auto& src2 = arithmeticInstruction->src2;
+                if (!defUse.isStableValue(src1) || !defUse.isStableValue(src2))
+                    return {};
+                if (isCommutative(arithmeticInstruction->opcode) && outOfOrder(src1, src2))
+                    std::swap(src1, src2);
+                return "arith " + std::to_string(static_cast<int>(arithmeticInstruction->opcode)) + " " + src1 + " " + src2;
+            }
+            case AVMInstructionType::CMP: {
+                auto* comparisonInstruction = dynamic_cast<ComparisonInstruction*>(instruction);
+                auto& op1 = comparisonInstruction->op1;
+                auto& op2 = comparisonInstruction->op2;
+                if (!defUse.isStableValue(op1) || !defUse.isStableValue(op2))
+                    return {};
+                if (outOfOrder(op1, op2)) {
+                    std::swap(op1, op2);
+                    comparisonInstruction->compareCode = swapComparison(comparisonInstruction->compareCode);
+                }
+                return "cmp " + std::to_string(static_cast<int>(comparisonInstruction->compareCode)) + " " + op1 + " " + op2;
+            }
+            case AVMInstructionType::GEP:
+                // The address of a variable never changes within a function
+                return "gep " + dynamic_cast<GetElementPtr*>(instruction)->src;
+            default:
+                return {};
+        }
+    };
+
+    std::function<void(u32)> visit = [&](u32 block) {
+        std::vector<std::string> added;
+        auto& sequence = cfg.blocks.at(block)->sequenceOfInstructions;
+        sequence.erase(std::remove_if(sequence.begin(), sequence.end(), [&](AVMInstruction* instruction) {
+            if (instruction->getInstructionType() != AVMInstructionType::PHI)
+            {
+                for (auto* operand : getInstructionOperands(instruction))
+                    replace(operand);
+            }
+            auto* destination = getInstructionDestination(instruction);
+            if (destination == nullptr || !defUse.isSSAValue(*destination))
+                return false;
+            std::string expression = expressionOf(instruction);
+            if (expression.empty())
+                return false;
+            auto found = available.find(expression);
+            if (found == available.end())
+            {
+                available[expression] = *destination;
+                added.push_back(expression);
+                return false;
+            }
+            replacement[*destination] = found->second;
+            delete instruction;
+            return true;
+        }), sequence.end());
+        for (auto child : dominatorTree.children.at(block))
+        {
+            visit(child);
+        }
+        for (const auto& expression : added)
+        {
+            available.erase(expression);
+        }
+    };
+    visit(0);
+
+    // Phis read their operands at the end of a predecessor, which the walk may not have reached yet
+    for (auto* basicBlock : cfg.blocks)
+    {
+        for (auto* instruction : basicBlock->sequenceOfInstructions)
+        {
+            if (instruction->getInstructionType() != AVMInstructionType::PHI)
+                break;
+            for (auto* operand : getInstructionOperands(instruction))
+                replace(operand);
+        }
+    }
+}
@@ -1,4 +1,5 @@
 #include <codeGen.hh>
+#include <AVMAnalysis.hh>
 #include <bit>
 std::unordered_map<Register, std::string> regToStringMap = {
         {Register::X0, "x0"},
@@ -37,6 +38,7 @@ std::unordered_map<AVMOpcode, std::string> AVMtoARMv8 {
         {AVMOpcode::ADD, "add"},
         {AVMOpcode::SUB, "sub"},
         {AVMOpcode::MUL, "mul"},
+        {AVMOpcode::MULH, "umulh"},
         {AVMOpcode::DIV, "udiv"},
         {AVMOpcode::MOD, "NULL"},
         {AVMOpcode::SLL, "lsl"},
@@ -46,6 +48,9 @@ std::unordered_map<AVMOpcode, std::string> AVMtoARMv8 {
         {AVMOpcode::XOR, "eor"},
         {AVMOpcode::ORR, "orr"}
 };
+// Shifts that can be folded into the second operand of the instructions in acceptsShiftedOperand
+std::set<AVMOpcode> shiftedOperandOpcodes {AVMOpcode::SLL, AVMOpcode::SLR, AVMOpcode::ASR};
+std::set<AVMOpcode> acceptsShiftedOperand {AVMOpcode::ADD, AVMOpcode::SUB, AVMOpcode::AND, AVMOpcode::ORR, AVMOpcode::XOR};
 std::unordered_map<CMPCode, std::string> AVMCMPCodetoARMv8 {
         {CMPCode::EQ, "eq"},
         {CMPCode::NEQ, "ne"},
@@ -54,6 +59,23 @@ std::unordered_map<CMPCode, std::string> AVMCMPCodetoARMv8 {
         {CMPCode::LTEQ, "ls"},
         {CMPCode::MTEQ, "hs"}
 };
+// Flags for ccmp to set in place of a comparison, making each condition hold or fail
+std::unordered_map<CMPCode, u8> NZCVSatisfying {
+        {CMPCode::EQ, 4},
+        {CMPCode::NEQ, 0},
+        {CMPCode::LT, 0},
+        {CMPCode::MT, 2},
+        {CMPCode::LTEQ, 0},
+        {CMPCode::MTEQ, 2}
+};
+std::unordered_map<CMPCode, u8> NZCVFailing {
+        {CMPCode::EQ, 0},
+        {CMPCode::NEQ, 4},
+        {CMPCode::LT, 2},
+        {CMPCode::MT, 0},
+        {CMPCode::LTEQ, 2},
+        {CMPCode::MTEQ, 0}
+};
 std::string regToString(Register registerName)
 {
     return regToStringMap[registerName];
@@ -105,7 +127,7 @@ void CodeGenerator::startFinalTranslation() {
     for (auto globalSymbol : virtualMachine.globalSyms)
     {
 
-        if (!(globalSymbol->type->isPtr()||globalSymbol->type->isNumVar())) {
+        if (!(globalSymbol->type->isPtr()||globalSymbol->type->isNumVar()) && !globalSymbol->type->isStatic()) {
             std::string temp{};
             temp.append(".globl ");
             temp.append(globalSymbol->identifier);
@@ -133,6 +155,17 @@ void CodeGenerator::convertFunctionToASM(AVMFunction *function) {
     bool finished = false;
     std::vector<AllocaInstruction*> allocations;
     int varsInitialised = 0;
+    functionLocalSymbolMapOnStack.clear();
+    siblingCallsAllowed = true;
+    useCounts.clear();
+    for (auto* basicBlock : function->basicBlocksInFunction)
+    {
+        for (auto* instruction : basicBlock->sequenceOfInstructions)
+        {
+            for (auto* operand : getInstructionOperands(instruction))
+                useCounts[*operand]++;
+        }
+    }
 
     for (auto* basicBlock : function->basicBlocksInFunction)
     {
@@ -170,6 +203,9 @@ void CodeGenerator::convertFunctionToASM(AVMFunction *function) {
                     break;
                 case AVMInstructionType::GEP:
                 {
+                    auto& source = dynamic_cast<GetElementPtr*>(instruction)->src;
+                    if (source.at(0) != '@' && source.at(0) != '!')
+                        siblingCallsAllowed = false;
                     if (dynamic_cast<GetElementPtr*>(instruction)->dest.at(0) == '%')
                     {
                         bool found = false;
@@ -202,7 +238,9 @@ void CodeGenerator::convertFunctionToASM(AVMFunction *function) {
                     break;
                 }
                 case AVMInstructionType::CALL: {
-                    if (dynamic_cast<CallInstruction*>(instruction)->returnVal.at(0) == '%')
+                    // A call whose result is never used has no return value to save
+                    if (!dynamic_cast<CallInstruction*>(instruction)->returnVal.empty()
+                        && dynamic_cast<CallInstruction*>(instruction)->returnVal.at(0) == '%')
                     {
                         bool found = false;
                         for (const auto& x : functionLocalSymbolMapOnStack)
@@ -234,6 +272,21 @@ void CodeGenerator::convertFunctionToASM(AVMFunction *function) {
                     }
                     break;
                 }
+                case AVMInstructionType::CSEL: {
+                    if (dynamic_cast<CSELInstruction*>(instruction)->dest.at(0) == '%')
+                    {
+                        bool found = false;
+                        for (const auto& x : functionLocalSymbolMapOnStack)
+                            if (x.first == dynamic_cast<CSELInstruction*>(instruction)->dest)
+                                found = true;
+                        if (!found) {
+                            functionLocalSymbolMapOnStack.emplace_back(dynamic_cast<CSELInstruction*>(instruction)->dest,
+                                                                       varsInitialised);
+                            varsInitialised++;
+                        }
+                    }
+                    break;
+                }
                 case AVMInstructionType::ALLOCA:
                 {
                     allocations.push_back(dynamic_cast<AllocaInstruction*>(instruction));
@@ -241,6 +294,7 @@ void CodeGenerator::convertFunctionToASM(AVMFunction *function) {
                     varsInitialised++;
                     break;
                 }
+                case AVMInstructionType::PHI: // Removed by AVM::destructSSA before code generation
                 case AVMInstructionType::END:
                     break;
             }
@@ -253,7 +307,7 @@ void CodeGenerator::convertFunctionToASM(AVMFunction *function) {
     }
     // treat each as u64,
     // finding out stack size,
-    u8 stackSize = 0;
+    u32 stackSize = 0;
     u8 divisionRes = (varsInitialised*8) / 16;
     u8 remainder = ((varsInitialised*8)%16)/8;
     stackSize = roundUp(varsInitialised*8);
@@ -262,8 +316,11 @@ void CodeGenerator::convertFunctionToASM(AVMFunction *function) {
     regAllocInit(function);
     stackSizeForEpilogue = stackSize;
     epilogueUsed = false;
-    for (auto it : function->basicBlocksInFunction)
+    auto& blocks = function->basicBlocksInFunction;
+    for (auto x = 0; x < blocks.size(); x++)
     {
+        auto* it = blocks.at(x);
+        nextBlockLabel = x + 1 < blocks.size() ? blocks.at(x+1)->label : "";
         if (it->label != "entry") {
             std::string tmp;
             tmp = it->label;
@@ -343,14 +400,26 @@ void CodeGenerator::convertFunctionToASM(AVMFunction *function) {
         assemblyFile << Epilogue(stackSize) << "\tret\n";
 }
 
+/*
+ * Moves sp by a frame's size. An add or sub immediate only encodes up to 4095, so larger frames
+ * are allocated in steps, each a multiple of 16 to keep sp aligned.
+ * */
+static std::string adjustStackPointer(const std::string& mnemonic, u32 stackSize) {
+    const u32 maxStep = 4080;
+    std::string adjustment{};
+    while (stackSize != 0)
+    {
+        u32 step = std::min(stackSize, maxStep);
+        adjustment.append("\t" + mnemonic + " sp, sp, #" + std::to_string(step) + "\n");
+        stackSize -= step;
+    }
+    return adjustment;
+}
+
 std::string CodeGenerator::Prologue(u32 stackSize) {
     std::string prelim{};
-    u16 stackAllocSize = (stackSize) + 16;
-    prelim.append("\tsub sp, sp, #");
-    prelim.append(std::to_string(stackAllocSize));
-    prelim.append(" // Allocate stack space \n\tstp x29, x30, [sp, #");
-    prelim.append(std::to_string(stackAllocSize-16));
-    prelim.append("] // Save the link register and frame pointer as per convention\n");
+    prelim.append("\tstp x29, x30, [sp, #-16]! // Save the link register and frame pointer as per convention\n");
+    prelim.append(adjustStackPointer("sub", stackSize));
     return prelim;
 }
 
@@ -374,7 +443,7 @@ void CodeGenerator::convertBasicBlockToASM(AVMBasicBlock *basicBlock) {
                 if (findOpcode->second == "NULL")
                 {
                     /*
-                     * ARMv8 has no native instruction for modulo, hence we use a divison, multiplication and subtraction to replace it as:
+                     * ARMv8 has no native instruction for modulo, hence we use a divison and a multiply-subtract to replace it as:
                      * a%b is the same as
                      * a - (a // b)*b where // represents integer division
                      * */
@@ -390,24 +459,109 @@ void CodeGenerator::convertBasicBlockToASM(AVMBasicBlock *basicBlock) {
                     assemblyFile << temp;
                     temp.clear();
                     freeRegs();
-                    temp.append("\tmul x12, x12, ");
-                    temp.append(regToString(findVariable(arithmeticInstruction->src2)));
+                    auto divisor = findVariable(arithmeticInstruction->src2);
+                    auto dividend = findVariable(arithmeticInstruction->src1);
+                    temp.append("\tmsub ");
+                    temp.append(regToString(allocRegister(arithmeticInstruction->dest)));
+                    temp.append(", x12, ");
+                    temp.append(regToString(divisor));
+                    temp.append(", ");
+                    temp.append(regToString(dividend));
                     temp.append("\n");
+                    assemblyFile << temp;
+                    saveVariable(arithmeticInstruction->dest);
+                    freeRegs();
+                    break;
+                }
+                auto arithmeticInstruction = dynamic_cast<ArithmeticInstruction*>(it);
+                // A single bit tested by the branch ending the block, directly or by a comparison against
+                // zero in between, is branched on with tbz or tbnz
+                if (arithmeticInstruction->opcode == AVMOpcode::AND && isAVMConstant(arithmeticInstruction->src2)
+                    && std::__popcount(getAVMConstant(arithmeticInstruction->src2)) == 1)
+                {
+                    auto& sequence = basicBlock->sequenceOfInstructions;
+                    auto* next = x + 1 < sequence.size() ? sequence.at(x+1) : nullptr;
+                    auto* comparisonInstruction = next != nullptr && next->getInstructionType() == AVMInstructionType::CMP
+                                                    ? dynamic_cast<ComparisonInstruction*>(next) : nullptr;
+                    bool againstZero = comparisonInstruction != nullptr && comparisonInstruction->op1 == arithmeticInstruction->dest
+                                       && comparisonInstruction->op2 == "#0" && useCounts[arithmeticInstruction->dest] == 1
+                                       && (comparisonInstruction->compareCode == CMPCode::EQ || comparisonInstruction->compareCode == CMPCode::NEQ);
+                    auto* branchInstruction = againstZero
+                            ? findFusableBranch(basicBlock, x + 1, comparisonInstruction->dest, arithmeticInstruction->src1)
+                            : findFusableBranch(basicBlock, x, arithmeticInstruction->dest, arithmeticInstruction->src1);
+                    if (branchInstruction != nullptr)
+                    {
+                        bool branchIfSet = !againstZero || comparisonInstruction->compareCode == CMPCode::NEQ;
+                        fusedBranch.branchInstruction = branchInstruction;
+                        fusedBranch.branchIfTrue = branchIfSet ? "tbnz" : "tbz";
+                        fusedBranch.branchIfFalse = branchIfSet ? "tbz" : "tbnz";
+                        fusedBranch.operand = arithmeticInstruction->src1;
+                        fusedBranch.bit = std::to_string(std::__countr_zero(getAVMConstant(arithmeticInstruction->src2)));
+                        if (againstZero)
+                            x++;
+                        break;
+                    }
+                }
+                // A product only used by the following right after it is folded into a multiply-subtract
+                auto* next = x + 1 < basicBlock->sequenceOfInstructions.size() ? basicBlock->sequenceOfInstructions.at(x+1) : nullptr;
+                auto* following = next != nullptr && next->getInstructionType() == AVMInstructionType::ARITHMETIC
+                                    ? dynamic_cast<ArithmeticInstruction*>(next) : nullptr;
+                // Likewise a shift by a constant only used by the instruction right after it becomes that
+                // instruction's shifted second operand, as in add x0, x1, x2, lsl #3
+                auto& shifted = arithmeticInstruction->dest;
+                if (shiftedOperandOpcodes.count(arithmeticInstruction->opcode) && isAVMConstant(arithmeticInstruction->src2)
+                    && getAVMConstant(arithmeticInstruction->src2) < 64 && following != nullptr
+                    && acceptsShiftedOperand.count(following->opcode) && shifted.at(0) == '%' && useCounts[shifted] == 1
+                    && (following->src2 == shifted || (following->src1 == shifted && isCommutative(following->opcode))))
+                {
+                    auto& other = following->src2 == shifted ? following->src1 : following->src2;
+                    auto first = findVariable(other);
+                    auto second = findVariable(arithmeticInstruction->src1);
+                    std::string temp{};
+                    temp.append("\t");
+                    temp.append(AVMtoARMv8.at(following->opcode));
+                    temp.append(" ");
+                    temp.append(regToString(allocRegister(following->dest)));
+                    temp.append(", ");
+                    temp.append(regToString(first));
+                    temp.append(", ");
+                    temp.append(regToString(second));
+                    temp.append(", ");
+                    temp.append(AVMtoARMv8.at(arithmeticInstruction->opcode));
+                    temp.append(" #");
+                    temp.append(std::to_string(getAVMConstant(arithmeticInstruction->src2)));
                     temp.append("\n");
                     assemblyFile << temp;
-                    temp.clear();
+                    saveVariable(following->dest);
                     freeRegs();
-                    temp.append("\tsub ");
-                    temp.append(regToString(allocRegister(arithmeticInstruction->dest)));
+                    x++;
+                    break;
+                }
+                if (arithmeticInstruction->opcode == AVMOpcode::MUL && following != nullptr && following->opcode == AVMOpcode::SUB
+                    && following->src2 == arithmeticInstruction->dest && following->src1 != arithmeticInstruction->dest
+                    && arithmeticInstruction->dest.at(0) == '%' && useCounts[arithmeticInstruction->dest] == 1)
+                {
+                    // msub needs a third source register
+                    freeRegisters.push(Register::X11);
+                    auto multiplicand = findVariable(arithmeticInstruction->src1);
+                    auto multiplier = findVariable(arithmeticInstruction->src2);
+                    auto minuend = findVariable(following->src1);
+                    std::string temp{};
+                    temp.append("\tmsub ");
+                    temp.append(regToString(allocRegister(following->dest)));
                     temp.append(", ");
-                    temp.append(regToString(findVariable(arithmeticInstruction->src1)));
-                    temp.append(", x12\n");
+                    temp.append(regToString(multiplicand));
+                    temp.append(", ");
+                    temp.append(regToString(multiplier));
+                    temp.append(", ");
+                    temp.append(regToString(minuend));
+                    temp.append("\n");
                     assemblyFile << temp;
-                    saveVariable(arithmeticInstruction->dest);
+                    saveVariable(following->dest);
                     freeRegs();
+                    x++;
                     break;
                 }
-                auto arithmeticInstruction = dynamic_cast<ArithmeticInstruction*>(it);
                 std::string temp{};
                 temp.append("\t");
                 temp.append(findOpcode->second);
@@ -439,6 +593,17 @@ void CodeGenerator::convertBasicBlockToASM(AVMBasicBlock *basicBlock) {
                 break;
             }
             case AVMInstructionType::STORE: {
+                auto storeInstruction = dynamic_cast<StoreMemoryInstruction*>(it);
+                auto value = findVariable(storeInstruction->src);
+                auto address = findVariable(storeInstruction->addrVar);
+                std::string temp{};
+                temp.append("\tstr ");
+                temp.append(regToString(value));
+                temp.append(", [");
+                temp.append(regToString(address));
+                temp.append("]\n");
+                assemblyFile << temp;
+                freeRegs();
                 break;
             }
             case AVMInstructionType::GEP: {
@@ -482,17 +647,91 @@ void CodeGenerator::convertBasicBlockToASM(AVMBasicBlock *basicBlock) {
             case AVMInstructionType::CMP:
             {
                 auto comparisonInstruction = dynamic_cast<ComparisonInstruction*>(it);
-                std::string comparison{};
-                comparison.append("\tcmp ");
-                comparison.append(regToString(findVariable(comparisonInstruction->op1)));
-                comparison.append(", ");
-                comparison.append(regToString(findVariable(comparisonInstruction->op2)));
-                comparison.append("\n");
-                assemblyFile << comparison;
+                // Comparisons combined by and or or as they come, each read once, are chained with ccmp:
+                // each comparison is only made if the ones before it left the outcome open, and otherwise
+                // sets flags giving that outcome
+                auto& sequence = basicBlock->sequenceOfInstructions;
+                auto end = x;
+                std::string value = comparisonInstruction->dest;
+                while (end + 2 < sequence.size() && sequence.at(end+1)->getInstructionType() == AVMInstructionType::CMP
+                       && sequence.at(end+2)->getInstructionType() == AVMInstructionType::ARITHMETIC)
+                {
+                    auto& next = dynamic_cast<ComparisonInstruction*>(sequence.at(end+1))->dest;
+                    auto* combination = dynamic_cast<ArithmeticInstruction*>(sequence.at(end+2));
+                    if ((combination->opcode != AVMOpcode::AND && combination->opcode != AVMOpcode::ORR)
+                        || !((combination->src1 == value && combination->src2 == next) || (combination->src1 == next && combination->src2 == value))
+                        || value.at(0) != '%' || useCounts[value] != 1 || next.at(0) != '%' || useCounts[next] != 1)
+                        break;
+                    end += 2;
+                    value = combination->dest;
+                }
+                if (end != x)
+                {
+                    emitComparison("cmp", comparisonInstruction, "");
+                    auto code = comparisonInstruction->compareCode;
+                    for (auto y = x + 1; y < end; y += 2)
+                    {
+                        auto* nextComparison = dynamic_cast<ComparisonInstruction*>(sequence.at(y));
+                        bool isAnd = sequence.at(y+1)->opcode == AVMOpcode::AND;
+                        u32 flags = isAnd ? NZCVFailing.at(nextComparison->compareCode) : NZCVSatisfying.at(nextComparison->compareCode);
+                        emitComparison("ccmp", nextComparison,
+                                       ", #" + std::to_string(flags) + ", " + cmpCodeToString(isAnd ? code : invertComparison(code)));
+                        code = nextComparison->compareCode;
+                    }
+                    x = end;
+                    auto* branchInstruction = findFusableBranch(basicBlock, end, value, "");
+                    if (branchInstruction != nullptr)
+                    {
+                        fusedBranch.branchInstruction = branchInstruction;
+                        fusedBranch.branchIfTrue = "b." + cmpCodeToString(code);
+                        fusedBranch.branchIfFalse = "b." + cmpCodeToString(invertComparison(code));
+                        fusedBranch.operand.clear();
+                        fusedBranch.bit.clear();
+                        break;
+                    }
+                    assemblyFile << "\tcset " << regToString(allocRegister(value)) << ", " << cmpCodeToString(code) << "\n";
+                    saveVariable(value);
+                    freeRegs();
+                    break;
+                }
+                // A comparison only read by the branch ending the block sets the flags that branch tests.
+                // Against zero there is no need for flags at all, unless the value compared is overwritten
+                // before the branch
+                auto* branchInstruction = findFusableBranch(basicBlock, x, comparisonInstruction->dest, "");
+                if (branchInstruction != nullptr)
+                {
+                    auto code = comparisonInstruction->compareCode;
+                    fusedBranch.branchInstruction = branchInstruction;
+                    fusedBranch.bit.clear();
+                    if (comparisonInstruction->op2 == "#0" && (code == CMPCode::EQ || code == CMPCode::NEQ)
+                        && findFusableBranch(basicBlock, x, comparisonInstruction->dest, comparisonInstruction->op1) != nullptr)
+                    {
+                        fusedBranch.branchIfTrue = code == CMPCode::NEQ ? "cbnz" : "cbz";
+                        fusedBranch.branchIfFalse = code == CMPCode::NEQ ? "cbz" : "cbnz";
+                        fusedBranch.operand = comparisonInstruction->op1;
+                        break;
+                    }
+                    emitComparison("cmp", comparisonInstruction, "");
+                    fusedBranch.branchIfTrue = "b." + cmpCodeToString(code);
+                    fusedBranch.branchIfFalse = "b." + cmpCodeToString(invertComparison(code));
+                    fusedBranch.operand.clear();
+                    break;
+                }
+                emitComparison("cmp", comparisonInstruction, "");
+                // A comparison only read by the select right after it sets the flags the select tests
+                auto* next = x + 1 < basicBlock->sequenceOfInstructions.size() ? basicBlock->sequenceOfInstructions.at(x+1) : nullptr;
+                if (next != nullptr && next->getInstructionType() == AVMInstructionType::CSEL
+                    && dynamic_cast<CSELInstruction*>(next)->condition == comparisonInstruction->dest
+                    && comparisonInstruction->dest.at(0) == '%' && useCounts[comparisonInstruction->dest] == 1)
+                {
+                    emitSelect(dynamic_cast<CSELInstruction*>(next), comparisonInstruction->compareCode);
+                    x++;
+                    break;
+                }
                 std::string cselInstruction;
-                cselInstruction.append("\tcsinv ");
+                cselInstruction.append("\tcset ");
                 cselInstruction.append(regToString(allocRegister(comparisonInstruction->dest)));
-                cselInstruction.append(", xzr, xzr, ");
+                cselInstruction.append(", ");
                 cselInstruction.append(cmpCodeToString(comparisonInstruction->compareCode));
                 assemblyFile << cselInstruction << "\n";
                 saveVariable(comparisonInstruction->dest);
@@ -527,21 +766,40 @@ void CodeGenerator::convertBasicBlockToASM(AVMBasicBlock *basicBlock) {
                 std::string functionName;
                 functionName = callInstruction->funcName;
                 functionName.erase(functionName.begin());
+                // A call whose result is returned straight away can reuse this function's return
+                // address: the frame is torn down first and the callee returns to our caller
+                auto* next = x + 1 < basicBlock->sequenceOfInstructions.size() ? basicBlock->sequenceOfInstructions.at(x+1) : nullptr;
+                if (siblingCallsAllowed && next != nullptr && next->getInstructionType() == AVMInstructionType::RET
+                    && dynamic_cast<RetInstruction*>(next)->value == callInstruction->returnVal)
+                {
+                    assemblyFile << Epilogue(stackSizeForEpilogue);
+                    epilogueUsed = true;
+                    assemblyFile << "\tb " << functionName << "\n";
+                    freeRegs();
+                    x++;
+                    break;
+                }
                 assemblyFile << ("\tbl ") << functionName << "\n";
-                assemblyFile << "\tmov x10, x0\n";
-                saveVariable(callInstruction->returnVal);
+                if (!callInstruction->returnVal.empty()) {
+                    assemblyFile << "\tmov x10, x0\n";
+                    saveVariable(callInstruction->returnVal);
+                }
                 freeRegs();
                 break;
             }
             case AVMInstructionType::RET: {
                 auto returnInstruction = dynamic_cast<RetInstruction*>(it);
-                std::string moveInstruction{};
-                moveInstruction.append("\tmov x0, ");
-                moveInstruction.append(regToString(findVariable(returnInstruction->value)));
-                assemblyFile << moveInstruction << "\n";
+                // A return without a value leaves x0 as it is
+                if (!returnInstruction->value.empty()) {
+                    std::string moveInstruction{};
+                    moveInstruction.append("\tmov x0, ");
+                    moveInstruction.append(regToString(findVariable(returnInstruction->value)));
+                    assemblyFile << moveInstruction << "\n";
+                }
                 assemblyFile << Epilogue(stackSizeForEpilogue);
                 epilogueUsed = true;
                 assemblyFile << "\tret\n";
+                freeRegs();
                 break;
             }
             case AVMInstructionType::MV: {
@@ -557,22 +815,42 @@ void CodeGenerator::convertBasicBlockToASM(AVMBasicBlock *basicBlock) {
                 freeRegs();
                 break;
             }
+            case AVMInstructionType::CSEL:
+            {
+                auto selectInstruction = dynamic_cast<CSELInstruction*>(it);
+                std::string comparison{};
+                comparison.append("\tcmp ");
+                comparison.append(regToString(findVariable(selectInstruction->condition)));
+                comparison.append(", #0\n");
+                assemblyFile << comparison;
+                freeRegs();
+                emitSelect(selectInstruction, CMPCode::NEQ);
+                break;
+            }
             case AVMInstructionType::BRANCH:
             {
                 auto branchInstruction = dynamic_cast<BranchInstruction*>(it);
                 if (branchInstruction->falseTarget != "NULL") {
-                    std::string cmp;
-                    cmp.append("\tcmp ");
-                    cmp.append(regToString(findVariable(branchInstruction->dependantComparison)));
-                    cmp.append(", #0\n");
-                    cmp.append("\tb.ne ");
-                    std::string tmp = branchInstruction->falseTarget;
-                    tmp.erase(0, 1);
-                    cmp.append(tmp);
-                    assemblyFile << cmp << "\n";
-                    std::string unconditionalBranch;
-
+                    if (branchInstruction != fusedBranch.branchInstruction) {
+                        fusedBranch.branchInstruction = branchInstruction;
+                        fusedBranch.branchIfTrue = "cbnz";
+                        fusedBranch.branchIfFalse = "cbz";
+                        fusedBranch.operand = branchInstruction->dependantComparison;
+                        fusedBranch.bit.clear();
+                    }
+                    // Operands come between the mnemonic and the target
+                    std::string operands = " ";
+                    if (!fusedBranch.operand.empty())
+                        operands.append(regToString(findVariable(fusedBranch.operand)) + ", ");
+                    if (!fusedBranch.bit.empty())
+                        operands.append("#" + fusedBranch.bit + ", ");
+                    emitConditionalBranch(branchInstruction, fusedBranch.branchIfTrue + operands, fusedBranch.branchIfFalse + operands);
+                    fusedBranch.branchInstruction = nullptr;
+                    freeRegs();
+                    break;
                 }
+                // No branch is needed to reach the block emitted next
+                if (branchInstruction->trueTarget != nextBlockLabel) {
                     std::string unconditionalBranch;
                     unconditionalBranch.append("\tb ");
                     std::string tmp = branchInstruction->trueTarget;
@@ -581,8 +859,9 @@ void CodeGenerator::convertBasicBlockToASM(AVMBasicBlock *basicBlock) {
                     unconditionalBranch.append(tmp);
                     unconditionalBranch.append("\n");
                     assemblyFile << unconditionalBranch;
-
+                }
                 freeRegs();
+                break;
             }
             default:
                 break;
@@ -621,6 +900,96 @@ Register CodeGenerator::findVariable(std::string identifier) {
     assemblyFile << loadInstruction;
     return freeReg;
 }
+/*
+ * The conditional branch ending the block that only reads the value defined at position x, with only
+ * moves in between that leave the operand named alone, or nullptr if there is none.
+ * */
+BranchInstruction* CodeGenerator::findFusableBranch(AVMBasicBlock* basicBlock, u64 x, const std::string& value, const std::string& operand) {
+    auto& sequence = basicBlock->sequenceOfInstructions;
+    if (value.at(0) != '%' || useCounts[value] != 1)
+        return nullptr;
+    for (auto y = x + 1; y < sequence.size(); y++)
+    {
+        auto* instruction = sequence.at(y);
+        if (instruction->getInstructionType() == AVMInstructionType::MV)
+        {
+            if (dynamic_cast<MoveInstruction*>(instruction)->dest == operand)
+                return nullptr;
+            continue;
+        }
+        auto* branchInstruction = dynamic_cast<BranchInstruction*>(instruction);
+        if (branchInstruction == nullptr || branchInstruction->falseTarget == "NULL" || branchInstruction->dependantComparison != value)
+            return nullptr;
+        return branchInstruction;
+    }
+    return nullptr;
+}
+/*
+ * Emits a conditional branch, given the instructions branching when the condition holds and when
+ * it does not, each followed by the target. Either target may be the block emitted next, which is
+ * then fallen through to.
+ * */
+void CodeGenerator::emitConditionalBranch(BranchInstruction* branchInstruction, const std::string& branchIfTrue, const std::string& branchIfFalse) {
+    auto label = [](std::string target) {
+        if (target.at(0) == '@')
+            target.erase(0, 1);
+        return target;
+    };
+    bool trueTargetFollows = branchInstruction->trueTarget == nextBlockLabel;
+    bool falseTargetFollows = branchInstruction->falseTarget == nextBlockLabel;
+    if (falseTargetFollows && !trueTargetFollows) {
+        assemblyFile << "\t" << branchIfTrue << label(branchInstruction->trueTarget) << "\n";
+        return;
+    }
+    assemblyFile << "\t" << branchIfFalse << label(branchInstruction->falseTarget) << "\n";
+    if (!trueTargetFollows)
+        assemblyFile << "\tb " << label(branchInstruction->trueTarget) << "\n";
+}
+/*
+ * Emits a cmp or ccmp of a comparison's operands, followed by the given suffix. The operands are
+ * loaded right before the instruction, as loading a later comparison's operands reuses the registers.
+ * */
+void CodeGenerator::emitComparison(const std::string& mnemonic, ComparisonInstruction* comparisonInstruction, const std::string& suffix) {
+    Register op1 = findVariable(comparisonInstruction->op1);
+    Register op2 = findVariable(comparisonInstruction->op2);
+    assemblyFile << "\t" << mnemonic << " " << regToString(op1) << ", " << regToString(op2) << suffix << "\n";
+    freeRegs();
+}
+/*
+ * Emits a select on flags already set, with code the condition under which the true value is chosen.
+ * Selects between 1 and 0 become a cset, and zero operands are read from xzr.
+ * */
+void CodeGenerator::emitSelect(CSELInstruction* selectInstruction, CMPCode code) {
+    auto operand = [&](const std::string& value) {
+        return value == "#0" ? std::string("xzr") : regToString(findVariable(value));
+    };
+    std::string temp{};
+    if (!selectInstruction->incrementFalse && selectInstruction->trueValue == "#1" && selectInstruction->falseValue == "#0") {
+        temp.append("\tcset ");
+        temp.append(regToString(allocRegister(selectInstruction->dest)));
+    }
+    else if (!selectInstruction->incrementFalse && selectInstruction->trueValue == "#0" && selectInstruction->falseValue == "#1") {
+        temp.append("\tcset ");
+        temp.append(regToString(allocRegister(selectInstruction->dest)));
+        code = invertComparison(code);
+    }
+    else {
+        auto trueValue = operand(selectInstruction->trueValue);
+        auto falseValue = operand(selectInstruction->falseValue);
+        temp.append(selectInstruction->incrementFalse ? "\tcsinc " : "\tcsel ");
+        temp.append(regToString(allocRegister(selectInstruction->dest)));
+        temp.append(", ");
+        temp.append(trueValue);
+        temp.append(", ");
+        temp.append(falseValue);
+    }
+    temp.append(", ");
+    temp.append(cmpCodeToString(code));
+    temp.append("\n");
+    assemblyFile << temp;
+    saveVariable(selectInstruction->dest);
+    freeRegs();
+}
 void CodeGenerator::freeRegs() {
     if (freeRegisters.empty()) {
         freeRegisters.push(Register::X9);
@@ -660,11 +1029,7 @@ void CodeGenerator::regAllocInit(AVMFunction *function) {
 std::string CodeGenerator::Epilogue(u32 stackSize)
 {
     std::string tmp;
-    tmp.append("\tldp x29, x30, [sp, #");
-    tmp.append(std::to_string(stackSize));
-    tmp.append("]\n");
-    tmp.append("\tadd sp, sp, #");
-    tmp.append(std::to_string(stackSize+16));
-    tmp.append("\n");
+    tmp.append(adjustStackPointer("add", stackSize));
+    tmp.append("\tldp x29, x30, [sp], #16\n");
     return tmp;
 }
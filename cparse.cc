@@ -103,7 +103,7 @@ bool isTypeSpecifier(const Token& token)
 }
 bool isTypeQualifier(const Token& token)
 {
-    if (token.token == CONST || token.token == VOLATILE)
+    if (token.token == CONST || token.token == VOLATILE || token.token == RESTRICT)
     {
         return true;
     }
@@ -273,10 +273,22 @@ bool CParse::parse()
     return true;
 }
 /*declaration_specifiers
-	: type_specifier
+	: storage_class_specifier
+	| storage_class_specifier declaration_specifiers
+	| type_specifier
 	| type_specifier declaration_specifiers
 	| type_qualifier
 	| type_qualifier declaration_specifiers
+	| function_specifier
+	| function_specifier declaration_specifiers
+	;
+
+storage_class_specifier
+	: STATIC
+	;
+
+function_specifier
+	: INLINE
 	;
 
 type_specifier
@@ -291,7 +303,8 @@ type_specifier
  */
 bool CParse::declarationSpecifiers(CType* cType)
 {
-    while (tokens->at(cursor).token != END && (isTypeQualifier(tokens->at(cursor)) || isTypeSpecifier(tokens->at(cursor))))
+    while (tokens->at(cursor).token != END && (isTypeQualifier(tokens->at(cursor)) || isTypeSpecifier(tokens->at(cursor))
+                                               || tokens->at(cursor).token == STATIC || tokens->at(cursor).token == INLINE))
     {
         if (!combinable(cType, tokens->at(cursor)))
         {
@@ -347,7 +360,14 @@ bool CParse::combinable(CType *cType, const Token& token)
             else return true;
         }
         case STATIC:
+        case INLINE:
         {
+            for (auto& i: cType->typeSpecifier)
+            {
+                if (i.token == token.token)
+                    return false;
+            }
+            return true;
         }
 
         default:
@@ -861,9 +881,30 @@ ASTNode* CParse::statement() {
     else if (tokens->at(cursor).token == RETURN) {
         return jumpStatement();
     }
+    else if (tokens->at(cursor).token == PRAGMA_UNROLL) {
+        return unrollPragma();
+    }
     return expressionStatement();
 }
 
+/*
+ * #pragma unroll [N] applies to the while loop that follows it. The requested count is kept in
+ * the loop's value; a bare pragma asks for the loop to be unrolled completely.
+ * */
+ASTNode* CParse::unrollPragma() {
+    Token pragma = tokens->at(cursor);
+    cursor++;
+    if (tokens->at(cursor).token != WHILE) {
+        print_note(pragma.lineNumber, "#pragma unroll is ignored as it is not followed by a while loop");
+        return statement();
+    }
+    auto* node = iterationStatement();
+    if (node == nullptr) return nullptr;
+    // As with GCC, a count of 0 or 1 keeps the loop from being unrolled
+    node->value = pragma.lexeme.empty() ? UINT64_MAX : std::max<u64>(1, std::stoull(pragma.lexeme));
+    return node;
+}
+
 ASTNode* CParse::labelStatement() {
     print_error("Label statements are not yet supported by this compiler");
     return nullptr;
@@ -1167,6 +1208,7 @@ std::vector<Pointer*> CParse::pointer() {
         {
             if (tokens->at(cursor).token == VOLATILE) nPointer->setVolatile();
             if (tokens->at(cursor).token == CONST) nPointer->setConst();
+            if (tokens->at(cursor).token == RESTRICT) nPointer->setRestrict();
             cursor++;
         }
         pointers.push_back(nPointer);
@@ -1545,6 +1587,37 @@ std::string CType::typeAsString() {
     return type;
 }
 
+std::string CType::accessTypeAsString() {
+    std::string type{};
+    for (const auto& i: typeSpecifier)
+    {
+        switch (i.token) {
+            case CONST:
+            case VOLATILE:
+            case RESTRICT:
+            case STATIC:
+            case EXTERN:
+            case INLINE:
+            case REGISTER:
+            case AUTO:
+            case SIGNED:
+            case UNSIGNED:
+                break;
+            default:
+                type.append(i.lexeme);
+                break;
+        }
+    }
+    if (type.empty())
+        type = "int";
+    for (auto* i : declaratorPartList)
+    {
+        if (i->getDPT() == PTR)
+            type.append("*");
+    }
+    return type;
+}
+
 CType* CType::dereferenceType() {
     if (!isPtr())
         return nullptr;
@@ -1554,7 +1627,7 @@ CType* CType::dereferenceType() {
     {
         cursor = 1;
     }
-    copy(ctype);
+    ctype->copy(this);
     auto* ptr = dynamic_cast<Pointer*>(ctype->declaratorPartList.at(cursor));
     ctype->declaratorPartList.erase(ctype->declaratorPartList.cbegin()+cursor);
     delete ptr;
@@ -1572,7 +1645,7 @@ CType *CType::refType() {
     {
         cursor = 1;
     }
-    copy(ctype);
+    ctype->copy(this);
     auto* pointer = new Pointer;
     ctype->declaratorPartList.insert(ctype->declaratorPartList.cbegin()+cursor, pointer);
     return ctype;
@@ -1597,6 +1670,10 @@ void CType::copy(CType* x) {
                 {
                     pointer->setVolatile();
                 }
+                if (pointer2.isRestrictPtr())
+                {
+                    pointer->setRestrict();
+                }
                 declaratorPartList.push_back(pointer);
                 break;
             }
@@ -1629,11 +1706,40 @@ void CType::copy(CType* x) {
 }
 
 bool CType::isStatic() {
-    bool found = false;
     for (const auto& i : typeSpecifier) {
         if (i.token == STATIC)
             return true;
     }
+    return false;
+}
+
+bool CType::isInline() {
+    for (const auto& i : typeSpecifier) {
+        if (i.token == INLINE)
+            return true;
+    }
+    return false;
+}
+
+bool CType::isVolatile() {
+    for (const auto& i : typeSpecifier) {
+        if (i.token == VOLATILE)
+            return true;
+    }
+    for (auto* i : declaratorPartList) {
+        if (i->getDPT() == PTR && dynamic_cast<Pointer*>(i)->isVolatilePtr())
+            return true;
+    }
+    return false;
+}
+
+bool CType::isRestrict() {
+    for (auto* i : declaratorPartList) {
+        if (i->getDPT() == D_IDENTIFIER)
+            continue;
+        return i->getDPT() == PTR && dynamic_cast<Pointer*>(i)->isRestrictPtr();
+    }
+    return false;
 }
 
 std::string DeclaratorPieces::print() {
@@ -0,0 +1,265 @@
+#pragma once
+#include <cparse.hh>
+#include <optional>
+#include <set>
+#include <unordered_map>
+
+/*
+ * Helpers for reading AVM operands.
+ * Operands are strings: "#N" is an immediate, '@' and '!' prefixed names live in global memory,
+ * and everything else names a local variable or temporary.
+ * */
+bool isAVMConstant(const std::string& operand);
+bool isAVMLocalVariable(const std::string& operand);
+u64 getAVMConstant(const std::string& operand);
+std::string makeAVMConstant(u64 value);
+
+bool isCommutative(AVMOpcode opcode);
+/*
+ * Comparison code that gives the opposite result for the same operands.
+ * */
+CMPCode invertComparison(CMPCode code);
+/*
+ * Comparison code that gives the same result once the operands are swapped.
+ * */
+CMPCode swapComparison(CMPCode code);
+
+/*
+ * Returns the variable written by an instruction, or nullptr if it writes no variable.
+ * */
+std::string* getInstructionDestination(AVMInstruction* instruction);
+/*
+ * Returns every value read by an instruction. The source of a GetElementPtr is not included,
+ * as it names a memory location rather than reading a value.
+ * */
+std::vector<std::string*> getInstructionOperands(AVMInstruction* instruction);
+
+/*
+ * Returns a new instruction identical to the one given, for passes that duplicate code.
+ * */
+AVMInstruction* cloneInstruction(AVMInstruction* instruction);
+
+AVMInstruction* getTerminator(AVMBasicBlock* basicBlock);
+std::vector<std::string> getBranchTargets(AVMBasicBlock* basicBlock);
+void retargetBranch(AVMBasicBlock* basicBlock, const std::string& from, const std::string& to);
+BranchInstruction* createUnconditionalBranch(const std::string& target);
+MoveInstruction* createMove(const std::string& dest, const std::string& value);
+ArithmeticInstruction* createArithmetic(AVMOpcode opcode, const std::string& dest, const std::string& src1, const std::string& src2);
+void insertBeforeTerminator(AVMBasicBlock* basicBlock, AVMInstruction* instruction);
+/*
+ * Value a local declared in the function starts with, as the code generator initialises it.
+ * */
+u64 getInitialValue(AVMFunction* function, const std::string& local);
+
+void normaliseControlFlow(AVMFunction* function);
+bool removeUnreachableBlocks(AVMFunction* function);
+void layoutBlocks(AVMFunction* function);
+
+/*
+ * Number of 8-byte stack slots the code generator gives a function: one for every local it
+ * declares, writes or takes as a parameter. Locals are addressed from sp with an add immediate,
+ * which encodes at most 4095, so passes that copy code keep functions within maxFrameSlots.
+ * */
+constexpr u64 maxFrameSlots = 4096 / 8 - 1;
+u64 countFrameSlots(AVMFunction* function);
+
+/*
+ * Control flow graph of a function, indexed by position in basicBlocksInFunction.
+ * A block without a branch or return falls through to the next block in layout,
+ * which mirrors how the code generator emits it.
+ * */
+class AVMControlFlowGraph {
+public:
+    explicit AVMControlFlowGraph(AVMFunction* function);
+    AVMFunction* function;
+    std::vector<AVMBasicBlock*> blocks;
+    std::unordered_map<std::string, u32> labelToIndex;
+    std::vector<std::vector<u32>> successors;
+    std::vector<std::vector<u32>> predecessors;
+    std::vector<u32> reversePostOrder;
+    std::vector<bool> reachable;
+};
+
+/*
+ * Dominator tree and dominance frontiers, computed with the Cooper-Harvey-Kennedy algorithm.
+ * Unreachable blocks have no immediate dominator (-1).
+ * */
+class AVMDominatorTree {
+public:
+    explicit AVMDominatorTree(AVMControlFlowGraph& cfg);
+    std::vector<i64> immediateDominator;
+    std::vector<std::vector<u32>> children;
+    std::vector<std::vector<u32>> dominanceFrontier;
+    bool dominates(u32 dominator, u32 block);
+private:
+    std::vector<u32> rpoNumber;
+};
+
+/*
+ * Post-dominator tree, computed like the dominator tree on the reversed flow graph. Every block
+ * that leaves the function is joined to a virtual exit block, numbered after the real blocks.
+ * Blocks that cannot reach the exit have no immediate post-dominator (-1).
+ * */
+class AVMPostDominatorTree {
+public:
+    explicit AVMPostDominatorTree(AVMControlFlowGraph& cfg);
+    u32 exit;
+    std::vector<i64> immediatePostDominator;
+    bool postDominates(u32 postDominator, u32 block);
+};
+
+/*
+ * Live variable sets at the entry and exit of each block.
+ * Phi operands are live out of the predecessor they flow from, not live into the phi's block.
+ * */
+class AVMLiveness {
+public:
+    explicit AVMLiveness(AVMControlFlowGraph& cfg);
+    std::vector<std::set<std::string>> liveIn;
+    std::vector<std::set<std::string>> liveOut;
+};
+
+/*
+ * Where every variable is defined and used, with block indices into basicBlocksInFunction.
+ * In SSA form a value is a local with exactly one definition whose address is never taken;
+ * anything else (parameters, globals, address-taken locals) may change behind a pass's back.
+ * */
+class AVMDefUse {
+public:
+    explicit AVMDefUse(AVMFunction* function);
+    std::unordered_map<std::string, std::vector<std::pair<AVMInstruction*, u32>>> uses;
+    std::unordered_map<std::string, std::pair<AVMInstruction*, u32>> definition;
+    std::unordered_map<std::string, u32> definitionCount;
+    std::set<std::string> addressTaken;
+    bool isSSAValue(const std::string& variable);
+    /*
+     * True if the operand reads the same value wherever it appears: a constant, an SSA value,
+     * or a parameter that is never reassigned.
+     * */
+    bool isStableValue(const std::string& operand);
+    /*
+     * True if the SSA value is always 0 or 1: the result of a comparison, or the and or or of
+     * such values.
+     * */
+    bool isBooleanValue(const std::string& value);
+};
+
+/*
+ * A natural loop: the header and every block that reaches one of its latches (blocks with a
+ * back edge to the header) without passing through the header. Loops sharing a header are merged.
+ * */
+struct AVMLoop {
+    u32 header;
+    std::set<u32> blocks;
+    std::vector<u32> latches;
+    // Blocks outside the loop that are entered from inside it
+    std::vector<u32> exits;
+    // Index of the innermost enclosing loop in AVMLoopInfo::loops, -1 for outermost loops
+    i64 parent = -1;
+    u32 depth = 1;
+};
+
+/*
+ * Natural loops of a function, found from back edges (edges whose target dominates their source).
+ * Loops are ordered innermost first, so a pass walking them in order sees inner loops before
+ * the loops enclosing them.
+ * */
+class AVMLoopInfo {
+public:
+    AVMLoopInfo(AVMControlFlowGraph& cfg, AVMDominatorTree& dominatorTree);
+    std::vector<AVMLoop> loops;
+    /*
+     * The block that enters the loop, if the header has exactly one predecessor outside the loop
+     * and that predecessor branches only to the header, otherwise -1.
+     * */
+    i64 preheader(const AVMLoop& loop);
+private:
+    AVMControlFlowGraph& cfg;
+};
+
+/*
+ * What is known about a value: bits known to be zero or one, and an unsigned range [min, max]
+ * holding it. Default constructed facts know nothing.
+ * */
+struct AVMValueFacts {
+    u64 knownZero = 0;
+    u64 knownOne = 0;
+    u64 min = 0;
+    u64 max = UINT64_MAX;
+    bool isConstant() const { return (knownZero | knownOne) == UINT64_MAX; }
+    bool operator==(const AVMValueFacts& other) const {
+        return knownZero == other.knownZero && knownOne == other.knownOne && min == other.min && max == other.max;
+    }
+};
+
+/*
+ * Known bits and ranges of the SSA values of a function, found by running every definition's
+ * transfer function from a worklist until nothing changes. Passes only ever replace a value with
+ * an equal one, so the facts stay true while a pass rewrites the function.
+ * */
+class AVMValueTracking {
+public:
+    AVMValueTracking(AVMFunction* function, AVMDefUse& defUse);
+    AVMValueFacts facts(const std::string& operand);
+    /*
+     * Result of a comparison, if the facts about its operands decide it.
+     * */
+    std::optional<bool> decideComparison(CMPCode code, const std::string& op1, const std::string& op2);
+private:
+    std::unordered_map<std::string, AVMValueFacts> values;
+};
+
+/*
+ * Memory that an access reads or writes. Globals and locals whose address is taken are variables
+ * in memory, named as they are in operands; an access through a pointer is located by the
+ * variable or restrict parameter its address is derived from, when one is known.
+ * */
+struct AVMMemoryLocation {
+    enum class Base { Variable, RestrictParameter, Unknown };
+    Base base = Base::Unknown;
+    // The variable or parameter the address is derived from
+    std::string name{};
+    // The address operand of a load or store, empty for variables accessed by name
+    std::string address{};
+    // True if the access covers exactly the variable, rather than somewhere derived from its address
+    bool exact = false;
+    // Type accessed, as given by CType::accessTypeAsString; empty if unknown
+    std::string accessType{};
+};
+
+/*
+ * Alias analysis for the memory accesses of a function in SSA form.
+ *
+ * Two locations may alias unless one of these tells them apart:
+ *  - distinct variables never overlap;
+ *  - a local can only be reached through a pointer if its address escapes, that is, is used for
+ *    anything but the address of a load or store, directly or after pointer arithmetic;
+ *  - memory reached through a restrict parameter is only reached through that parameter;
+ *  - accesses to unrelated types do not overlap, except that char accesses may overlap anything.
+ * Calls may read and write any memory but locals whose address does not escape, and a return
+ * reads all memory that outlives the function.
+ * */
+class AVMAliasAnalysis {
+public:
+    AVMAliasAnalysis(AVMFunction* function, AVMDefUse& defUse, const std::vector<Symbol*>& globals);
+    // Location of a load or store
+    AVMMemoryLocation locationOf(AVMInstruction* access);
+    AVMMemoryLocation locationOfVariable(const std::string& variable);
+    // True for globals and for locals whose address is taken
+    bool isMemoryVariable(const std::string& variable);
+    bool isEscaped(const std::string& variable);
+    bool mayAlias(const AVMMemoryLocation& first, const AVMMemoryLocation& second);
+    bool mustAlias(const AVMMemoryLocation& first, const AVMMemoryLocation& second);
+    bool mayRead(AVMInstruction* instruction, const AVMMemoryLocation& location);
+    bool mayWrite(AVMInstruction* instruction, const AVMMemoryLocation& location);
+    // True if the instruction overwrites all of the location
+    bool mustWrite(AVMInstruction* instruction, const AVMMemoryLocation& location);
+private:
+    AVMDefUse& defUse;
+    std::set<std::string> escaped;
+    std::set<std::string> restrictParameters;
+    std::unordered_map<std::string, std::string> variableTypes;
+    AVMMemoryLocation locationOfAddress(const std::string& address, u32 depth);
+    // True if memory at the location may still be reached once the function has returned
+    bool outlivesFunction(const AVMMemoryLocation& location);
+};
@@ -53,6 +53,21 @@ private:
     std::queue<Register> freeRegisters;
     u32 stackSizeForEpilogue = 0;
     bool epilogueUsed = false;
+    // Cleared when the function takes the address of a local, which a sibling call could still read
+    bool siblingCallsAllowed = true;
+    // Number of times each variable is read in the current function
+    std::unordered_map<std::string, u32> useCounts;
+    // Label of the block emitted after the current one, which branches can fall through to
+    std::string nextBlockLabel;
+    // A conditional branch whose test was folded into an instruction before it: the mnemonics branching
+    // when its condition holds and when it does not, with the value and bit they test, if any
+    struct FusedBranch {
+        BranchInstruction* branchInstruction = nullptr;
+        std::string branchIfTrue;
+        std::string branchIfFalse;
+        std::string operand;
+        std::string bit;
+    } fusedBranch;
     std::string Prologue(u32 stackSize);
 
     Register findVariable(std::string);
@@ -63,5 +78,13 @@ private:
 
     void saveVariable(const std::string& identifier);
 
+    void emitComparison(const std::string& mnemonic, ComparisonInstruction* comparisonInstruction, const std::string& suffix);
+
+    void emitSelect(CSELInstruction* selectInstruction, CMPCode code);
+
+    BranchInstruction* findFusableBranch(AVMBasicBlock* basicBlock, u64 x, const std::string& value, const std::string& operand);
+
+    void emitConditionalBranch(BranchInstruction* branchInstruction, const std::string& branchIfTrue, const std::string& branchIfFalse);
+
     std::string Epilogue(u32 stackSize);
 };
\ No newline at end of file
@@ -77,8 +77,10 @@ public:
     DeclaratorPieceType getDPT() final {return dpt;};
     void setConst() {isConst = true;};
     void setVolatile() {isVolatile = true;};
+    void setRestrict() {isRestrict = true;};
     bool isConstPtr() {return isConst;};
     bool isVolatilePtr() {return isVolatile;};
+    bool isRestrictPtr() {return isRestrict;};
     std::string print() override {
         std::string temp;
         temp.append("*");
@@ -86,12 +88,15 @@ public:
             temp.append("const");
         if (isVolatile)
             temp.append("volatile");
+        if (isRestrict)
+            temp.append("restrict");
         return temp;
     }
 private:
     DeclaratorPieceType dpt = PTR;
     bool isConst = false;
     bool isVolatile = false;
+    bool isRestrict = false;
 };
 
 struct CType
@@ -113,9 +118,19 @@ struct CType
     bool isFuncPtr();
     bool isEqual(CType* otherType, bool ptrOrNum);
     bool isStatic();
+    bool isInline();
+    // True if volatile qualifies the type itself or anything it points to
+    bool isVolatile();
+    // True if the type is a pointer declared restrict
+    bool isRestrict();
     CType* dereferenceType();
     CType* refType();
     std::string typeAsString();
+    /*
+     * The type as far as type-based alias analysis is concerned: qualifiers, storage classes and
+     * signedness are dropped, so only accesses to unrelated types are told apart.
+     * */
+    std::string accessTypeAsString();
 
 private:
     bool assignCompat(CType type);
@@ -294,6 +309,7 @@ private:
     ASTNode* conditionalExpression();
     ASTNode* assignmentExpression();
     ASTNode* labelStatement();
+    ASTNode* unrollPragma();
     ASTNode* expression();
     ASTNode* statement();
     ASTNode* constantExpression();
@@ -330,6 +346,8 @@ enum class AVMOpcode {
     ADD,
     SUB,
     MUL,
+    // High 64 bits of the 128-bit unsigned product
+    MULH,
     DIV,
     MOD,
     SLL,
@@ -351,6 +369,7 @@ enum class AVMOpcode {
     CALL,
     // Miscellaneous
     MV,
+    PHI,
     NOP,
     PROGEND
 };
@@ -375,14 +394,19 @@ enum class AVMInstructionType {
     RET,
     MV,
     ALLOCA,
+    PHI,
+    CSEL,
     END
 };
 std::string mapOptoString(AVMOpcode op);
 std::string mapConditionCodetoString(CMPCode code);
 AVMOpcode toAVM(ASTop op);
 bool ASTopIsBinOpAVM(ASTop op);
+u64 performCalculation(AVMOpcode opcode, u64 operand1, u64 operand2);
+bool performComparison(CMPCode code, u64 operand1, u64 operand2);
 class AVMInstruction {
 public:
+    virtual ~AVMInstruction() = default;
     virtual AVMInstructionType getInstructionType() {
         return AVMInstructionType::ARITHMETIC;
     }
@@ -401,9 +425,13 @@ public:
     }
     std::string dest{};
     std::string addrVar{};
+    // Volatile accesses are never removed, merged or moved
+    bool isVolatile = false;
+    // Type read, as given by CType::accessTypeAsString; empty if unknown
+    std::string accessType{};
     std::string print() override {
         std::string temp{};
-        temp.append("ldr ");
+        temp.append(isVolatile ? "ldr.volatile " : "ldr ");
         temp.append(dest);
         temp.append(", ");
         temp.append(addrVar);
@@ -419,9 +447,11 @@ public:
     }
     std::string src{};
     std::string addrVar{};
+    bool isVolatile = false;
+    std::string accessType{};
     std::string print() override {
         std::string temp{};
-        temp.append("str ");
+        temp.append(isVolatile ? "str.volatile " : "str ");
         temp.append(src);
         temp.append(", ");
         temp.append(addrVar);
@@ -521,8 +551,10 @@ public:
     std::vector<std::string> args;
     std::string print() override {
         std::string temp{};
-        temp.append(returnVal);
-        temp.append(" = ");
+        if (!returnVal.empty()) {
+            temp.append(returnVal);
+            temp.append(" = ");
+        }
         temp.append("call ");
         temp.append(funcName);
         temp.append("(");
@@ -612,7 +644,66 @@ public:
 private:
     AVMInstructionType type = AVMInstructionType::ALLOCA;
 };
-class CSELInstruction : public AVMInstruction {};
+/*
+ * Only present while a function is in SSA form, see AVM::constructSSA.
+ * Each incoming pair is the value and the label of the predecessor it flows from.
+ * */
+class PhiInstruction : public AVMInstruction {
+public:
+    AVMInstructionType getInstructionType() override
+    {
+        return type;
+    }
+    std::string dest{};
+    std::vector<std::pair<std::string, std::string>> incoming;
+    std::string print() override
+    {
+        std::string temp{};
+        temp.append("phi ");
+        temp.append(dest);
+        for (auto& i : incoming) {
+            temp.append(", [");
+            temp.append(i.first);
+            temp.append(", ");
+            temp.append(i.second);
+            temp.append("]");
+        }
+        return temp;
+    }
+private:
+    AVMInstructionType type = AVMInstructionType::PHI;
+};
+/*
+ * Conditional select, made by AVM::optConvertIfsToSelects: dest is trueValue if condition is
+ * non-zero and falseValue otherwise, or falseValue + 1 when incrementFalse is set, as ARMv8 csinc.
+ * */
+class CSELInstruction : public AVMInstruction {
+public:
+    AVMInstructionType getInstructionType() override
+    {
+        return type;
+    }
+    std::string dest{};
+    std::string condition{};
+    std::string trueValue{};
+    std::string falseValue{};
+    bool incrementFalse = false;
+    std::string print() override
+    {
+        std::string temp{};
+        temp.append(incrementFalse ? "csinc " : "csel ");
+        temp.append(dest);
+        temp.append(", ");
+        temp.append(condition);
+        temp.append(", ");
+        temp.append(trueValue);
+        temp.append(", ");
+        temp.append(falseValue);
+        return temp;
+    }
+private:
+    AVMInstructionType type = AVMInstructionType::CSEL;
+};
 
 class AVMBasicBlock {
 public:
@@ -642,6 +733,10 @@ public:
     std::vector<AVMInstruction*> poolOfInstructions;
     std::string name;
     FunctionPrototype* prototype = nullptr;
+    bool isStatic = false;
+    bool isInline = false;
+    // Unroll counts requested by #pragma unroll, keyed by the labels of the loop's header blocks
+    std::unordered_map<std::string, u64> unrollPragmas;
 private:
 
 };
@@ -659,6 +754,7 @@ public:
     ASTNode* currentNode = nullptr;
     std::string label = "entry";
     std::string genCode(ASTNode* expr);
+    bool isVolatileAddress(ASTNode* expr);
     std::vector<std::string> genArgs(ASTNode* argNode)
     {
         if (argNode == nullptr)
@@ -689,6 +785,15 @@ public:
         tmpCounter++;
         return tmp;
     }
+    u64 ssaCounter = 0;
+    std::string genSSAName(const std::string& variable) {
+        std::string tmp = "%";
+        tmp.append(variable.at(0) == '%' ? variable.substr(1) : variable);
+        tmp.append("_");
+        tmp.append(std::to_string(ssaCounter));
+        ssaCounter++;
+        return tmp;
+    }
     u64 globalCounter = 0;
     std::string genGlobalDest() {
         std::string tmp = "!label.";
@@ -699,16 +804,59 @@ public:
 
     void startBasicBlockConversion(ASTNode *node);
     std::vector<AVMBasicBlock *> newBasicBlockHandler(ASTNode *node, ASTNode *nextBasicBlock, bool nested);
+    void genBranch(ASTNode *condition, const std::string& trueTarget, const std::string& falseTarget);
 
-    void optMulToShift(AVMBasicBlock* basicBlock);
+    void optMulByConstant(AVMBasicBlock* basicBlock);
 
     void avmOptimiseFunction(AVMFunction* function);
 
-    void optDivToShift(AVMBasicBlock *basicBlock);
+    void avmOptimiseCompilationUnit();
+
+    void optInlineCalls(AVMFunction* function);
+
+    void optEliminateTailRecursion(AVMFunction* function);
+
+    void optSimplifyControlFlow(AVMFunction* function);
+
+    void optDivByConstant(AVMBasicBlock *basicBlock);
 
     void optFoldConstants(AVMBasicBlock *basicBlock);
 
     void optPropagateConstants(AVMFunction *function);
 
     void copyPropagation(AVMFunction *function);
+
+    void optEliminateDeadCode(AVMFunction *function);
+
+    void optGlobalValueNumbering(AVMFunction *function);
+
+    void optCombineInstructions(AVMFunction *function);
+
+    void optEliminateRedundantLoads(AVMFunction *function);
+
+    void optEliminateDeadStores(AVMFunction *function);
+
+    void optConvertIfsToSelects(AVMFunction *function);
+
+    void optCombineBranchConditions(AVMFunction *function);
+
+    bool insertLoopPreheaders(AVMFunction *function);
+
+    void optPromoteGlobalsInLoops(AVMFunction *function);
+
+    void optHoistLoopInvariants(AVMFunction *function);
+
+    void optUnswitchLoops(AVMFunction *function);
+
+    void optRotateLoops(AVMFunction *function);
+
+    void optStrengthReduceInductionVariables(AVMFunction *function);
+
+    // Number of copies of a loop's body made when unrolling, 1 disables unrolling unless a loop asks for it
+    u64 unrollFactor = 4;
+    void optUnrollLoops(AVMFunction *function);
+
+    void constructSSA(AVMFunction *function);
+
+    void destructSSA(AVMFunction *function);
 };
\ No newline at end of file
@@ -97,6 +97,8 @@ enum TokenType
     OPENBRACKETS,
     CLOSEBRACKETS,
     COMMA,
+    // Directives
+    PRAGMA_UNROLL,
     END
 };
 class Token
@@ -132,6 +134,7 @@ private:
     SBCCCode numberLiterals();
     SBCCCode stringLiterals();
     SBCCCode backslash();
+    SBCCCode directive();
     SBCCCode compoundExpressionHandler();
     SBCCCode secondPass();
     std::unordered_map<std::string, TokenType> hashMap = {
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cctype>
 #include <cstdio>
 #include <unordered_map>
@@ -92,6 +93,12 @@ LexerResult* Lexer::lexer()
             case '"':
                 stringLiterals();
                 break;
+            case '#':
+                if (directive()==SBCCCode::GeneralError) {
+                    tokenisedInput->returnCode = SBCCCode::GeneralError;
+                    return tokenisedInput;
+                }
+                break;
             case '[':
                 addToken(OPENBRACKETS, "[");
                 break;
@@ -436,6 +443,51 @@ SBCCCode Lexer::backslash()
     return OK;
 }
 
+/*
+ * Preprocessing directives. The only one understood is "#pragma unroll", optionally followed by
+ * an unroll count as "#pragma unroll(N)" or "#pragma unroll N", which becomes a PRAGMA_UNROLL
+ * token whose lexeme is the count (empty if none was given). Every other directive is skipped.
+ * */
+SBCCCode Lexer::directive()
+{
+    std::string text;
+    while (peek() != '\n' && !file.eof())
+    {
+        text.push_back(advance());
+    }
+    std::vector<std::string> words;
+    std::string word;
+    for (char c : text)
+    {
+        if (std::isalnum(c) || c == '_') {
+            word.push_back(c);
+            continue;
+        }
+        if (!word.empty())
+            words.push_back(word);
+        word.clear();
+        if (c != ' ' && c != '\t' && c != '(' && c != ')')
+            words.emplace_back(1, c);
+    }
+    if (!word.empty())
+        words.push_back(word);
+    if (words.size() < 2 || words[0] != "pragma" || words[1] != "unroll")
+        return OK;
+    if (words.size() > 3 || (words.size() == 3 && !std::all_of(words[2].begin(), words[2].end(), ::isdigit)))
+    {
+        print_error(line, "Malformed #pragma unroll, expected an unroll count");
+        return GeneralError;
+    }
+    // Up to 19 digits always fit in 64 bits
+    if (words.size() == 3 && words[2].size() > 19)
+    {
+        print_error(line, "#pragma unroll count is out of range");
+        return GeneralError;
+    }
+    addToken(PRAGMA_UNROLL, words.size() == 3 ? words[2] : "");
+    return OK;
+}
+
 SBCCCode Lexer::stringLiterals()
 {
     std::string literal;
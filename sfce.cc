@@ -1,4 +1,7 @@
+#include <cctype>
+#include <cerrno>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <errorHandler.hh>
 #include <lexer.hh>
@@ -12,6 +15,9 @@
 void help()
 {
     printf(ANSI_COLOR_BLUE "Usage: sfce [filenames] [target_options] -o [output filename]\n" ANSI_COLOR_RESET);
+    printf("  -O0                  Disable optimisation\n");
+    printf("  -funroll-loops=N     Unroll loops N times when optimising (default 4)\n");
+    printf("  -fno-unroll-loops    Only unroll loops marked with #pragma unroll\n");
 }
 
 void version()
@@ -42,9 +48,23 @@ int main(int argc, const char** argv)
         return 1;
     }
     bool optimise = false;
-    if (argc > 4)
+    u64 unrollFactor = 4;
+    for (int i = 4; i < argc; i++)
     {
-        if (strncmp(argv[4], "-O0", 8) != 0) {
+        if (!strncmp(argv[i], "-funroll-loops=", 15)) {
+            const char* count = argv[i] + 15;
+            char* end = nullptr;
+            errno = 0;
+            unrollFactor = strtoull(count, &end, 10);
+            if (!isdigit(static_cast<unsigned char>(*count)) || *end != '\0' || errno == ERANGE) {
+                print_error("Invalid unroll count given to -funroll-loops, expected a non-negative integer");
+                return 1;
+            }
+        }
+        else if (!strncmp(argv[i], "-fno-unroll-loops", 18)) {
+            unrollFactor = 1;
+        }
+        else if (strncmp(argv[i], "-O0", 8) != 0) {
             optimise = true;
         }
     }
@@ -64,15 +84,14 @@ int main(int argc, const char** argv)
     }
 
     AVM abstractVirtualMachine(parser);
+    abstractVirtualMachine.unrollFactor = unrollFactor;
     for (auto* i: parser.functions)
     {
         abstractVirtualMachine.AVMByteCodeDriver(i);
     }
 
     if (optimise) {
-        for (auto *i: abstractVirtualMachine.compilationUnit) {
-            abstractVirtualMachine.avmOptimiseFunction(i);
-        }
+        abstractVirtualMachine.avmOptimiseCompilationUnit();
     }
 
     CodeGenerator codeGenerator(abstractVirtualMachine, argv[3]);
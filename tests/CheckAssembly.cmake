@@ -0,0 +1,24 @@
+# Compiles SOURCE with SFCE and checks the assembly of FUNCTION against regular expressions:
+# EXPECT must match it and REJECT must not, with COUNT, if given, the number of matches of EXPECT.
+execute_process(COMMAND ${SFCE} ${SOURCE} -o ${OUTPUT} -O1 RESULT_VARIABLE result OUTPUT_QUIET)
+if (NOT result EQUAL 0)
+    message(FATAL_ERROR "sfce failed on ${SOURCE}")
+endif ()
+file(READ ${OUTPUT} assembly)
+# A function runs from its label to the next label at the start of a line that is not a block
+string(REGEX MATCH "\n${FUNCTION}:\n([^\n]*\n)*" body "${assembly}")
+string(REGEX REPLACE "^\n${FUNCTION}:\n" "" body "${body}")
+string(REGEX REPLACE "\n[A-Za-z_][A-Za-z0-9_]*:\n.*$" "\n" body "${body}")
+if (body STREQUAL "")
+    message(FATAL_ERROR "no function ${FUNCTION} in the output")
+endif ()
+if (DEFINED EXPECT)
+    string(REGEX MATCHALL "${EXPECT}" matches "${body}")
+    list(LENGTH matches count)
+    if (count EQUAL 0 OR (DEFINED COUNT AND NOT count EQUAL COUNT))
+        message(FATAL_ERROR "${FUNCTION}: expected ${EXPECT} (${COUNT}), found ${count} in:\n${body}")
+    endif ()
+endif ()
+if (DEFINED REJECT AND body MATCHES "${REJECT}")
+    message(FATAL_ERROR "${FUNCTION}: unexpected ${REJECT} in:\n${body}")
+endif ()
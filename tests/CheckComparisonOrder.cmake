@@ -0,0 +1,16 @@
+# Compiles SOURCE with SFCE and checks that every ccmp in the output reads operands loaded after the
+# comparison before it: loading a later comparison's operands reuses the registers of earlier ones.
+execute_process(COMMAND ${SFCE} ${SOURCE} -o ${OUTPUT} -O1 RESULT_VARIABLE result OUTPUT_QUIET)
+if (NOT result EQUAL 0)
+    message(FATAL_ERROR "sfce failed on ${SOURCE}")
+endif ()
+file(READ ${OUTPUT} assembly)
+string(REGEX MATCHALL "\tccmp " chains "${assembly}")
+list(LENGTH chains count)
+if (NOT count EQUAL ${EXPECTED_CHAINS})
+    message(FATAL_ERROR "expected ${EXPECTED_CHAINS} ccmp instructions, found ${count}")
+endif ()
+string(REGEX MATCHALL "\tc?cmp [^\n]*\n\tccmp [^\n]*" unloaded "${assembly}")
+if (unloaded)
+    message(FATAL_ERROR "ccmp without its own operand loads:\n${unloaded}")
+endif ()
@@ -0,0 +1,15 @@
+# Compiles SOURCE with SFCE and checks that every immediate used to move sp or to address the saved
+# frame pointer and link register can be encoded: add and sub take at most 4095, stp and ldp 504.
+execute_process(COMMAND ${SFCE} ${SOURCE} -o ${OUTPUT} -O1 RESULT_VARIABLE result OUTPUT_QUIET)
+if (NOT result EQUAL 0)
+    message(FATAL_ERROR "sfce failed on ${SOURCE}")
+endif ()
+file(STRINGS ${OUTPUT} lines)
+foreach (line IN LISTS lines)
+    if (line MATCHES "^\t(add|sub) sp, sp, #([0-9]+)" AND CMAKE_MATCH_2 GREATER 4095)
+        message(FATAL_ERROR "sp adjusted by an immediate out of range: ${line}")
+    endif ()
+    if (line MATCHES "^\t(stp|ldp) x29, x30, \\[sp, #(-?[0-9]+)\\]" AND CMAKE_MATCH_2 GREATER 504)
+        message(FATAL_ERROR "frame record addressed by an offset out of range: ${line}")
+    endif ()
+endforeach ()
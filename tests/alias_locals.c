@@ -0,0 +1,18 @@
+int reloadLocal(int* p, int i) {
+    int x = i;
+    int* q = &x;
+    int a = *q;
+    *p = 1;
+    int b = *q;
+    return a + b;
+}
+
+int reloadEscaped(int** e, int* p, int i) {
+    int x = i;
+    int* q = &x;
+    *e = q;
+    int a = *q;
+    *p = 1;
+    int b = *q;
+    return a + b;
+}
@@ -0,0 +1,13 @@
+int reloadRestrict(int* restrict p, int* restrict q) {
+    int a = *p;
+    *q = 1;
+    int b = *p;
+    return a + b;
+}
+
+int reloadAliased(int* p, int* q) {
+    int a = *p;
+    *q = 1;
+    int b = *p;
+    return a + b;
+}
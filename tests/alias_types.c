@@ -0,0 +1,13 @@
+long forwardLong(long* l, int* p) {
+    long a = *l;
+    *p = 1;
+    long b = *l;
+    return a + b;
+}
+
+long reloadAfterChar(long* l, char* c) {
+    long a = *l;
+    *c = 1;
+    long b = *l;
+    return a + b;
+}
@@ -0,0 +1,20 @@
+int andBranch(int a, int b) {
+    if ((a < b) && (b != 3)) {
+        return 1;
+    }
+    return 2;
+}
+int orBranch(int a, int b) {
+    if ((a < b) || (b == 3)) {
+        return 1;
+    }
+    return 2;
+}
+int andValue(int a, int b) {
+    int z = (a > 2) && b;
+    return z;
+}
+int orValue(int a, int b) {
+    int z = (a > 2) || b;
+    return z;
+}
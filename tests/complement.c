@@ -0,0 +1,4 @@
+int complementTwice(int x) {
+    int y = x ^ 18446744073709551615;
+    return y ^ 18446744073709551615;
+}
@@ -0,0 +1,10 @@
+int f(int n) {
+    int s = 0;
+    int i = 0;
+#pragma unroll(400)
+    while (i < n) {
+        s = s + i * 3;
+        i = i + 1;
+    }
+    return s;
+}
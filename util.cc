@@ -13,6 +13,7 @@ std::unordered_map<AVMOpcode, std::string> OpcodeToString {
         {AVMOpcode::ADD, "add"},
         {AVMOpcode::SUB, "sub"},
         {AVMOpcode::MUL, "mul"},
+        {AVMOpcode::MULH, "mulh"},
         {AVMOpcode::DIV, "div"},
         {AVMOpcode::MOD, "mod"},
         {AVMOpcode::SLL, "sll"},